@@ -0,0 +1,438 @@
+#include "Analyze.hpp"
+#include "Config.hpp"
+#include "Git.hpp"
+#include "Lfs.hpp"
+#include "Reader.hpp"
+#include "Svn.hpp"
+#include "Utils.hpp"
+
+#include <apr_strings.h>
+#include <fmt/format.h>
+#include <svn_checksum.h>
+#include <svn_error.h>
+#include <svn_fs.h>
+#include <svn_props.h>
+#include <svn_types.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <expected>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Directories are totalled this many levels deep, e.g. /projects/foo/trunk
+static constexpr size_t kDirectoryDepth = 3;
+// Rows in each table of the report
+static constexpr size_t kReportedGroups = 50;
+static constexpr size_t kReportedFiles = 20;
+static constexpr double kMiB = 1024.0 * 1024.0;
+// Longest svn checksum, SHA-1
+static constexpr size_t kDigestSize = 20;
+static constexpr size_t kMapArenaSize = 16 * 1024;
+
+namespace
+{
+
+/// Totals for the file versions under one extension or directory
+struct GroupStats
+{
+	size_t versions = 0;
+	size_t bytes = 0;
+	size_t binaryVersions = 0;
+	size_t largest = 0;
+
+	void Add(size_t size, bool binary)
+	{
+		versions++;
+		bytes += size;
+		binaryVersions += binary ? 1 : 0;
+		largest = std::max(largest, size);
+	}
+
+	void Merge(const GroupStats& other)
+	{
+		versions += other.versions;
+		bytes += other.bytes;
+		binaryVersions += other.binaryVersions;
+		largest = std::max(largest, other.largest);
+	}
+};
+
+struct FileVersion
+{
+	size_t size = 0;
+	long int revision = 0;
+	std::string path;
+};
+
+/// Contents, by svn checksum. The first byte holds the checksum kind and whether the contents
+/// went to LFS, so the same contents in git and in LFS are counted once each.
+using ContentKey = std::array<unsigned char, 1 + kDigestSize>;
+
+struct ContentKeyHash
+{
+	size_t operator()(const ContentKey& key) const
+	{
+		// Checksums are already uniformly distributed
+		size_t hash = 0;
+		std::memcpy(&hash, key.data() + 1, sizeof(hash));
+		return hash ^ key[0];
+	}
+};
+
+using GroupMap = std::unordered_map<std::string, GroupStats, StringHash, std::equal_to<>>;
+
+struct Stats
+{
+	GroupStats total;
+	GroupStats unmapped;
+	GroupMap extensions;
+	GroupMap directories;
+	/// The largest versions seen, a min heap on size of up to kReportedFiles
+	std::vector<FileVersion> largest;
+
+	size_t gitVersions = 0;
+	size_t lfsVersions = 0;
+	/// Bytes of the LFS pointers written to git in place of the LFS versions
+	size_t pointerBytes = 0;
+	/// Every unique content and its size
+	std::unordered_map<ContentKey, size_t, ContentKeyHash> contents;
+	/// Versions without a stored checksum, which can't be deduplicated
+	size_t uncheckedGitBytes = 0;
+	size_t uncheckedLFSBytes = 0;
+
+	void AddLargest(FileVersion version)
+	{
+		constexpr auto kBySize = [](const FileVersion& a, const FileVersion& b)
+		{ return a.size > b.size; };
+		if (largest.size() == kReportedFiles)
+		{
+			if (version.size <= largest.front().size)
+			{
+				return;
+			}
+			std::ranges::pop_heap(largest, kBySize);
+			largest.pop_back();
+		}
+		largest.push_back(std::move(version));
+		std::ranges::push_heap(largest, kBySize);
+	}
+
+	void Merge(Stats&& other)
+	{
+		total.Merge(other.total);
+		unmapped.Merge(other.unmapped);
+		for (const auto& [name, group] : other.extensions)
+		{
+			extensions[name].Merge(group);
+		}
+		for (const auto& [name, group] : other.directories)
+		{
+			directories[name].Merge(group);
+		}
+		for (FileVersion& version : other.largest)
+		{
+			AddLargest(std::move(version));
+		}
+		gitVersions += other.gitVersions;
+		lfsVersions += other.lfsVersions;
+		pointerBytes += other.pointerBytes;
+		contents.merge(other.contents);
+		uncheckedGitBytes += other.uncheckedGitBytes;
+		uncheckedLFSBytes += other.uncheckedLFSBytes;
+	}
+};
+
+struct Worker
+{
+	explicit Worker(const Config& config) :
+		mapper(config, std::vector<Git::Target>{})
+	{
+	}
+
+	svn::Pool pool;
+	svn_fs_t* fs = nullptr;
+	Git mapper;
+	Stats stats;
+};
+
+// Lower cased, without the dot. Names starting with a dot are not an extension.
+std::string GetExtension(std::string_view path)
+{
+	const std::string_view name = path.substr(path.rfind('/') + 1);
+	const auto dot = name.rfind('.');
+	if (dot == std::string_view::npos || dot == 0)
+	{
+		return "(none)";
+	}
+	std::string extension(name.substr(dot + 1));
+	std::ranges::transform(
+		extension, extension.begin(),
+		[](unsigned char c) { return static_cast<char>(std::tolower(c)); }
+	);
+	return extension;
+}
+
+// The file's directory, cut down to kDirectoryDepth levels
+std::string_view GetDirectory(std::string_view path)
+{
+	size_t end = 0;
+	for (size_t depth = 0; depth < kDirectoryDepth; ++depth)
+	{
+		const auto slash = path.find('/', end + 1);
+		if (slash == std::string_view::npos)
+		{
+			break;
+		}
+		end = slash;
+	}
+	return end == 0 ? "/" : path.substr(0, end);
+}
+
+std::expected<void, std::string>
+AnalyzeRevision(const Config& config, Worker& worker, long int revision, apr_pool_t* pool)
+{
+	svn_fs_root_t* root = nullptr;
+	svn_error_t* err = svn_fs_revision_root(&root, worker.fs, revision, pool);
+	if (err)
+	{
+		return std::unexpected(svn::FormatSvnError(err));
+	}
+
+	svn_fs_path_change_iterator_t* changes = nullptr;
+	err = svn_fs_paths_changed3(&changes, root, pool, pool);
+	if (err)
+	{
+		return std::unexpected(svn::FormatSvnError(err));
+	}
+
+	Stats& stats = worker.stats;
+	std::array<std::byte, kMapArenaSize> arenaBuffer;
+	std::pmr::monotonic_buffer_resource arena(arenaBuffer.data(), arenaBuffer.size());
+	svn::Pool iterPool(pool);
+
+	svn_fs_path_change3_t* change = nullptr;
+	while ((err = svn_fs_path_change_get(&change, changes)) == SVN_NO_ERROR && change)
+	{
+		// Deletes, copies and property changes add no new contents
+		if (change->node_kind != svn_node_file ||
+			change->change_kind == svn_fs_path_change_delete || !change->text_mod)
+		{
+			continue;
+		}
+
+		iterPool.clear();
+		const char* path = apr_pstrmemdup(iterPool, change->path.data, change->path.len);
+
+		svn_filesize_t length = 0;
+		err = svn_fs_file_length(&length, root, path, iterPool);
+		if (err)
+		{
+			return std::unexpected(svn::FormatSvnError(err));
+		}
+		const auto size = static_cast<size_t>(length);
+
+		svn_string_t* mimeType = nullptr;
+		err = svn_fs_node_prop(&mimeType, root, path, SVN_PROP_MIME_TYPE, iterPool);
+		if (err)
+		{
+			return std::unexpected(svn::FormatSvnError(err));
+		}
+		const bool binary = mimeType && svn_mime_type_is_binary(mimeType->data);
+
+		// Older revisions may only have an MD5 stored
+		svn_checksum_t* checksum = nullptr;
+		err = svn_fs_file_checksum(&checksum, svn_checksum_sha1, root, path, false, iterPool);
+		if (!err && !checksum)
+		{
+			err = svn_fs_file_checksum(&checksum, svn_checksum_md5, root, path, false, iterPool);
+		}
+		if (err)
+		{
+			return std::unexpected(svn::FormatSvnError(err));
+		}
+
+		const std::string_view pathView{path, change->path.len};
+		stats.total.Add(size, binary);
+		stats.extensions[GetExtension(pathView)].Add(size, binary);
+		const std::string_view directory = GetDirectory(pathView);
+		auto group = stats.directories.find(directory);
+		if (group == stats.directories.end())
+		{
+			group = stats.directories.try_emplace(std::string(directory)).first;
+		}
+		group->second.Add(size, binary);
+		if (stats.largest.size() < kReportedFiles || size > stats.largest.front().size)
+		{
+			stats.AddLargest({.size = size, .revision = revision, .path = std::string(pathView)});
+		}
+
+		arena.release();
+		const auto mapping = worker.mapper.MapPath(revision, pathView, &arena);
+		if (!mapping || mapping->skip)
+		{
+			stats.unmapped.Add(size, binary);
+			continue;
+		}
+
+		const bool lfs = mapping->lfs ||
+						 (config.lfsSizeThreshold && size >= *config.lfsSizeThreshold) ||
+						 (config.lfsBinary && binary);
+		if (lfs)
+		{
+			stats.lfsVersions++;
+			stats.pointerBytes += LFSPointer(std::string(64, '0'), size).size();
+		}
+		else
+		{
+			stats.gitVersions++;
+		}
+
+		const auto digestSize = checksum ? svn_checksum_size(checksum) : 0;
+		if (digestSize == 0 || digestSize > kDigestSize)
+		{
+			(lfs ? stats.uncheckedLFSBytes : stats.uncheckedGitBytes) += size;
+			continue;
+		}
+		ContentKey key{};
+		key[0] = static_cast<unsigned char>((checksum->kind << 1) | (lfs ? 1 : 0));
+		std::memcpy(key.data() + 1, checksum->digest, digestSize);
+		stats.contents.try_emplace(key, size);
+	}
+	if (err)
+	{
+		return std::unexpected(svn::FormatSvnError(err));
+	}
+	return {};
+}
+
+void FormatGroups(std::string& report, std::string_view title, const GroupMap& groups)
+{
+	std::vector<std::pair<std::string_view, const GroupStats*>> ranked;
+	for (const auto& [name, group] : groups)
+	{
+		ranked.emplace_back(name, &group);
+	}
+	std::ranges::sort(
+		ranked, std::ranges::greater{},
+		[](const auto& entry) { return entry.second->bytes; }
+	);
+
+	auto out = std::back_inserter(report);
+	fmt::format_to(out, "\n{} by bytes ({} in total)\n", title, ranked.size());
+	fmt::format_to(
+		out, "{:>12} {:>12} {:>12} {:>8}  {}\n", "versions", "MiB", "largest MiB", "binary",
+		title
+	);
+	for (const auto& [name, group] : ranked | std::views::take(kReportedGroups))
+	{
+		fmt::format_to(
+			out, "{:>12} {:>12.1f} {:>12.1f} {:>7.0f}%  {}\n", group->versions,
+			static_cast<double>(group->bytes) / kMiB, static_cast<double>(group->largest) / kMiB,
+			100.0 * static_cast<double>(group->binaryVersions) /
+				static_cast<double>(std::max<size_t>(group->versions, 1)),
+			name
+		);
+	}
+}
+
+std::string FormatReport(const Stats& stats, long int first, long int last)
+{
+	size_t gitBytes = stats.pointerBytes + stats.uncheckedGitBytes;
+	size_t lfsBytes = stats.uncheckedLFSBytes;
+	size_t gitContents = 0;
+	size_t lfsObjects = 0;
+	for (const auto& [key, size] : stats.contents)
+	{
+		const bool lfs = (key[0] & 1) != 0;
+		(lfs ? lfsBytes : gitBytes) += size;
+		(lfs ? lfsObjects : gitContents)++;
+	}
+
+	std::string report;
+	auto out = std::back_inserter(report);
+	fmt::format_to(
+		out, "r{} to r{}: {} file versions, {:.1f} MiB\n", first, last, stats.total.versions,
+		static_cast<double>(stats.total.bytes) / kMiB
+	);
+	fmt::format_to(
+		out, "Unmapped by the rules: {} versions, {:.1f} MiB\n", stats.unmapped.versions,
+		static_cast<double>(stats.unmapped.bytes) / kMiB
+	);
+	fmt::format_to(
+		out,
+		"git history: {} versions, {} unique contents, {:.1f} MiB before compression and deltas "
+		"(including {:.1f} MiB of LFS pointers)\n",
+		stats.gitVersions, gitContents, static_cast<double>(gitBytes) / kMiB,
+		static_cast<double>(stats.pointerBytes) / kMiB
+	);
+	fmt::format_to(
+		out, "LFS store: {} versions, {} objects, {:.1f} MiB\n", stats.lfsVersions, lfsObjects,
+		static_cast<double>(lfsBytes) / kMiB
+	);
+
+	FormatGroups(report, "extension", stats.extensions);
+	FormatGroups(report, "directory", stats.directories);
+
+	std::vector<const FileVersion*> largest;
+	for (const FileVersion& version : stats.largest)
+	{
+		largest.push_back(&version);
+	}
+	std::ranges::sort(largest, std::ranges::greater{}, &FileVersion::size);
+	fmt::format_to(out, "\nLargest file versions\n{:>12}  {}\n", "MiB", "path@revision");
+	for (const FileVersion* version : largest)
+	{
+		fmt::format_to(
+			out, "{:>12.1f}  {}@{}\n", static_cast<double>(version->size) / kMiB, version->path,
+			version->revision
+		);
+	}
+	return report;
+}
+
+} // namespace
+
+std::expected<std::string, std::string>
+AnalyzeRepository(const Config& config, long int first, long int last, unsigned int threads)
+{
+	const size_t revisions = last >= first ? static_cast<size_t>(last - first + 1) : 0;
+	auto workers = svn::RunInParallel(
+		config.svnRepo, revisions, threads, "Analyzing",
+		[&] { return std::make_unique<Worker>(config); },
+		[&](Worker& worker, size_t i, svn::Pool& scratch) -> std::expected<void, std::string>
+		{
+			const long int revision = first + static_cast<long int>(i);
+			auto analyzed = AnalyzeRevision(config, worker, revision, scratch);
+			if (!analyzed)
+			{
+				return std::unexpected(
+					fmt::format("Analyzing r{}: {}", revision, analyzed.error())
+				);
+			}
+			return {};
+		}
+	);
+	if (!workers)
+	{
+		return std::unexpected(workers.error());
+	}
+
+	Stats& stats = workers->front()->stats;
+	for (auto& worker : *workers | std::views::drop(1))
+	{
+		stats.Merge(std::move(worker->stats));
+	}
+	return FormatReport(stats, first, last);
+}
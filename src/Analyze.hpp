@@ -0,0 +1,17 @@
+#pragma once
+#include "Config.hpp"
+
+#include <expected>
+#include <string>
+
+/// Scans revisions `first` to `last` of config.svnRepo on `threads` threads and returns a report
+/// for choosing LFS patterns and rules: the bytes, number of versions, largest file and share of
+/// binary versions per extension and per directory, the largest file versions, and how big the
+/// git history and the LFS store would be under `config`.
+///
+/// Only metadata is read: change kinds, file lengths, svn:mime-type and the checksums svn already
+/// stores, never file contents. So "binary" means a binary svn:mime-type, files lfs_binary would
+/// only catch by their contents aren't counted as LFS, and identical contents are recognised by
+/// svn checksum rather than the git or LFS object id.
+std::expected<std::string, std::string>
+AnalyzeRepository(const Config& config, long int first, long int last, unsigned int threads);
@@ -0,0 +1,78 @@
+#include "BranchCache.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Past this many branches, a branch is as good as evicted for any cache worth running with
+static constexpr size_t kMaxFollowedBranches = 4096;
+
+std::optional<size_t> BranchWorkingSet::Distance(std::string_view branch) const
+{
+	const auto found = std::ranges::find(mRecent, branch);
+	if (found == mRecent.end())
+	{
+		return std::nullopt;
+	}
+	return static_cast<size_t>(std::distance(mRecent.begin(), found));
+}
+
+void BranchWorkingSet::Commit(std::string_view branch)
+{
+	mCommits++;
+	const auto distance = Distance(branch);
+	if (!distance)
+	{
+		mMisses++;
+		if (mRecent.size() == kMaxFollowedBranches)
+		{
+			mRecent.pop_back();
+		}
+		mRecent.emplace(mRecent.begin(), branch);
+		return;
+	}
+
+	if (*distance >= mDistances.size())
+	{
+		mDistances.resize(*distance + 1);
+	}
+	mDistances[*distance]++;
+	const auto found = mRecent.begin() + static_cast<std::ptrdiff_t>(*distance);
+	std::rotate(mRecent.begin(), found, std::next(found));
+}
+
+size_t BranchWorkingSet::Switches() const
+{
+	// The first commit has nothing to switch from
+	const size_t repeats = mDistances.empty() ? 0 : mDistances.front();
+	return mCommits - repeats - std::min<size_t>(mCommits, 1);
+}
+
+size_t BranchWorkingSet::Loads(size_t cacheSize) const
+{
+	size_t loads = mMisses;
+	for (size_t distance = cacheSize; distance < mDistances.size(); ++distance)
+	{
+		loads += mDistances[distance];
+	}
+	return loads;
+}
+
+size_t BranchWorkingSet::CacheSizeFor(double share) const
+{
+	const size_t returning = mCommits - mMisses;
+	const auto wanted = static_cast<size_t>(share * static_cast<double>(returning));
+	size_t held = 0;
+	for (size_t distance = 0; distance < mDistances.size(); ++distance)
+	{
+		held += mDistances[distance];
+		if (held >= wanted)
+		{
+			return distance + 1;
+		}
+	}
+	return std::max<size_t>(mDistances.size(), 1);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// fast-import keeps the trees of the `--active-branches` most recently committed to branches in
+/// memory, and has to load a branch's tree from the repository again when committing to one that
+/// has fallen out. This follows the branches committed to in the same least recently used order,
+/// so the commits can be ordered to stay in that cache and the cache can be sized to fit them.
+class BranchWorkingSet
+{
+public:
+	/// fast-import's own default for --active-branches
+	static constexpr size_t kFastImportDefault = 5;
+
+	/// How many branches were committed to since `branch` last was, 0 if it was the last one.
+	/// Unset if it hasn't been committed to, or too long ago to be followed.
+	std::optional<size_t> Distance(std::string_view branch) const;
+
+	void Commit(std::string_view branch);
+
+	size_t Commits() const { return mCommits; }
+
+	/// Commits to a different branch than the commit before
+	size_t Switches() const;
+
+	/// Commits that would have had to load their branch's tree with a cache of `cacheSize`
+	/// branches. A branch's first commit always does.
+	size_t Loads(size_t cacheSize) const;
+
+	/// The smallest cache that would have held the branch of at least `share` of the commits to
+	/// branches committed to before.
+	size_t CacheSizeFor(double share) const;
+
+private:
+	/// Most recently committed to first, limited to kMaxFollowedBranches
+	std::vector<std::string> mRecent;
+	/// Number of commits at each Distance
+	std::vector<size_t> mDistances;
+	/// Commits to a branch not in mRecent
+	size_t mMisses = 0;
+	size_t mCommits = 0;
+};
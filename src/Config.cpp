@@ -6,9 +6,13 @@
 #include <re2/re2.h>
 #include <toml++/toml.h>
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
 #include <expected>
 #include <filesystem>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -40,15 +44,21 @@ std::expected<Config, std::string> Config::Parse(const toml::table& root)
 	result.commitMessage = root["commit_message"].value_or(kDefaultCommitMessage);
 
 	const auto svnRepositoryValue = root["svn_repository"].value<std::string>();
+	const auto svnDumpValue = root["svn_dump"].value<std::string>();
 	const auto gitRepositoryValue = root["git_repository"].value<std::string>();
 
-	if (!svnRepositoryValue)
+	if (!svnRepositoryValue && !svnDumpValue)
 	{
 		return std::unexpected(
-			"ERROR: No SVN repository path, provide a path to a valid on-disk SVN repository."
+			"ERROR: No SVN repository path, provide a path to a valid on-disk SVN repository or an svn_dump file."
 		);
 	}
 
+	if (svnRepositoryValue && svnDumpValue)
+	{
+		return std::unexpected("ERROR: Provide either svn_repository or svn_dump, not both.");
+	}
+
 	if (!gitRepositoryValue)
 	{
 		return std::unexpected(
@@ -56,8 +66,45 @@ std::expected<Config, std::string> Config::Parse(const toml::table& root)
 		);
 	}
 
-	result.svnRepo = *svnRepositoryValue;
-	result.gitRepo = *gitRepositoryValue;
+	result.svnRepo = svnRepositoryValue.value_or("");
+	result.svnDump = svnDumpValue;
+	result.gitRepos.push_back({.name = "", .path = *gitRepositoryValue});
+
+	const toml::table* gitRepositoriesTable = root["git_repositories"].as_table();
+
+	if (gitRepositoriesTable)
+	{
+		// Two fast-import processes writing to one repository would clobber each other
+		const auto normalPath = [](std::string_view path)
+		{
+			std::filesystem::path normal = std::filesystem::absolute(path).lexically_normal();
+			return normal.has_filename() ? normal : normal.parent_path();
+		};
+		for (auto&& [key, value] : *gitRepositoriesTable)
+		{
+			const auto path = value.value<std::string>();
+			if (!path || key.str().empty())
+			{
+				return std::unexpected(
+					fmt::format("ERROR: Git repository {:?} is invalid.", key.str())
+				);
+			}
+			const auto samePath = std::ranges::find_if(
+				result.gitRepos, [&](const GitRepository& other)
+				{ return normalPath(other.path) == normalPath(*path); }
+			);
+			if (samePath != result.gitRepos.end())
+			{
+				return std::unexpected(
+					fmt::format(
+						"ERROR: Git repository {:?} has the same path as {:?}.", key.str(),
+						samePath->name.empty() ? "git_repository" : samePath->name
+					)
+				);
+			}
+			result.gitRepos.push_back({.name = std::string(key.str()), .path = *path});
+		}
+	}
 
 	const toml::table* identityTable = root["identity_map"].as_table();
 
@@ -80,17 +127,48 @@ std::expected<Config, std::string> Config::Parse(const toml::table& root)
 
 	if (branchTable)
 	{
+		// Strings are origins for git_repository, tables are the origins of a named repository
 		for (auto&& [key, value] : *branchTable)
 		{
-			const auto fromValue = value.value<std::string>();
-			if (!fromValue)
+			const toml::table* repositoryTable = value.as_table();
+			if (!repositoryTable)
+			{
+				const auto fromValue = value.value<std::string>();
+				if (!fromValue)
+				{
+					return std::unexpected(
+						fmt::format("ERROR: Branch mapping for {:?} is invalid.", key.str())
+					);
+				}
+				// TODO: Add validators
+				result.gitRepos.front().branchOrigins[std::string(key.str())] = *fromValue;
+				continue;
+			}
+
+			const auto found = std::ranges::find(result.gitRepos, key.str(), &GitRepository::name);
+			if (key.str().empty() || found == result.gitRepos.end())
 			{
 				return std::unexpected(
-					fmt::format("ERROR: Branch mapping for {:?} is invalid.", key.str())
+					fmt::format(
+						"ERROR: [branch_origin.{}] is not a repository defined in [git_repositories].",
+						key.str()
+					)
 				);
 			}
-			// TODO: Add validators
-			result.branchMap[std::string(key.str())] = *fromValue;
+			for (auto&& [branch, from] : *repositoryTable)
+			{
+				const auto fromValue = from.value<std::string>();
+				if (!fromValue)
+				{
+					return std::unexpected(
+						fmt::format(
+							"ERROR: Branch mapping for {:?} in [branch_origin.{}] is invalid.",
+							branch.str(), key.str()
+						)
+					);
+				}
+				found->branchOrigins[std::string(branch.str())] = *fromValue;
+			}
 		}
 	}
 
@@ -112,6 +190,22 @@ std::expected<Config, std::string> Config::Parse(const toml::table& root)
 		}
 	}
 
+	result.lfsBinary = root["lfs_binary"].value_or(kDefaultLfsBinary);
+	if (const auto lfsStore = root["lfs_store"].value<std::string>())
+	{
+		result.lfsStore = *lfsStore;
+	}
+
+	if (root.contains("lfs_size_threshold"))
+	{
+		const auto threshold = root["lfs_size_threshold"].value<std::int64_t>();
+		if (!threshold || *threshold <= 0)
+		{
+			return std::unexpected("ERROR: lfs_size_threshold must be a positive number of bytes.");
+		}
+		result.lfsSizeThreshold = static_cast<size_t>(*threshold);
+	}
+
 	const toml::array* rulesConfig = root["rule"].as_array();
 
 	if (!rulesConfig)
@@ -145,8 +239,36 @@ std::expected<Config, std::string> Config::Parse(const toml::table& root)
 		const auto minRev = table["min_revision"].value<long int>();
 		const auto maxRev = table["max_revision"].value<long int>();
 
+		const bool tag = table["tag"].value_or(false);
+		if (tag && ignore)
+		{
+			return std::unexpected(
+				fmt::format(
+					"ERROR: The tag rule for {:?} needs a branch to name the tag.", *svnPath
+				)
+			);
+		}
+
+		size_t gitRepo = 0;
+		if (const auto repositoryName = table["repository"].value<std::string_view>())
+		{
+			const auto found =
+				std::ranges::find(result.gitRepos, *repositoryName, &GitRepository::name);
+			if (repositoryName->empty() || found == result.gitRepos.end())
+			{
+				return std::unexpected(
+					fmt::format(
+						"ERROR: The rule for {:?} uses the repository {:?}, which is not defined in [git_repositories].",
+						*svnPath, *repositoryName
+					)
+				);
+			}
+			gitRepo = static_cast<size_t>(std::distance(result.gitRepos.begin(), found));
+		}
+
 		result.rules.emplace_back(
-			ignore, std::make_unique<RE2>(*svnPath), branch.value_or(""), gitPath, minRev, maxRev
+			ignore, std::make_unique<RE2>(*svnPath), branch.value_or(""), gitPath, minRev, maxRev,
+			gitRepo, tag
 		);
 	}
 
@@ -161,7 +283,14 @@ std::expected<Config, std::string> Config::Parse(const toml::table& root)
 
 std::expected<void, std::string> Config::IsValid() const
 {
-	if (!std::filesystem::is_directory(svnRepo))
+	if (svnDump && *svnDump != "-" && !std::filesystem::is_regular_file(*svnDump))
+	{
+		return std::unexpected(
+			fmt::format("ERROR: Dump file {:?} is not a file that can be found.", *svnDump)
+		);
+	}
+
+	if (!svnDump && !std::filesystem::is_directory(svnRepo))
 	{
 		return std::unexpected(
 			fmt::format(
@@ -210,15 +339,19 @@ std::expected<void, std::string> Config::IsValid() const
 		);
 	}
 
-	try
-	{
-		date::locate_zone(timezone);
-	}
-	catch (const std::exception& e)
+	// Loading the time zone database takes longer than the rest of startup, so UTC skips it
+	if (!IsUtcTimeZone())
 	{
-		return std::unexpected(
-			fmt::format("ERROR: Timezone {:?} is not valid. {}", timezone, e.what())
-		);
+		try
+		{
+			date::locate_zone(timezone);
+		}
+		catch (const std::exception& e)
+		{
+			return std::unexpected(
+				fmt::format("ERROR: Timezone {:?} is not valid. {}", timezone, e.what())
+			);
+		}
 	}
 
 	if (!domain)
@@ -258,3 +391,9 @@ std::expected<void, std::string> Config::IsValid() const
 	}
 	return {};
 }
+
+bool Config::IsUtcTimeZone() const
+{
+	return timezone == "Etc/UTC" || timezone == "UTC" || timezone == "Etc/Zulu" ||
+		   timezone == "Zulu";
+}
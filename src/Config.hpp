@@ -2,7 +2,9 @@
 #include <re2/re2.h>
 #include <toml++/toml.h>
 
+#include <cstddef>
 #include <expected>
+#include <filesystem>
 #include <memory>
 #include <optional>
 #include <string>
@@ -25,6 +27,22 @@ struct Rule
 	std::optional<long int> minRevision;
 	/// Maximum revision the rule applies to.
 	std::optional<long int> maxRevision;
+	/// Index into Config::gitRepos of the repository to write to.
+	size_t gitRepo = 0;
+	/// gitBranch names a tag. An unmodified copy of a branch becomes a git tag pointing at the
+	/// copied commit, and only becomes a branch if it is changed afterwards.
+	bool tag = false;
+};
+
+/// A git repository written to by the conversion.
+struct GitRepository
+{
+	/// Name rules use to select the repository, empty for the default git_repository.
+	std::string name;
+	std::string path;
+	/// Which commit new branches start from, per branch. Marks (":1234") are only known to the
+	/// repository the revision was written to, so each repository has its own.
+	std::unordered_map<std::string, std::string> branchOrigins;
 };
 
 struct Config
@@ -32,7 +50,8 @@ struct Config
 	Config() :
 		strictMode(kDefaultStrictMode),
 		timezone(kDefaultTimeZone),
-		commitMessage(kDefaultCommitMessage)
+		commitMessage(kDefaultCommitMessage),
+		lfsBinary(kDefaultLfsBinary)
 	{
 	}
 
@@ -40,21 +59,34 @@ struct Config
 
 	std::expected<void, std::string> IsValid() const;
 
+	/// Whether timezone is UTC, which needs no time zone database to apply.
+	bool IsUtcTimeZone() const;
+
 	bool strictMode;
 	std::string svnRepo;
-	std::string gitRepo;
+	/// Read revisions from an `svnadmin dump` file ("-" for stdin) instead of svnRepo.
+	std::optional<std::string> svnDump;
+	/// git_repository first, followed by any named [git_repositories]. All of them are written in
+	/// the same pass over the SVN history.
+	std::vector<GitRepository> gitRepos;
 	std::optional<std::string> domain;
 	std::string timezone;
 	std::string commitMessage;
 	std::vector<Rule> rules;
 	std::vector<std::string> lfsWildmatches;
+	/// Files at least this many bytes go to LFS, even if no wildmatch matches them.
+	std::optional<size_t> lfsSizeThreshold;
+	/// Files with a binary svn:mime-type, or that look binary, go to LFS.
+	bool lfsBinary;
+	/// LFS object directory shared by every repository (and conversion) that uses it.
+	std::optional<std::filesystem::path> lfsStore;
 	std::unordered_map<std::string, std::string> identityMap;
-	std::unordered_map<std::string, std::string> branchMap;
 
 private:
 	static std::expected<Config, std::string> Parse(const toml::table& root);
 
 	static constexpr bool kDefaultStrictMode = false;
+	static constexpr bool kDefaultLfsBinary = false;
 	static constexpr std::string_view kDefaultTimeZone = "Etc/UTC";
 	static constexpr std::string_view kDefaultCommitMessage =
 		"{log}\n\nThis commit was converted from r{rev} by svn-lfs-export.";
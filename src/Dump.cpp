@@ -0,0 +1,1064 @@
+#include "Dump.hpp"
+#include "Svn.hpp"
+#include "Utils.hpp"
+
+#include <apr_hash.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+#include <svn_delta.h>
+#include <svn_error.h>
+#include <svn_error_codes.h>
+#include <svn_io.h>
+#include <svn_props.h>
+#include <svn_repos.h>
+#include <svn_string.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace svn
+{
+
+// Dump paths are relative to the repository root, but the converter (and the user's rules) use
+// the leading '/' that svn_fs gives.
+static std::string AbsolutePath(std::string_view path)
+{
+	if (path.starts_with('/'))
+	{
+		return std::string(path);
+	}
+	return fmt::format("/{}", path);
+}
+
+static std::string ChildPrefix(std::string_view path)
+{
+	return path == "/" ? std::string(path) : fmt::format("{}/", path);
+}
+
+static std::optional<long int> ParseRevision(const char* value)
+{
+	if (!value)
+	{
+		return std::nullopt;
+	}
+	long int rev = 0;
+	const char* end = value + std::strlen(value);
+	if (std::from_chars(value, end, rev).ec != std::errc{})
+	{
+		return std::nullopt;
+	}
+	return rev;
+}
+
+static svn_error_t* MalformedError(const std::string& message)
+{
+	return svn_error_create(SVN_ERR_STREAM_MALFORMED_DATA, nullptr, message.c_str());
+}
+
+// The tree of the spool as of the last revision a run converted, inside the spool directory
+static constexpr std::string_view kIndexPath = "index";
+
+// Bits of a version's flags in the index
+static constexpr unsigned int kDeletedFlag = 1;
+static constexpr unsigned int kDirectoryFlag = 2;
+static constexpr unsigned int kExecutableFlag = 4;
+static constexpr unsigned int kSymlinkFlag = 8;
+static constexpr unsigned int kBinaryFlag = 16;
+
+static std::expected<void, std::string> CreateShards(const std::filesystem::path& spoolDirectory)
+{
+	// Spread the spooled texts over 256 directories so no single directory gets huge
+	std::error_code err;
+	for (unsigned int shard = 0; shard < 256; ++shard)
+	{
+		std::filesystem::create_directories(spoolDirectory / fmt::format("{:02x}", shard), err);
+		if (err)
+		{
+			return std::unexpected(
+				fmt::format(
+					"Could not create dump spool directory {:?}: {}", spoolDirectory.c_str(),
+					err.message()
+				)
+			);
+		}
+	}
+	return {};
+}
+
+std::expected<std::unique_ptr<DumpSource>, std::string> DumpSource::Open(
+	const std::string& dumpPath, std::filesystem::path spoolDirectory, bool pruneTexts
+)
+{
+	if (dumpPath != "-" && !std::filesystem::is_regular_file(dumpPath))
+	{
+		return std::unexpected(fmt::format("Dump file {:?} could not be found", dumpPath));
+	}
+
+	std::unique_ptr<DumpSource> source(new DumpSource());
+	source->mDumpPath = dumpPath;
+	source->mSpoolDirectory = std::move(spoolDirectory);
+	source->mPruneTexts = pruneTexts;
+
+	auto created = CreateShards(source->mSpoolDirectory);
+	if (!created)
+	{
+		return std::unexpected(created.error());
+	}
+
+	return source;
+}
+
+std::filesystem::path DumpSource::ContentPath(std::uint64_t contentId) const
+{
+	return mSpoolDirectory / fmt::format("{:02x}", contentId & 0xff) / std::to_string(contentId);
+}
+
+std::expected<void, std::string> DumpSource::ResetSpool()
+{
+	mTree.clear();
+	mReferences.clear();
+	mUnreferenced.clear();
+	mPrunable.clear();
+	mNextContentId = 1;
+
+	std::error_code err;
+	std::filesystem::remove_all(mSpoolDirectory, err);
+	if (err)
+	{
+		return std::unexpected(
+			fmt::format(
+				"Could not clear dump spool directory {:?}: {}", mSpoolDirectory.c_str(),
+				err.message()
+			)
+		);
+	}
+	return CreateShards(mSpoolDirectory);
+}
+
+std::expected<bool, std::string> DumpSource::ReadIndex(long int resumeAfter)
+{
+	const std::filesystem::path path = mSpoolDirectory / kIndexPath;
+	std::ifstream file{path};
+	if (!file)
+	{
+		return false;
+	}
+
+	const auto invalid = [&]
+	{ return std::unexpected(fmt::format("Dump spool index {:?} is invalid", path.c_str())); };
+
+	const auto parseVersion = [](std::string_view line) -> std::optional<NodeVersion>
+	{
+		NodeVersion version;
+		unsigned int flags = 0;
+		const char* position = line.data();
+		const char* end = line.data() + line.size();
+		const auto next = [&](auto& value)
+		{
+			auto [stop, error] = std::from_chars(position, end, value);
+			position = stop == end ? end : stop + 1;
+			return error == std::errc{};
+		};
+		if (!next(version.rev) || !next(flags) || !next(version.contentId) || !next(version.size))
+		{
+			return std::nullopt;
+		}
+		version.deleted = (flags & kDeletedFlag) != 0;
+		version.isDirectory = (flags & kDirectoryFlag) != 0;
+		version.isExecutable = (flags & kExecutableFlag) != 0;
+		version.isSymlink = (flags & kSymlinkFlag) != 0;
+		version.isBinary = (flags & kBinaryFlag) != 0;
+		return version;
+	};
+
+	// A header, then each path followed by its versions
+	std::optional<long int> revision;
+	bool usable = true;
+	std::vector<NodeVersion>* versions = nullptr;
+	std::string line;
+	while (usable && std::getline(file, line))
+	{
+		const auto space = line.find(' ');
+		const std::string_view kind = std::string_view(line).substr(0, space);
+		const std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+		if (kind == "path")
+		{
+			versions = &mTree[value];
+		}
+		else if (versions)
+		{
+			auto version = parseVersion(line);
+			if (!version)
+			{
+				return invalid();
+			}
+			versions->push_back(*version);
+		}
+		else if (kind == "identity")
+		{
+			// Only checked against the dump once its first revision is read
+			mSpoolIdentity = value;
+		}
+		else if (kind == "texts")
+		{
+			// Texts a pruned spool dropped can't be brought back
+			usable = value == (mPruneTexts ? "prune" : "keep");
+		}
+		else if (kind == "revision")
+		{
+			revision = ParseRevision(value.c_str());
+			if (!revision)
+			{
+				return invalid();
+			}
+			// The tree can't be wound back to an earlier revision
+			usable = *revision <= resumeAfter;
+		}
+		else if (kind == "next")
+		{
+			auto [end, error] =
+				std::from_chars(value.data(), value.data() + value.size(), mNextContentId);
+			if (error != std::errc{})
+			{
+				return invalid();
+			}
+		}
+		else
+		{
+			return invalid();
+		}
+	}
+
+	if (!usable)
+	{
+		mTree.clear();
+		return false;
+	}
+	if (!revision || !mSpoolIdentity)
+	{
+		return invalid();
+	}
+
+	CountReferences();
+	mSkipThrough = *revision;
+	mAcceptedRevision = *revision;
+	return true;
+}
+
+std::expected<void, std::string> DumpSource::WriteIndex()
+{
+	const std::filesystem::path path = mSpoolDirectory / kIndexPath;
+	const std::filesystem::path temporary = mSpoolDirectory / fmt::format("{}.tmp", kIndexPath);
+
+	std::ofstream file{temporary, std::ios::trunc};
+	fmt::print(
+		file, "identity {}\ntexts {}\nrevision {}\nnext {}\n", *mIdentity,
+		mPruneTexts ? "prune" : "keep", *mAcceptedRevision, mNextContentId
+	);
+	for (const auto& [nodePath, versions] : mTree)
+	{
+		fmt::print(file, "path {}\n", nodePath);
+		for (const NodeVersion& version : versions)
+		{
+			const unsigned int flags = (version.deleted ? kDeletedFlag : 0) |
+									   (version.isDirectory ? kDirectoryFlag : 0) |
+									   (version.isExecutable ? kExecutableFlag : 0) |
+									   (version.isSymlink ? kSymlinkFlag : 0) |
+									   (version.isBinary ? kBinaryFlag : 0);
+			fmt::print(
+				file, "{} {} {} {}\n", version.rev, flags, version.contentId, version.size
+			);
+		}
+	}
+	file.close();
+	if (!file)
+	{
+		return std::unexpected(
+			fmt::format("Could not write dump spool index {:?}", temporary.c_str())
+		);
+	}
+
+	// Replaced in one step, so an interrupted write leaves no index rather than half of one
+	std::error_code err;
+	std::filesystem::rename(temporary, path, err);
+	if (err)
+	{
+		return std::unexpected(
+			fmt::format(
+				"Could not write dump spool index {:?}: {}", path.c_str(), err.message()
+			)
+		);
+	}
+	return {};
+}
+
+static const auto* VersionAt(const auto& versions, long int rev)
+{
+	// Versions are recorded in revision order
+	auto it = std::ranges::upper_bound(versions, rev, {}, [](const auto& v) { return v.rev; });
+	return it == versions.begin() ? nullptr : &*std::prev(it);
+}
+
+const DumpSource::NodeVersion* DumpSource::Lookup(std::string_view path, long int rev) const
+{
+	auto it = mTree.find(path);
+	if (it == mTree.end())
+	{
+		return nullptr;
+	}
+	return VersionAt(it->second, rev);
+}
+
+std::expected<void, std::string>
+DumpSource::CheckSpooled(const NodeVersion& version, std::string_view path, long int rev) const
+{
+	if (!mPruneTexts || version.contentId == 0 || mReferences.contains(version.contentId))
+	{
+		return {};
+	}
+	return std::unexpected(
+		fmt::format(
+			"{}@{} is copied after its text was pruned from the dump spool, convert without "
+			"--prune-dump-texts to keep every text",
+			path, rev
+		)
+	);
+}
+
+void DumpSource::Retain(std::uint64_t contentId)
+{
+	if (contentId != 0)
+	{
+		mReferences[contentId]++;
+	}
+}
+
+void DumpSource::Release(std::uint64_t contentId)
+{
+	auto it = mReferences.find(contentId);
+	if (it != mReferences.end() && --it->second == 0 && mPruneTexts)
+	{
+		mUnreferenced.push_back(contentId);
+	}
+}
+
+void DumpSource::SetLatest(std::vector<NodeVersion>& versions, const NodeVersion& version)
+{
+	Retain(version.contentId);
+	if (!versions.empty())
+	{
+		Release(versions.back().contentId);
+	}
+
+	// A path can be touched more than once in one revision (e.g. replaced, or copied with its
+	// parent then modified), only the final state is needed.
+	if (!versions.empty() && versions.back().rev == version.rev)
+	{
+		versions.back() = version;
+	}
+	else
+	{
+		versions.push_back(version);
+	}
+}
+
+void DumpSource::CountReferences()
+{
+	mReferences.clear();
+	for (const auto& [path, versions] : mTree)
+	{
+		if (!versions.empty())
+		{
+			Retain(versions.back().contentId);
+		}
+	}
+}
+
+void DumpSource::PruneTexts()
+{
+	for (const std::uint64_t contentId : mPrunable)
+	{
+		auto it = mReferences.find(contentId);
+		if (it == mReferences.end() || it->second != 0)
+		{
+			continue;
+		}
+		mReferences.erase(it);
+		std::error_code err;
+		std::filesystem::remove(ContentPath(contentId), err);
+	}
+	mPrunable = std::exchange(mUnreferenced, {});
+}
+
+void DumpSource::AcceptRevision(long int rev)
+{
+	mAcceptedRevision = rev;
+	mRevisionTexts.clear();
+	if (mPruneTexts)
+	{
+		PruneTexts();
+	}
+}
+
+void DumpSource::DropRevisionsAfter(long int rev)
+{
+	for (auto it = mTree.begin(); it != mTree.end();)
+	{
+		std::vector<NodeVersion>& versions = it->second;
+		while (!versions.empty() && versions.back().rev > rev)
+		{
+			versions.pop_back();
+		}
+		it = versions.empty() ? mTree.erase(it) : std::next(it);
+	}
+
+	// Texts the dropped revisions spooled, and any nothing refers to, aren't needed any more
+	std::vector<std::uint64_t> candidates = std::exchange(mRevisionTexts, {});
+	if (mPruneTexts)
+	{
+		candidates.insert(candidates.end(), mUnreferenced.begin(), mUnreferenced.end());
+		candidates.insert(candidates.end(), mPrunable.begin(), mPrunable.end());
+		mUnreferenced.clear();
+		mPrunable.clear();
+	}
+
+	CountReferences();
+	for (const std::uint64_t contentId : candidates)
+	{
+		if (!mReferences.contains(contentId))
+		{
+			std::error_code err;
+			std::filesystem::remove(ContentPath(contentId), err);
+		}
+	}
+}
+
+void DumpSource::Record(const std::string& path, const NodeVersion& version)
+{
+	SetLatest(mTree[path], version);
+}
+
+void DumpSource::DeleteTree(const std::string& path, long int rev)
+{
+	const NodeVersion deleted{.rev = rev, .deleted = true};
+
+	if (const NodeVersion* current = Lookup(path, rev); current && !current->deleted)
+	{
+		Record(path, deleted);
+	}
+
+	const std::string prefix = ChildPrefix(path);
+	for (auto it = mTree.lower_bound(prefix); it != mTree.end() && it->first.starts_with(prefix);
+		 ++it)
+	{
+		std::vector<NodeVersion>& versions = it->second;
+		if (!versions.empty() && !versions.back().deleted)
+		{
+			SetLatest(versions, deleted);
+		}
+	}
+}
+
+std::expected<void, std::string>
+DumpSource::CopyTree(const File::CopyFrom& source, const std::string& path, long int rev)
+{
+	const std::string sourcePrefix = ChildPrefix(source.path);
+	const std::string targetPrefix = ChildPrefix(path);
+
+	// Collect first, the target may sort inside the range being iterated
+	std::vector<std::pair<std::string, NodeVersion>> children;
+	for (auto it = mTree.lower_bound(sourcePrefix);
+		 it != mTree.end() && it->first.starts_with(sourcePrefix); ++it)
+	{
+		const NodeVersion* version = VersionAt(it->second, source.rev);
+		if (!version || version->deleted)
+		{
+			continue;
+		}
+		auto spooled = CheckSpooled(*version, it->first, source.rev);
+		if (!spooled)
+		{
+			return spooled;
+		}
+		NodeVersion child = *version;
+		child.rev = rev;
+		children.emplace_back(targetPrefix + it->first.substr(sourcePrefix.size()), child);
+	}
+
+	for (const auto& [childPath, child] : children)
+	{
+		Record(childPath, child);
+		if (!child.isDirectory)
+		{
+			AddFile(childPath, child, File::Change::Add);
+		}
+	}
+	return {};
+}
+
+void DumpSource::AddFile(
+	std::string_view path, const NodeVersion& version, File::Change change,
+	const std::optional<File::CopyFrom>& copiedFrom
+)
+{
+	Revision& revision = *mRevision;
+
+	File file;
+	file.path = {apr_pstrmemdup(revision.mRevisionPool, path.data(), path.size()), path.size()};
+	file.isDirectory = version.isDirectory;
+	file.changeType = change;
+	file.mDumpSource = this;
+
+	if (change != File::Change::Delete)
+	{
+		file.isExecutable = version.isExecutable;
+		file.isSymlink = version.isSymlink;
+		file.isBinary = version.isBinary;
+		file.size = version.size;
+		file.mContentId = version.contentId;
+		file.copiedFrom = copiedFrom;
+	}
+
+	revision.mFiles.push_back(file);
+}
+
+std::expected<void, std::string> DumpSource::CloseNode()
+{
+	Node& node = *mNode;
+	const long int rev = mRevision->mRevNum;
+
+	if (node.hasNewText)
+	{
+		std::error_code err;
+		const auto size = std::filesystem::file_size(ContentPath(node.version.contentId), err);
+		if (err)
+		{
+			return std::unexpected(
+				fmt::format("Could not read spooled text of {} in r{}", node.path, rev)
+			);
+		}
+		node.version.size = static_cast<size_t>(size);
+	}
+
+	if (node.change == File::Change::Delete)
+	{
+		DeleteTree(node.path, rev);
+		AddFile(node.path, node.version, node.change);
+		return {};
+	}
+
+	if (node.change == File::Change::Replace)
+	{
+		DeleteTree(node.path, rev);
+	}
+
+	Record(node.path, node.version);
+	AddFile(node.path, node.version, node.change, node.copiedFrom);
+
+	if (node.copiedFrom && node.version.isDirectory)
+	{
+		return CopyTree(*node.copiedFrom, node.path, rev);
+	}
+
+	return {};
+}
+
+std::expected<std::unique_ptr<char[]>, std::string>
+DumpSource::ReadContents(std::uint64_t contentId, size_t size) const
+{
+	const std::filesystem::path path = ContentPath(contentId);
+	std::ifstream file{path, std::ios::binary};
+
+	auto buffer = std::make_unique<char[]>(size);
+	file.read(buffer.get(), static_cast<std::streamsize>(size));
+	if (static_cast<size_t>(file.gcount()) != size)
+	{
+		return std::unexpected(
+			fmt::format(
+				"Short read of spooled text {:?}: expected {} bytes, got {}", path.c_str(), size,
+				file.gcount()
+			)
+		);
+	}
+
+	return buffer;
+}
+
+std::expected<void, std::string>
+DumpSource::Parse(const RevisionCallback& callback, long int resumeAfter)
+{
+	mSkipThrough = -1;
+	mAcceptedRevision.reset();
+	mIdentity.reset();
+	mSpoolIdentity.reset();
+	auto resumed = ReadIndex(resumeAfter);
+	if (!resumed)
+	{
+		return std::unexpected(resumed.error());
+	}
+	if (*resumed)
+	{
+		// Only valid until texts are spooled or pruned again
+		std::error_code removeErr;
+		std::filesystem::remove(mSpoolDirectory / kIndexPath, removeErr);
+		Log("Carrying on from the dump spool at r{}", mSkipThrough);
+	}
+	else
+	{
+		auto reset = ResetSpool();
+		if (!reset)
+		{
+			return std::unexpected(reset.error());
+		}
+	}
+
+	Pool pool;
+	svn_error_t* err = nullptr;
+
+	svn_stream_t* stream = nullptr;
+	if (mDumpPath == "-")
+	{
+		err = svn_stream_for_stdin2(&stream, true, pool);
+	}
+	else
+	{
+		err = svn_stream_open_readonly(&stream, mDumpPath.c_str(), pool, pool);
+	}
+	if (err)
+	{
+		return std::unexpected(FormatSvnError(err));
+	}
+
+	svn_repos_parse_fns3_t parser{};
+	parser.magic_header_record = OnMagicHeader;
+	parser.uuid_record = OnUuid;
+	parser.new_revision_record = OnNewRevision;
+	parser.new_node_record = OnNewNode;
+	parser.set_revision_property = OnSetRevisionProperty;
+	parser.set_node_property = OnSetNodeProperty;
+	parser.delete_node_property = OnDeleteNodeProperty;
+	parser.remove_node_props = OnRemoveNodeProperties;
+	parser.set_fulltext = OnSetFulltext;
+	parser.apply_textdelta = OnApplyTextDelta;
+	parser.close_node = OnCloseNode;
+	parser.close_revision = OnCloseRevision;
+
+	mCallback = &callback;
+	mError.reset();
+	err = svn_repos_parse_dumpstream3(stream, &parser, this, false, nullptr, nullptr, pool);
+	mCallback = nullptr;
+	mNode.reset();
+	mRevision.reset();
+
+	// Leave the spool as of the last revision that was taken, for the next run to carry on from
+	if (mAcceptedRevision && mIdentity)
+	{
+		DropRevisionsAfter(*mAcceptedRevision);
+		auto written = WriteIndex();
+		if (!written)
+		{
+			Log("WARNING: {}, the next run will spool the dump again", written.error());
+		}
+	}
+
+	// Stopping early (on purpose or because of a conversion error) is signalled with
+	// SVN_ERR_CEASE_INVOCATION through the parser
+	if (err && svn_error_find_cause(err, SVN_ERR_CEASE_INVOCATION))
+	{
+		svn_error_clear(err);
+		err = nullptr;
+	}
+	if (mError)
+	{
+		svn_error_clear(err);
+		return std::unexpected(*mError);
+	}
+	if (err)
+	{
+		return std::unexpected(FormatSvnError(err));
+	}
+	return {};
+}
+
+svn_error_t* DumpSource::OnMagicHeader(int /*version*/, void* /*parseBaton*/, apr_pool_t* /*pool*/)
+{
+	return SVN_NO_ERROR;
+}
+
+svn_error_t* DumpSource::OnUuid(const char* uuid, void* parseBaton, apr_pool_t* /*pool*/)
+{
+	auto* self = static_cast<DumpSource*>(parseBaton);
+	self->mUuid = uuid;
+	return SVN_NO_ERROR;
+}
+
+std::expected<void, std::string> DumpSource::IdentifyDump()
+{
+	if (mIdentity)
+	{
+		return {};
+	}
+
+	// The repository's UUID and the first revision's number and date tell dumps apart, even when
+	// they're read from stdin
+	mIdentity = fmt::format("{} r{} {}", mUuid, mRevision->mRevNum, mRevision->mDate);
+	if (mSpoolIdentity && *mSpoolIdentity != *mIdentity)
+	{
+		// Nothing has been skipped yet, so the dump can still be spooled from the start
+		Log("The dump spool was left by a different dump, spooling it again");
+		mSkipThrough = -1;
+		mAcceptedRevision.reset();
+		auto reset = ResetSpool();
+		if (!reset)
+		{
+			return reset;
+		}
+	}
+	mSpoolIdentity.reset();
+	return {};
+}
+
+svn_error_t* DumpSource::OnNewRevision(
+	void** revisionBaton, apr_hash_t* headers, void* parseBaton, apr_pool_t* /*pool*/
+)
+{
+	auto* self = static_cast<DumpSource*>(parseBaton);
+
+	const auto rev = ParseRevision(static_cast<const char*>(
+		apr_hash_get(headers, SVN_REPOS_DUMPFILE_REVISION_NUMBER, APR_HASH_KEY_STRING)
+	));
+	if (!rev)
+	{
+		return MalformedError("Revision record without a valid Revision-number");
+	}
+
+	static constexpr const char* kEpoch = "1970-01-01T00:00:00Z";
+	self->mRevision = Revision(*rev);
+	self->mRevision->mDate = kEpoch;
+
+	*revisionBaton = self;
+	return SVN_NO_ERROR;
+}
+
+svn_error_t*
+DumpSource::OnNewNode(void** nodeBaton, apr_hash_t* headers, void* revisionBaton, apr_pool_t* pool)
+{
+	auto* self = static_cast<DumpSource*>(revisionBaton);
+	const long int rev = self->mRevision->mRevNum;
+
+	if (auto identified = self->IdentifyDump(); !identified)
+	{
+		self->mError = identified.error();
+		return svn_error_create(SVN_ERR_CEASE_INVOCATION, nullptr, nullptr);
+	}
+
+	// The spool already has the revision, its nodes only need reading past
+	if (rev <= self->mSkipThrough)
+	{
+		*nodeBaton = self;
+		return SVN_NO_ERROR;
+	}
+
+	auto header = [&](const char* key)
+	{ return static_cast<const char*>(apr_hash_get(headers, key, APR_HASH_KEY_STRING)); };
+
+	const char* path = header(SVN_REPOS_DUMPFILE_NODE_PATH);
+	const char* action = header(SVN_REPOS_DUMPFILE_NODE_ACTION);
+	const char* kind = header(SVN_REPOS_DUMPFILE_NODE_KIND);
+	const char* copyFromPath = header(SVN_REPOS_DUMPFILE_NODE_COPYFROM_PATH);
+	const auto copyFromRev = ParseRevision(header(SVN_REPOS_DUMPFILE_NODE_COPYFROM_REV));
+
+	if (!path || !action)
+	{
+		return MalformedError(fmt::format("Node record in r{} without a path or action", rev));
+	}
+
+	Node node;
+	node.path = AbsolutePath(path);
+	node.pool = pool;
+
+	const std::string_view actionName{action};
+	if (actionName == "change")
+	{
+		node.change = File::Change::Modify;
+	}
+	else if (actionName == "add")
+	{
+		node.change = File::Change::Add;
+	}
+	else if (actionName == "delete")
+	{
+		node.change = File::Change::Delete;
+	}
+	else if (actionName == "replace")
+	{
+		node.change = File::Change::Replace;
+	}
+	else
+	{
+		return MalformedError(fmt::format("Unknown node action {:?} for {}", action, node.path));
+	}
+
+	const NodeVersion* previous = self->Lookup(node.path, rev);
+	const bool existed = previous && !previous->deleted;
+
+	if (node.change != File::Change::Delete && copyFromPath && copyFromRev)
+	{
+		const std::string source = AbsolutePath(copyFromPath);
+		const NodeVersion* sourceVersion = self->Lookup(source, *copyFromRev);
+		if (!sourceVersion || sourceVersion->deleted)
+		{
+			return MalformedError(
+				fmt::format(
+					"Copy source {}@{} of {} does not exist", source, *copyFromRev, node.path
+				)
+			);
+		}
+		node.copiedFrom = File::CopyFrom{
+			.path = apr_pstrmemdup(self->mRevision->mRevisionPool, source.data(), source.size()),
+			.rev = *copyFromRev
+		};
+		if (auto spooled = self->CheckSpooled(*sourceVersion, source, *copyFromRev); !spooled)
+		{
+			return MalformedError(spooled.error());
+		}
+		// Copies inherit the source's text and properties until told otherwise
+		node.version = *sourceVersion;
+	}
+	else if ((node.change == File::Change::Modify || node.change == File::Change::Delete) &&
+			 existed)
+	{
+		node.version = *previous;
+	}
+
+	node.version.rev = rev;
+	node.version.deleted = false;
+	if (kind)
+	{
+		node.version.isDirectory = std::string_view{kind} == "dir";
+	}
+
+	self->mNode = std::move(node);
+	*nodeBaton = self;
+	return SVN_NO_ERROR;
+}
+
+svn_error_t*
+DumpSource::OnSetRevisionProperty(void* revisionBaton, const char* name, const svn_string_t* value)
+{
+	auto* self = static_cast<DumpSource*>(revisionBaton);
+	const std::string_view propName{name};
+	const std::string propValue{value->data, value->len};
+
+	if (propName == SVN_PROP_REVISION_AUTHOR)
+	{
+		self->mRevision->mAuthor = propValue;
+	}
+	else if (propName == SVN_PROP_REVISION_LOG)
+	{
+		self->mRevision->mLog = propValue;
+	}
+	else if (propName == SVN_PROP_REVISION_DATE)
+	{
+		self->mRevision->mDate = propValue;
+	}
+	return SVN_NO_ERROR;
+}
+
+svn_error_t*
+DumpSource::OnSetNodeProperty(void* nodeBaton, const char* name, const svn_string_t* value)
+{
+	auto* self = static_cast<DumpSource*>(nodeBaton);
+	if (!self->mNode)
+	{
+		return SVN_NO_ERROR;
+	}
+	NodeVersion& version = self->mNode->version;
+	const std::string_view propName{name};
+
+	if (propName == SVN_PROP_EXECUTABLE)
+	{
+		version.isExecutable = true;
+	}
+	else if (propName == SVN_PROP_MIME_TYPE)
+	{
+		version.isBinary = svn_mime_type_is_binary(value->data);
+	}
+	else if (propName == SVN_PROP_SPECIAL)
+	{
+		version.isSymlink = true;
+	}
+	else if (propName == SVN_PROP_EXTERNALS)
+	{
+		Log("WARNING: svn external {:?} in {} is not supported in git", value->data,
+			self->mNode->path);
+	}
+	return SVN_NO_ERROR;
+}
+
+svn_error_t* DumpSource::OnDeleteNodeProperty(void* nodeBaton, const char* name)
+{
+	auto* self = static_cast<DumpSource*>(nodeBaton);
+	if (!self->mNode)
+	{
+		return SVN_NO_ERROR;
+	}
+	NodeVersion& version = self->mNode->version;
+	const std::string_view propName{name};
+
+	if (propName == SVN_PROP_EXECUTABLE)
+	{
+		version.isExecutable = false;
+	}
+	else if (propName == SVN_PROP_MIME_TYPE)
+	{
+		version.isBinary = false;
+	}
+	else if (propName == SVN_PROP_SPECIAL)
+	{
+		version.isSymlink = false;
+	}
+	return SVN_NO_ERROR;
+}
+
+svn_error_t* DumpSource::OnRemoveNodeProperties(void* nodeBaton)
+{
+	auto* self = static_cast<DumpSource*>(nodeBaton);
+	if (!self->mNode)
+	{
+		return SVN_NO_ERROR;
+	}
+	NodeVersion& version = self->mNode->version;
+	version.isExecutable = false;
+	version.isBinary = false;
+	version.isSymlink = false;
+	return SVN_NO_ERROR;
+}
+
+svn_error_t* DumpSource::OnSetFulltext(svn_stream_t** stream, void* nodeBaton)
+{
+	auto* self = static_cast<DumpSource*>(nodeBaton);
+	if (!self->mNode)
+	{
+		// The parser reads past the text
+		*stream = nullptr;
+		return SVN_NO_ERROR;
+	}
+	Node& node = *self->mNode;
+
+	node.version.contentId = self->mNextContentId++;
+	node.hasNewText = true;
+	self->mRevisionTexts.push_back(node.version.contentId);
+
+	const std::filesystem::path target = self->ContentPath(node.version.contentId);
+	return svn_stream_open_writable(stream, target.c_str(), node.pool, node.pool);
+}
+
+svn_error_t* DumpSource::OnApplyTextDelta(
+	svn_txdelta_window_handler_t* handler, void** handlerBaton, void* nodeBaton
+)
+{
+	auto* self = static_cast<DumpSource*>(nodeBaton);
+	if (!self->mNode)
+	{
+		// The parser reads past the delta
+		*handler = nullptr;
+		*handlerBaton = nullptr;
+		return SVN_NO_ERROR;
+	}
+	Node& node = *self->mNode;
+
+	// Deltas are against the node's previous text, or the copy source's text, which is what
+	// OnNewNode seeded the version with
+	svn_stream_t* base = nullptr;
+	if (node.version.contentId == 0)
+	{
+		base = svn_stream_empty(node.pool);
+	}
+	else
+	{
+		const std::filesystem::path basePath = self->ContentPath(node.version.contentId);
+		SVN_ERR(svn_stream_open_readonly(&base, basePath.c_str(), node.pool, node.pool));
+	}
+
+	node.version.contentId = self->mNextContentId++;
+	node.hasNewText = true;
+	self->mRevisionTexts.push_back(node.version.contentId);
+
+	svn_stream_t* target = nullptr;
+	const std::filesystem::path targetPath = self->ContentPath(node.version.contentId);
+	SVN_ERR(svn_stream_open_writable(&target, targetPath.c_str(), node.pool, node.pool));
+
+	svn_txdelta_apply(base, target, nullptr, node.path.c_str(), node.pool, handler, handlerBaton);
+	return SVN_NO_ERROR;
+}
+
+svn_error_t* DumpSource::OnCloseNode(void* nodeBaton)
+{
+	auto* self = static_cast<DumpSource*>(nodeBaton);
+	if (!self->mNode)
+	{
+		return SVN_NO_ERROR;
+	}
+	auto result = self->CloseNode();
+	self->mNode.reset();
+	if (!result)
+	{
+		return MalformedError(result.error());
+	}
+	return SVN_NO_ERROR;
+}
+
+svn_error_t* DumpSource::OnCloseRevision(void* revisionBaton)
+{
+	auto* self = static_cast<DumpSource*>(revisionBaton);
+	const long int rev = self->mRevision->mRevNum;
+
+	if (auto identified = self->IdentifyDump(); !identified)
+	{
+		self->mError = identified.error();
+		self->mRevision.reset();
+		return svn_error_create(SVN_ERR_CEASE_INVOCATION, nullptr, nullptr);
+	}
+
+	// r0 only ever carries revision properties, and skipped revisions were converted before
+	if (rev == 0 || rev <= self->mSkipThrough)
+	{
+		self->mRevision.reset();
+		return SVN_NO_ERROR;
+	}
+
+	auto result = (*self->mCallback)(*self->mRevision);
+	self->mRevision.reset();
+
+	if (!result)
+	{
+		self->mError = result.error();
+		return svn_error_create(SVN_ERR_CEASE_INVOCATION, nullptr, nullptr);
+	}
+	if (!*result)
+	{
+		return svn_error_create(SVN_ERR_CEASE_INVOCATION, nullptr, nullptr);
+	}
+	self->AcceptRevision(rev);
+	return SVN_NO_ERROR;
+}
+
+} // namespace svn
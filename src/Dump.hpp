@@ -0,0 +1,170 @@
+#pragma once
+#include "Svn.hpp"
+
+#include <apr_hash.h>
+#include <apr_pools.h>
+#include <svn_delta.h>
+#include <svn_io.h>
+#include <svn_repos.h>
+#include <svn_string.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace svn
+{
+
+/// Reads revisions straight from an `svnadmin dump` stream (plain or deltified) in one sequential
+/// pass, without loading it into a repository first. Produces the same Revision/File model as
+/// Repository, so the converter doesn't know the difference.
+///
+/// A dump only describes what changed, so to resolve directory copies, deltas and inherited
+/// properties the source keeps a history of every node, and spools the file texts to disk.
+/// Contents are read back from the spool on demand. Optionally, a text is dropped from the spool
+/// once no path refers to it any more.
+///
+/// The spool is kept between runs, with an index of the tree as of the last revision the
+/// callback accepted, so a resumed conversion of the same dump doesn't have to spool it again.
+class DumpSource
+{
+public:
+	/// Return false to stop parsing early, without an error.
+	using RevisionCallback = std::function<std::expected<bool, std::string>(const Revision&)>;
+
+	/// `dumpPath` may be "-" to read from stdin, e.g. when decompressing with another tool. File
+	/// texts are spooled into `spoolDirectory`. With `pruneTexts`, texts no path refers to any more
+	/// are deleted, which fails on dumps that copy files from revisions they have changed since.
+	static std::expected<std::unique_ptr<DumpSource>, std::string>
+	Open(const std::string& dumpPath, std::filesystem::path spoolDirectory, bool pruneTexts);
+
+	DumpSource(const DumpSource&) = delete;
+	DumpSource& operator=(const DumpSource&) = delete;
+	DumpSource(DumpSource&&) = delete;
+	DumpSource& operator=(DumpSource&&) = delete;
+
+	/// Parse the whole stream, calling `callback` as each revision is completed. Revisions up to
+	/// `resumeAfter` are only needed for the state of the tree, so if the spool was left by an
+	/// earlier run at or before it, the revisions it has are skipped without being passed on.
+	std::expected<void, std::string>
+	Parse(const RevisionCallback& callback, long int resumeAfter);
+
+	std::expected<std::unique_ptr<char[]>, std::string>
+	ReadContents(std::uint64_t contentId, size_t size) const;
+
+private:
+	DumpSource() = default;
+
+	/// The state of a path as of one revision
+	struct NodeVersion
+	{
+		long int rev = 0;
+		bool deleted = false;
+		bool isDirectory = false;
+		bool isExecutable = false;
+		bool isSymlink = false;
+		bool isBinary = false;
+		/// 0 for empty (or no) contents
+		std::uint64_t contentId = 0;
+		size_t size = 0;
+	};
+
+	struct Node
+	{
+		std::string path;
+		File::Change change = File::Change::Add;
+		std::optional<File::CopyFrom> copiedFrom;
+		NodeVersion version;
+		bool hasNewText = false;
+		apr_pool_t* pool = nullptr;
+	};
+
+	std::filesystem::path ContentPath(std::uint64_t contentId) const;
+	std::expected<void, std::string> ResetSpool();
+	std::expected<bool, std::string> ReadIndex(long int resumeAfter);
+	std::expected<void, std::string> WriteIndex();
+	std::expected<void, std::string> IdentifyDump();
+	const NodeVersion* Lookup(std::string_view path, long int rev) const;
+	std::expected<void, std::string>
+	CheckSpooled(const NodeVersion& version, std::string_view path, long int rev) const;
+	void Retain(std::uint64_t contentId);
+	void Release(std::uint64_t contentId);
+	void SetLatest(std::vector<NodeVersion>& versions, const NodeVersion& version);
+	void CountReferences();
+	void PruneTexts();
+	void DropRevisionsAfter(long int rev);
+	void AcceptRevision(long int rev);
+	void Record(const std::string& path, const NodeVersion& version);
+	void DeleteTree(const std::string& path, long int rev);
+	std::expected<void, std::string>
+	CopyTree(const File::CopyFrom& source, const std::string& path, long int rev);
+	void AddFile(
+		std::string_view path, const NodeVersion& version, File::Change change,
+		const std::optional<File::CopyFrom>& copiedFrom = std::nullopt
+	);
+	std::expected<void, std::string> CloseNode();
+
+	static svn_error_t* OnMagicHeader(int version, void* parseBaton, apr_pool_t* pool);
+	static svn_error_t* OnUuid(const char* uuid, void* parseBaton, apr_pool_t* pool);
+	static svn_error_t* OnNewRevision(
+		void** revisionBaton, apr_hash_t* headers, void* parseBaton, apr_pool_t* pool
+	);
+	static svn_error_t*
+	OnNewNode(void** nodeBaton, apr_hash_t* headers, void* revisionBaton, apr_pool_t* pool);
+	static svn_error_t*
+	OnSetRevisionProperty(void* revisionBaton, const char* name, const svn_string_t* value);
+	static svn_error_t*
+	OnSetNodeProperty(void* nodeBaton, const char* name, const svn_string_t* value);
+	static svn_error_t* OnDeleteNodeProperty(void* nodeBaton, const char* name);
+	static svn_error_t* OnRemoveNodeProperties(void* nodeBaton);
+	static svn_error_t* OnSetFulltext(svn_stream_t** stream, void* nodeBaton);
+	static svn_error_t* OnApplyTextDelta(
+		svn_txdelta_window_handler_t* handler, void** handlerBaton, void* nodeBaton
+	);
+	static svn_error_t* OnCloseNode(void* nodeBaton);
+	static svn_error_t* OnCloseRevision(void* revisionBaton);
+
+	std::string mDumpPath;
+	std::filesystem::path mSpoolDirectory;
+	bool mPruneTexts = false;
+	std::string mUuid;
+	/// Set once the dump's first revision is read
+	std::optional<std::string> mIdentity;
+	/// The identity of the dump the loaded index was written for, until it's checked
+	std::optional<std::string> mSpoolIdentity;
+	std::uint64_t mNextContentId = 1;
+
+	std::map<std::string, std::vector<NodeVersion>, std::less<>> mTree;
+
+	/// How many paths' latest version refers to each spooled text. Texts are erased when they are
+	/// pruned, so a text missing from here is no longer on disk.
+	std::unordered_map<std::uint64_t, size_t> mReferences;
+	/// Texts that lost their last reference in this revision, and in the revision before. They are
+	/// only pruned a revision late, so the last revision can still be dropped from the index.
+	std::vector<std::uint64_t> mUnreferenced;
+	std::vector<std::uint64_t> mPrunable;
+	/// Texts spooled in this revision
+	std::vector<std::uint64_t> mRevisionTexts;
+	/// Revisions the spool already has, which are skipped
+	long int mSkipThrough = -1;
+	/// The last revision the callback accepted, which the index is written for
+	std::optional<long int> mAcceptedRevision;
+
+	std::optional<Revision> mRevision;
+	/// Unset while reading past the nodes of a skipped revision
+	std::optional<Node> mNode;
+
+	const RevisionCallback* mCallback = nullptr;
+	std::optional<std::string> mError;
+};
+
+} // namespace svn
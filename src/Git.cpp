@@ -1,5 +1,7 @@
 #include "Config.hpp"
 #include "Git.hpp"
+#include "Lfs.hpp"
+#include "Reader.hpp"
 #include "Svn.hpp"
 #include "Utils.hpp"
 #include "Writer.hpp"
@@ -14,17 +16,28 @@
 #include <re2/re2.h>
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <chrono>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
+#include <exception>
 #include <expected>
 #include <filesystem>
+#include <iterator>
+#include <limits>
+#include <memory_resource>
+#include <numeric>
 #include <optional>
+#include <ranges>
+#include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <tuple>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 // Use internal wildmatch.c implementation from libgit2
@@ -35,6 +48,26 @@ static constexpr unsigned int kWmPathname = 2;
 // WM_MATCH
 static constexpr int kWmMatch = 0;
 
+// Initial stack buffer for the per revision arena in WriteCommit
+static constexpr size_t kRevisionArenaSize = 64 * 1024;
+
+// git's own binary check only looks for a NUL byte in the first 8000 bytes
+static constexpr size_t kBinaryCheckSize = 8000;
+
+// Starts the section of .gitattributes listing paths routed to LFS by size or content
+static constexpr std::string_view kRoutedAttributesHeader =
+	"# Stored in LFS by lfs_size_threshold or lfs_binary\n";
+static constexpr std::string_view kLFSAttributes = " filter=lfs diff=lfs merge=lfs -text";
+// Stands in for whitespace in escaped attribute paths
+static constexpr std::string_view kAttributesSpace = "[[:space:]]";
+
+// Distinct unmapped paths kept while profiling rules, and how many of them are reported
+static constexpr size_t kMaxProfiledPaths = 100000;
+static constexpr size_t kMaxReportedPaths = 100;
+
+// Rule ranges are only worked out to this many characters, longer paths fall inside them
+static constexpr int kRuleRangeLength = 256;
+
 enum class Mode
 {
 	Normal = 100644,
@@ -68,18 +101,106 @@ std::string Git::GetCommitMessage(const std::string& log, const std::string& use
 	);
 }
 
-std::string Git::GetGitAttributesContent()
+// Attribute lines can't hold a newline, and a tab would be read back as the space matched by
+// kAttributesSpace, so paths with either aren't routed to LFS.
+static bool CanListInAttributes(std::string_view path)
+{
+	return path.find_first_of("\n\t") == std::string_view::npos;
+}
+
+// Escape a literal path as a gitattributes pattern. Attribute lines are split on whitespace,
+// so spaces are matched with a character class instead.
+static std::string EscapeAttributesPath(std::string_view path)
+{
+	std::string escaped;
+	for (const char c : path)
+	{
+		if (c == ' ')
+		{
+			escaped.append(kAttributesSpace);
+			continue;
+		}
+		if (c == '*' || c == '?' || c == '[' || c == '\\')
+		{
+			escaped.push_back('\\');
+		}
+		escaped.push_back(c);
+	}
+	return escaped;
+}
+
+std::string Git::GetGitAttributesContent(size_t repository, std::string_view branch)
 {
 	std::string attributes;
 
 	for (const std::string& rule : mConfig.lfsWildmatches)
 	{
-		attributes.append(fmt::format("{} filter=lfs diff=lfs merge=lfs -text\n", rule));
+		attributes.append(fmt::format("{}{}\n", rule, kLFSAttributes));
+	}
+
+	const auto& routedPaths = mTargets[repository].lfsRoutedPaths;
+	const auto routed = routedPaths.find(branch);
+	if (routed != routedPaths.end() && !routed->second.empty())
+	{
+		attributes.append(kRoutedAttributesHeader);
+		for (const std::string& path : routed->second)
+		{
+			// Anchored with '/' so only this exact path matches
+			attributes.append(fmt::format("/{}{}\n", EscapeAttributesPath(path), kLFSAttributes));
+		}
 	}
 	return attributes;
 }
 
-std::string Git::GetTime(const std::string& svnTime)
+std::vector<std::string> Git::ParseRoutedPaths(std::string_view attributes)
+{
+	std::vector<std::string> paths;
+
+	const auto header = attributes.find(kRoutedAttributesHeader);
+	if (header == std::string_view::npos)
+	{
+		return paths;
+	}
+	attributes.remove_prefix(header + kRoutedAttributesHeader.size());
+
+	while (!attributes.empty())
+	{
+		const auto lineEnd = attributes.find('\n');
+		std::string_view line = attributes.substr(0, lineEnd);
+		attributes.remove_prefix(
+			lineEnd == std::string_view::npos ? attributes.size() : lineEnd + 1
+		);
+
+		if (!line.starts_with('/') || !line.ends_with(kLFSAttributes))
+		{
+			continue;
+		}
+		line.remove_prefix(1);
+		line.remove_suffix(kLFSAttributes.size());
+
+		std::string path;
+		for (size_t i = 0; i < line.size(); ++i)
+		{
+			if (line.substr(i).starts_with(kAttributesSpace))
+			{
+				path.push_back(' ');
+				i += kAttributesSpace.size() - 1;
+			}
+			else if (line[i] == '\\' && i + 1 < line.size())
+			{
+				path.push_back(line[++i]);
+			}
+			else
+			{
+				path.push_back(line[i]);
+			}
+		}
+		paths.push_back(std::move(path));
+	}
+	return paths;
+}
+
+std::expected<std::string, std::string> Git::GetTime(const std::string& svnTime)
 {
 	// It looks like SVN stores dates in UTC time
 	// https://svn.haxx.se/users/archive-2003-09/0322.shtml
@@ -93,15 +214,35 @@ std::string Git::GetTime(const std::string& svnTime)
 
 	auto unixEpoch = utcTime.time_since_epoch().count();
 
-	const date::time_zone* serverTimezone = date::get_tzdb().locate_zone(mConfig.timezone);
+	if (mConfig.IsUtcTimeZone())
+	{
+		return fmt::format("{} +0000", unixEpoch);
+	}
 
-	date::zoned_time<std::chrono::seconds> zonedTime{serverTimezone, utcTime};
+	// The database is loaded on first use, so only runs that need it pay for it
+	if (!mTimeZone)
+	{
+		try
+		{
+			mTimeZone = date::get_tzdb().locate_zone(mConfig.timezone);
+		}
+		catch (const std::exception& e)
+		{
+			return std::unexpected(
+				fmt::format("Timezone {:?} is not valid. {}", mConfig.timezone, e.what())
+			);
+		}
+	}
+
+	date::zoned_time<std::chrono::seconds> zonedTime{mTimeZone, utcTime};
 	std::string formattedOffset = date::format("%z", zonedTime);
 
 	return fmt::format("{} {}", unixEpoch, formattedOffset);
 }
 
-std::string Git::WriteLFSFile(const std::string_view input)
+std::expected<std::string, std::string> Git::WriteLFSFile(
+	size_t repository, const std::string_view input, const std::string_view sha256
+)
 {
 	if (input.empty())
 	{
@@ -109,15 +250,47 @@ std::string Git::WriteLFSFile(const std::string_view input)
 		return "";
 	}
 
-	std::string hash = picosha2::hash256_hex_string(input.begin(), input.end());
-	std::filesystem::path path =
-		"lfs/objects/" + hash.substr(0, 2) + "/" + hash.substr(2, 2) + "/" + hash;
+	// Reader threads may have already hashed the contents
+	std::string hash(sha256);
+	if (hash.empty())
+	{
+		hash = picosha2::hash256_hex_string(input.begin(), input.end());
+	}
 
-	mWriter.WriteToGitDirectory(path, input);
+	auto written = mTargets[repository].writer->WriteLFSObject(hash, input);
+	if (!written)
+	{
+		return std::unexpected(written.error());
+	}
 
-	return fmt::format(
-		"version https://git-lfs.github.com/spec/v1\noid sha256:{}\nsize {}\n", hash, input.size()
+	return LFSPointer(hash, input.size());
+}
+
+std::expected<std::string, std::string> Git::DeferLFSFile(
+	size_t repository, const std::string_view input, const std::string_view sha256,
+	const svn::File& source, long int rev
+)
+{
+	if (input.empty())
+	{
+		return "";
+	}
+
+	std::string hash(sha256);
+	if (hash.empty())
+	{
+		hash = picosha2::hash256_hex_string(input.begin(), input.end());
+	}
+
+	auto listed = mTargets[repository].writer->AppendToGitDirectory(
+		kLFSManifestPath, fmt::format("{} {} {} {}\n", hash, input.size(), rev, source.path)
 	);
+	if (!listed)
+	{
+		return std::unexpected(listed.error());
+	}
+
+	return LFSPointer(hash, input.size());
 }
 
 std::string Git::ConvertSymlink(std::string_view svnSymlink)
@@ -129,9 +302,10 @@ std::string Git::ConvertSymlink(std::string_view svnSymlink)
 	return output;
 }
 
-std::optional<std::string> Git::GetBranchOrigin(const std::string& branch)
+std::optional<std::string> Git::GetBranchOrigin(size_t repository, std::string_view branch)
 {
-	const bool seenBranch = mSeenBranches.contains(branch);
+	Target& target = mTargets[repository];
+	const bool seenBranch = target.seenBranches.contains(branch);
 
 	if (seenBranch)
 	{
@@ -139,55 +313,93 @@ std::optional<std::string> Git::GetBranchOrigin(const std::string& branch)
 		return std::string("");
 	}
 
-	if (mFirstCommit && mStartingState.isRepoEmpty)
+	if (target.firstCommit && target.startingState.isRepoEmpty)
 	{
 		// Omit the `from`, this is the first commit to a new repository
 		// so create a commit with no ancestor.
 		return std::string("");
 	}
 
-	if (std::ranges::contains(mStartingState.existingBranches, branch))
+	const auto tag = target.tags.find(branch);
+	if (tag != target.tags.end())
+	{
+		// A tag that is committed to carries on as a branch from the commit it points at
+		return fmt::format("from {}\n", tag->second);
+	}
+
+	// Re-exported branches are written again from their first revision, not continued
+	if (!target.onlyBranches && IsExistingBranch(target, branch))
 	{
 		// Load from disk with ^0
 		return fmt::format("from refs/heads/{}^0\n", branch);
 	}
 
-	if (mConfig.branchMap.contains(branch))
+	// A tag written by an earlier run is continued from the commit it points at, like above
+	const StartingState& state = target.startingState;
+	if (!target.onlyBranches && state.tagExists && state.tagExists(branch))
+	{
+		return fmt::format("from refs/tags/{}^0\n", branch);
+	}
+
+	const auto& origins = mConfig.gitRepos[repository].branchOrigins;
+	const auto origin = origins.find(std::string(branch));
+	if (origin != origins.end())
 	{
 		// Delete contents of new branch, so it's clean like svn
-		const std::string fromLocation = mConfig.branchMap.at(branch);
-		return fmt::format("from {}\ndeleteall\n", fromLocation);
+		return fmt::format("from {}\ndeleteall\n", origin->second);
+	}
+
+	if (target.onlyBranches)
+	{
+		// Without an origin, the branch began with no ancestor the first time too
+		return std::string("");
 	}
 
 	// Unknown branch origin
 	return std::nullopt;
 }
 
-std::optional<Git::Mapping> Git::MapPath(const long int rev, const std::string_view& path)
+// Copy a string into the arena, NUL terminated so it can be passed to C APIs
+static std::string_view ArenaCopy(std::pmr::memory_resource* arena, std::string_view value)
+{
+	auto* data = static_cast<char*>(arena->allocate(value.size() + 1, alignof(char)));
+	std::ranges::copy(value, data);
+	data[value.size()] = '\0';
+	return {data, value.size()};
+}
+
+std::optional<Git::Mapping> Git::MapPath(
+	const long int rev, const std::string_view& path, std::pmr::memory_resource* arena
+)
 {
 	const std::vector<Rule>& rules = mConfig.rules;
+	const bool profiling = !mRuleProfile.empty();
 
-	for (const Rule& rule : rules)
+	for (size_t ruleIndex = 0; ruleIndex < rules.size(); ++ruleIndex)
 	{
+		const Rule& rule = rules[ruleIndex];
+		RuleProfile* profile = profiling ? &mRuleProfile[ruleIndex] : nullptr;
+
 		// Given a RULE, takes an INPUT REVISION and INPUT SVN PATH
 		// 1. If not MIN REVISION <= INPUT REVISION <= MAX REVISION continue
 		//    to next rule
 		// 2. If not INPUT SVN PATH starts with and matches against
 		//    RULE SVN PATH continue, recording any non-captured suffix
-		// 3. If no REPOSITORY, ignore path, break and skip all other rules
-		// 4. Rewrite GIT REPO with substitutions from SVN PATH match
+		// 3. If no BRANCH, ignore path, break and skip all other rules
+		// 4. Output to the rule's GIT REPO (git_repository unless the rule names one)
 		// 5. Rewrite BRANCH with substitutions from SVN PATH match
 		// 6. Rewrite GIT PATH with substitutions from SVN PATH match
 		// 7. Append GIT PATH with the non-captured suffix
 		// 8. Check if GIT PATH full matches with a rule in LFS RULES
 		// 9. Output GIT REPO, GIT BRANCH, a GIT PATH, and if LFS
 
-		if (rule.minRevision && *rule.minRevision > rev)
-		{
-			continue;
-		}
-		if (rule.maxRevision && *rule.maxRevision < rev)
+		if ((rule.minRevision && *rule.minRevision > rev) ||
+			(rule.maxRevision && *rule.maxRevision < rev))
 		{
+			if (profile)
+			{
+				profile->outsideRevisions++;
+			}
 			continue;
 		}
 
@@ -195,29 +407,42 @@ std::optional<Git::Mapping> Git::MapPath(const long int rev, const std::string_v
 		// Regex must be valid so the capture group number is always >= 0
 		auto containerSize = static_cast<size_t>(capturesGroups);
 
-		std::vector<std::string_view> capturesStrings(containerSize);
-
-		std::vector<RE2::Arg> args(containerSize);
-		std::vector<RE2::Arg*> argPtrs(containerSize);
+		// Slot 0 is reserved for the whole capture so the \0 substitution can be used properly
+		if (mCaptures.size() < containerSize + 1)
+		{
+			mCaptures.resize(containerSize + 1);
+			mCaptureArgs.resize(containerSize);
+			mCaptureArgPtrs.resize(containerSize);
+		}
 
 		for (size_t i = 0; i < containerSize; ++i)
 		{
-			args[i] = RE2::Arg(&capturesStrings[i]);
-			argPtrs[i] = &args[i];
+			mCaptureArgs[i] = RE2::Arg(&mCaptures[i + 1]);
+			mCaptureArgPtrs[i] = &mCaptureArgs[i];
 		}
 
 		std::string_view consumedPtr(path);
-		if (!RE2::ConsumeN(&consumedPtr, *rule.svnPath, argPtrs.data(), capturesGroups))
+		const auto matchStart = profile ? std::chrono::steady_clock::now()
+										: std::chrono::steady_clock::time_point{};
+		const bool matched =
+			RE2::ConsumeN(&consumedPtr, *rule.svnPath, mCaptureArgPtrs.data(), capturesGroups);
+		if (profile)
+		{
+			profile->attempts++;
+			profile->matchTime += std::chrono::steady_clock::now() - matchStart;
+			profile->matches += matched ? 1 : 0;
+			profile->skips += matched && rule.skipRevision ? 1 : 0;
+		}
+		if (!matched)
 		{
 			continue;
 		}
 
-		// Insert the whole capture so the \0 substitution can be used properly
 		int captureGroupsWith0th = capturesGroups + 1;
 
 		const auto* wholeCaptureBegin = path.begin();
 		const auto* wholeCaptureEnd = consumedPtr.begin();
-		capturesStrings.emplace(capturesStrings.begin(), wholeCaptureBegin, wholeCaptureEnd);
+		mCaptures[0] = std::string_view(wholeCaptureBegin, wholeCaptureEnd);
 
 		if (rule.skipRevision)
 		{
@@ -225,26 +450,35 @@ std::optional<Git::Mapping> Git::MapPath(const long int rev, const std::string_v
 		}
 
 		Mapping result;
+		result.repository = rule.gitRepo;
+		result.tag = rule.tag;
 
+		mRewriteBuffer.clear();
 		rule.svnPath->Rewrite(
-			&result.branch, rule.gitBranch, capturesStrings.data(), captureGroupsWith0th
+			&mRewriteBuffer, rule.gitBranch, mCaptures.data(), captureGroupsWith0th
 		);
+		result.branch = ArenaCopy(arena, mRewriteBuffer);
 
+		mRewriteBuffer.clear();
 		rule.svnPath->Rewrite(
-			&result.path, rule.gitFilePath, capturesStrings.data(), captureGroupsWith0th
+			&mRewriteBuffer, rule.gitFilePath, mCaptures.data(), captureGroupsWith0th
 		);
 
 		// Append any of the non-captured SVN path to the output git path
-		result.path.append(consumedPtr);
+		mRewriteBuffer.append(consumedPtr);
 
-		if (!result.path.empty() && result.path.front() == '/')
+		// fast-import paths can't start with '/' and removing it automatically means
+		// less regex shenanigans for the user
+		std::string_view gitPath = mRewriteBuffer;
+		while (gitPath.starts_with('/'))
 		{
-			result.path.erase(0, 1);
+			gitPath.remove_prefix(1);
 		}
+		result.path = ArenaCopy(arena, gitPath);
 
 		for (const std::string& glob : mConfig.lfsWildmatches)
 		{
-			const char* subject = result.path.c_str();
+			const char* subject = result.path.data();
 			if (glob.find('/') == std::string::npos)
 			{
 				// Wildmatches that don't contain a path separator (e.g. "foo.psd") get matched
@@ -252,7 +486,7 @@ std::optional<Git::Mapping> Git::MapPath(const long int rev, const std::string_v
 				const auto slash = result.path.rfind('/');
 				if (slash != std::string::npos)
 				{
-					subject = result.path.c_str() + slash + 1;
+					subject = result.path.data() + slash + 1;
 				}
 			}
 
@@ -263,41 +497,327 @@ std::optional<Git::Mapping> Git::MapPath(const long int rev, const std::string_v
 			}
 		}
 
-		// fast-import paths can't start with '/' and removing it automatically means
-		// less regex shenanigans for the user
-		if (result.path.starts_with('/'))
+		return result;
+	}
+
+	if (profiling)
+	{
+		mUnmappedCount++;
+		const auto counted = mUnmappedPaths.find(path);
+		if (counted != mUnmappedPaths.end())
 		{
-			result.path.erase(0, 1);
+			counted->second++;
+		}
+		else if (mUnmappedPaths.size() < kMaxProfiledPaths)
+		{
+			mUnmappedPaths.emplace(std::string(path), 1);
 		}
-
-		return result;
 	}
 	return std::nullopt;
 }
 
+bool Git::CouldMapBelow(std::string_view directory)
+{
+	if (mRuleRanges.empty())
+	{
+		for (const Rule& rule : mConfig.rules)
+		{
+			RuleRange& range = mRuleRanges.emplace_back();
+			range.bounded =
+				rule.svnPath->PossibleMatchRange(&range.min, &range.max, kRuleRangeLength);
+		}
+	}
+
+	// Rules only have to match the start of a path, so a file under `directory` can match if a
+	// prefix of the directory is in a rule's range, or if the directory is a prefix of something
+	// that is
+	for (const RuleRange& range : mRuleRanges)
+	{
+		if (!range.bounded)
+		{
+			return true;
+		}
+		if (std::string_view(range.min).substr(0, directory.size()) <= directory &&
+			directory <= range.max)
+		{
+			return true;
+		}
+		for (size_t length = 1; length < directory.size(); ++length)
+		{
+			const std::string_view prefix = directory.substr(0, length);
+			if (range.min <= prefix && prefix <= range.max)
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void Git::EnableRuleProfiling()
+{
+	mRuleProfile.assign(mConfig.rules.size(), RuleProfile{});
+}
+
+std::string Git::GetRuleProfileReport() const
+{
+	if (mRuleProfile.empty())
+	{
+		return {};
+	}
+
+	std::string report;
+	auto out = std::back_inserter(report);
+
+	// Rules are numbered by their position in the config, starting from 1
+	std::vector<size_t> ranked(mRuleProfile.size());
+	std::iota(ranked.begin(), ranked.end(), 0);
+	std::ranges::stable_sort(
+		ranked, std::ranges::greater{}, [&](size_t i) { return mRuleProfile[i].matchTime; }
+	);
+
+	fmt::format_to(out, "Rules by time spent matching\n");
+	fmt::format_to(
+		out, "{:>6} {:>12} {:>12} {:>10} {:>10} {:>10}  {}\n", "rule", "attempts", "matches",
+		"skips", "outside", "time (ms)", "svn_path"
+	);
+	for (const size_t i : ranked)
+	{
+		const RuleProfile& profile = mRuleProfile[i];
+		const double milliseconds =
+			std::chrono::duration<double, std::milli>(profile.matchTime).count();
+		fmt::format_to(
+			out, "{:>6} {:>12} {:>12} {:>10} {:>10} {:>10.1f}  {}\n", i + 1, profile.attempts,
+			profile.matches, profile.skips, profile.outsideRevisions, milliseconds,
+			mConfig.rules[i].svnPath->pattern()
+		);
+	}
+
+	fmt::format_to(out, "\nRules that never matched\n");
+	for (size_t i = 0; i < mRuleProfile.size(); ++i)
+	{
+		if (mRuleProfile[i].matches == 0)
+		{
+			fmt::format_to(out, "{:>6}  {}\n", i + 1, mConfig.rules[i].svnPath->pattern());
+		}
+	}
+
+	std::vector<std::pair<std::string_view, size_t>> unmapped(
+		mUnmappedPaths.begin(), mUnmappedPaths.end()
+	);
+	std::ranges::sort(
+		unmapped, std::ranges::greater{}, &std::pair<std::string_view, size_t>::second
+	);
+	fmt::format_to(out, "\nUnmapped paths ({} in total)\n", mUnmappedCount);
+	for (const auto& [path, count] : unmapped | std::views::take(kMaxReportedPaths))
+	{
+		fmt::format_to(out, "{:>12}  {}\n", count, path);
+	}
+	return report;
+}
+
+bool Git::IsExistingBranch(Target& target, std::string_view branch)
+{
+	const auto known = target.existingBranches.find(branch);
+	if (known != target.existingBranches.end())
+	{
+		return known->second;
+	}
+
+	const StartingState& state = target.startingState;
+	const bool exists = state.branchExists && state.branchExists(branch);
+	// A re-exported branch is rebuilt from scratch, so it routes paths as a fresh export would
+	const bool reexported = target.onlyBranches && target.onlyBranches->contains(branch);
+	if (exists && !reexported && state.readRoutedPaths)
+	{
+		// Paths routed to LFS by size or content on an earlier run have to stay in LFS
+		const std::vector<std::string> paths = state.readRoutedPaths(branch);
+		if (!paths.empty())
+		{
+			target.lfsRoutedPaths.emplace(
+				std::string(branch), Target::PathSet(paths.begin(), paths.end())
+			);
+		}
+	}
+
+	target.existingBranches.emplace(std::string(branch), exists);
+	return exists;
+}
+
+bool Git::IsRoutedToLFS(const Target& target, const svn::File& file, const Mapping& mapping) const
+{
+	// Symlinks are never large, and a path with a newline or tab can't be listed in .gitattributes
+	if (file.isDirectory || file.isSymlink || !CanListInAttributes(mapping.path))
+	{
+		return false;
+	}
+
+	// Once a path is in LFS on a branch it stays there, so .gitattributes stays correct
+	const auto routed = target.lfsRoutedPaths.find(mapping.branch);
+	if (routed != target.lfsRoutedPaths.end() && routed->second.contains(mapping.path))
+	{
+		return true;
+	}
+
+	if (mConfig.lfsSizeThreshold && file.size >= *mConfig.lfsSizeThreshold)
+	{
+		return true;
+	}
+	return mConfig.lfsBinary && file.isBinary;
+}
+
+// Whether `path` is inside the directory `directory`
+static bool IsBelow(std::string_view path, std::string_view directory)
+{
+	return path.size() > directory.size() && path.starts_with(directory) &&
+		   path[directory.size()] == '/';
+}
+
+std::optional<std::string> Git::FindTagSource(
+	const svn::Revision& rev, std::span<const MappedFile> files, std::pmr::memory_resource* arena
+)
+{
+	const Mapping& tag = files.front().git;
+	Target& target = mTargets[tag.repository];
+	if (target.onlyBranches || target.seenBranches.contains(tag.branch) ||
+		target.tags.contains(tag.branch) || IsExistingBranch(target, tag.branch))
+	{
+		return std::nullopt;
+	}
+
+	// Copying a directory lists only the directory as changed, the files come from walking it
+	const std::string_view firstPath = files.front().svn->path;
+	const auto copy = std::ranges::find_if(
+		rev.GetFiles(),
+		[&](const svn::File& file)
+		{
+			return file.isDirectory && file.copiedFrom &&
+				   file.changeType == svn::File::Change::Add && IsBelow(firstPath, file.path);
+		}
+	);
+	if (copy == rev.GetFiles().end())
+	{
+		return std::nullopt;
+	}
+
+	// The copy has to be of a whole branch to the whole tag, not of a directory inside them
+	const svn::File::CopyFrom& source = *copy->copiedFrom;
+	const auto copiedRoot = MapPath(rev.GetNumber(), fmt::format("{}/", copy->path), arena);
+	const auto sourceRoot = MapPath(source.rev, fmt::format("{}/", source.path), arena);
+	if (!copiedRoot || copiedRoot->skip || copiedRoot->branch != tag.branch ||
+		!copiedRoot->path.empty() || !sourceRoot || sourceRoot->skip || sourceRoot->tag ||
+		sourceRoot->repository != tag.repository || !sourceRoot->path.empty())
+	{
+		return std::nullopt;
+	}
+	const std::string_view sourceBranch = sourceRoot->branch;
+
+	// Every file in the copy has to be in the tag, and nothing else, or it isn't a plain copy
+	const auto copiedFiles = std::ranges::count_if(
+		rev.GetFiles(),
+		[&](const svn::File& file) { return !file.isDirectory && IsBelow(file.path, copy->path); }
+	);
+	std::string sourcePath;
+	std::ptrdiff_t taggedFiles = 0;
+	for (const MappedFile& file : files)
+	{
+		if (file.svn == &*copy)
+		{
+			continue;
+		}
+		if (file.svn->isDirectory || file.svn->copiedFrom ||
+			file.svn->changeType != svn::File::Change::Add || !IsBelow(file.svn->path, copy->path))
+		{
+			return std::nullopt;
+		}
+		taggedFiles++;
+
+		// The file has to be where the branch it was copied from had it
+		sourcePath.assign(source.path);
+		sourcePath.append(file.svn->path.substr(copy->path.size()));
+		const auto original = MapPath(source.rev, sourcePath, arena);
+		if (!original || original->skip || original->tag ||
+			original->repository != tag.repository || original->path != file.git.path ||
+			original->lfs != file.git.lfs || original->branch != sourceBranch)
+		{
+			return std::nullopt;
+		}
+	}
+	if (taggedFiles == 0 || taggedFiles != copiedFiles)
+	{
+		return std::nullopt;
+	}
+
+	// The branch at the copied revision is its last commit at or before it, from this run if it
+	// has committed to the branch by then
+	const auto commits = target.branchCommits.find(sourceBranch);
+	if (commits != target.branchCommits.end())
+	{
+		const auto next = std::ranges::upper_bound(
+			commits->second, source.rev, {}, &std::pair<long int, bool>::first
+		);
+		if (next != commits->second.begin())
+		{
+			if (!std::prev(next)->second)
+			{
+				return std::nullopt;
+			}
+			return fmt::format(":{}", std::prev(next)->first);
+		}
+	}
+
+	// Otherwise from an earlier run
+	const StartingState& state = target.startingState;
+	if (!state.findBranchCommit || source.rev > target.resumeAfter)
+	{
+		return std::nullopt;
+	}
+	return state.findBranchCommit(sourceBranch, source.rev);
+}
+
+// Same check git uses to decide if a file is binary
+static bool LooksBinary(std::string_view contents)
+{
+	const size_t length = std::min(contents.size(), kBinaryCheckSize);
+	return std::memchr(contents.data(), '\0', length) != nullptr;
+}
+
 std::expected<void, std::string> Git::WriteCommit(const svn::Revision& rev)
 {
 	const std::string committer = GetAuthor(rev.GetAuthor());
 	const std::string message = GetCommitMessage(rev.GetLog(), rev.GetAuthor(), rev.GetNumber());
-	const std::string time = GetTime(rev.GetDate());
-
-	struct MappedFile
+	const auto time = GetTime(rev.GetDate());
+	if (!time)
 	{
-		const svn::File* svn;
-		Mapping git;
-		auto operator<=>(const MappedFile& other) const { return git.branch <=> other.git.branch; }
-	};
-	std::vector<MappedFile> mappings;
+		return std::unexpected(time.error());
+	}
+
+	// Everything mapped for this revision lives in one arena, released in one shot on return.
+	// Most revisions fit in the initial stack buffer and never touch the heap.
+	std::array<std::byte, kRevisionArenaSize> arenaBuffer;
+	std::pmr::monotonic_buffer_resource arena(arenaBuffer.data(), arenaBuffer.size());
+	std::pmr::vector<MappedFile> mappings(&arena);
 
 	for (const auto& file : rev.GetFiles())
 	{
-		std::optional<Mapping> destination = MapPath(rev.GetNumber(), file.path);
+		std::optional<Mapping> destination = MapPath(rev.GetNumber(), file.path, &arena);
 
 		if (destination)
 		{
-			if (!destination->skip)
+			// Targets that are already further ahead than this revision are left alone
+			// Tags in a snapshot would each repeat a whole branch, so they're left out
+			Target& target = mTargets[destination->repository];
+			const bool isSnapshotTag = rev.IsSnapshot() && destination->tag;
+			if (!destination->skip && !isSnapshotTag && rev.GetNumber() > target.resumeAfter)
 			{
-				mappings.emplace_back(&file, *destination);
+				// Load what's known about the branch before deciding how to store the file
+				IsExistingBranch(target, destination->branch);
+
+				const bool routed = !destination->lfs &&
+									file.changeType != svn::File::Change::Delete &&
+									IsRoutedToLFS(target, file, *destination);
+				destination->lfs = destination->lfs || routed;
+				mappings.emplace_back(&file, *destination, routed);
 			}
 		}
 		else
@@ -316,26 +836,164 @@ std::expected<void, std::string> Git::WriteCommit(const svn::Revision& rev)
 
 	std::stable_sort(mappings.begin(), mappings.end());
 
-	std::string lastBranch;
+	// Unmodified copies to tag rules become tags, and none of their files are written
+	for (auto it = mappings.begin(); it != mappings.end();)
+	{
+		const auto groupEnd = std::find_if(
+			it, mappings.end(),
+			[&](const MappedFile& m)
+			{ return m.git.repository != it->git.repository || m.git.branch != it->git.branch; }
+		);
+		if (!it->git.tag)
+		{
+			it = groupEnd;
+			continue;
+		}
+
+		const auto source = FindTagSource(rev, {it, groupEnd}, &arena);
+		if (!source)
+		{
+			it = groupEnd;
+			continue;
+		}
+
+		Target& target = mTargets[it->git.repository];
+		target.writer->Reset(fmt::format("refs/tags/{}", it->git.branch), *source);
+		target.tags.emplace(it->git.branch, std::move(*source));
+		it = mappings.erase(it, groupEnd);
+	}
 
-	// One SVN revision maps to multiple different git commits
-	const bool isMultiCommit =
-		!mappings.empty() && (mappings.front().git.branch != mappings.back().git.branch);
+	// fast-import only keeps the trees of the branches it committed to last. Committing to the
+	// most recently used branches first keeps every one of them that is still cached a hit, where
+	// committing to an uncached branch first could evict one before it's reached.
+	for (auto it = mappings.begin(); it != mappings.end();)
+	{
+		const auto groupEnd = std::find_if(
+			it, mappings.end(),
+			[&](const MappedFile& m)
+			{ return m.git.repository != it->git.repository || m.git.branch != it->git.branch; }
+		);
+		const auto distance = mTargets[it->git.repository].workingSet.Distance(it->git.branch);
+		for (auto file = it; file != groupEnd; ++file)
+		{
+			file->cacheOrder = distance.value_or(std::numeric_limits<size_t>::max());
+		}
+		it = groupEnd;
+	}
+	std::ranges::stable_sort(
+		mappings, {},
+		[](const MappedFile& m) { return std::pair{m.git.repository, m.cacheOrder}; }
+	);
+
+	// Queue up every file that needs its contents, in the order they're written below, so the
+	// reader threads can work ahead of the writer
+	std::pmr::vector<svn::ContentReader::Request> reads(&arena);
+	const auto isWritten = [this](const MappedFile& file)
+	{
+		const Target& target = mTargets[file.git.repository];
+		return !target.onlyBranches || target.onlyBranches->contains(file.git.branch);
+	};
 
 	for (const auto& file : mappings)
 	{
-		const std::string& branch = file.git.branch;
+		if (isWritten(file) && file.svn->changeType != svn::File::Change::Delete &&
+			!file.svn->isDirectory)
+		{
+			reads.push_back({.file = file.svn, .hash = file.git.lfs && !file.svn->isSymlink});
+		}
+	}
+	std::optional<svn::ContentReader::Batch> batch;
+	if (mReader)
+	{
+		batch.emplace(*mReader, rev.GetNumber(), reads);
+	}
+
+	std::optional<size_t> lastRepository;
+	std::string_view lastBranch;
+	std::optional<size_t> multiCommitRepository;
+	bool isMultiCommit = false;
+	size_t commitFiles = 0;
+	size_t commitBytes = 0;
+
+	svn::Pool contentPool;
 
-		if (branch != lastBranch)
+	// The branch's .gitattributes has to be written again by the end of this commit
+	auto staleAttributes = [](Target& target, std::string_view branch)
+	{
+		const auto current = target.currentAttributes.find(branch);
+		if (current != target.currentAttributes.end())
+		{
+			target.currentAttributes.erase(current);
+		}
+	};
+
+	// .gitattributes is written once each commit's files are known, since files that look binary
+	// are only found once their contents are read. It's only written by the first commit to each
+	// branch, and when a path is routed to LFS or the file is deleted or overwritten.
+	auto finishCommit = [&]() -> std::expected<void, std::string>
+	{
+		Target& target = mTargets[*lastRepository];
+		if (!target.currentAttributes.contains(lastBranch))
+		{
+			std::string attributes = GetGitAttributesContent(*lastRepository, lastBranch);
+			if (attributes.length() > 0)
+			{
+				target.writer->Modify(static_cast<int>(Mode::Normal), ".gitattributes", attributes);
+			}
+			target.currentAttributes.emplace(lastBranch);
+		}
+		return target.writer->RecordBranchCommit(
+			rev.GetNumber(), lastBranch, commitFiles, commitBytes
+		);
+	};
+
+	for (auto it = mappings.begin(); it != mappings.end(); ++it)
+	{
+		const MappedFile& file = *it;
+		const size_t repository = file.git.repository;
+		const std::string_view branch = file.git.branch;
+		Target& target = mTargets[repository];
+		IFastImport& writer = *target.writer;
+
+		if (repository != multiCommitRepository)
+		{
+			// One SVN revision maps to multiple different git commits in this repository. Branches
+			// that aren't being re-exported still count, so marks stay unambiguous.
+			multiCommitRepository = repository;
+			auto repositoryEnd = std::find_if(
+				it, mappings.end(),
+				[&](const MappedFile& m) { return m.git.repository != repository; }
+			);
+			isMultiCommit = std::prev(repositoryEnd)->git.branch != branch;
+		}
+
+		if (!isWritten(file))
+		{
+			continue;
+		}
+
+		if (repository != lastRepository || branch != lastBranch)
 		{
 			// We've moved onto a new branch, start a new commit!
+			if (lastRepository)
+			{
+				if (auto finished = finishCommit(); !finished)
+				{
+					return finished;
+				}
+			}
+			lastRepository = repository;
 			lastBranch = branch;
+			commitFiles = 0;
+			commitBytes = 0;
 
 			// Only mark unambiguous commits
 			const std::string mark =
 				!isMultiCommit ? fmt::format("mark :{}\n", rev.GetNumber()) : "";
 
-			const auto from = GetBranchOrigin(branch);
+			// A snapshot starts every branch afresh
+			const auto from = rev.IsSnapshot() ? std::optional<std::string>("")
+											   : GetBranchOrigin(repository, branch);
 			if (!from.has_value())
 			{
 				return std::unexpected(
@@ -346,67 +1004,165 @@ std::expected<void, std::string> Git::WriteCommit(const svn::Revision& rev)
 				);
 			}
 
-			mWriter.BeginCommit(
+			writer.BeginCommit(
 				BeginCommitArgInfo{
 					.branch = branch,
 					.mark = mark,
 					.revision = rev.GetNumber(),
 					.committer = committer,
-					.time = time,
+					.time = *time,
 					.message = message,
 					.from = *from
 				}
 			);
 
-			mSeenBranches.insert(branch);
-
-			std::string attributes = GetGitAttributesContent();
-			if (attributes.length() > 0)
+			target.seenBranches.emplace(branch);
+			target.workingSet.Commit(branch);
+			auto commits = target.branchCommits.find(branch);
+			if (commits == target.branchCommits.end())
 			{
-				// We don't need to be writing this for every commit, just the first to each branch
-				// Oh well, it's easier to do it this way for now
-				mWriter.Modify(static_cast<int>(Mode::Normal), ".gitattributes", attributes);
+				commits = target.branchCommits.try_emplace(std::string(branch)).first;
 			}
+			commits->second.emplace_back(rev.GetNumber(), !isMultiCommit);
 		}
 
 		if (file.svn->changeType == svn::File::Change::Delete ||
 			file.svn->changeType == svn::File::Change::Replace)
 		{
-			mWriter.Delete(file.git.path);
+			writer.Delete(file.git.path);
+		}
+		if (file.git.path.empty() || file.git.path == ".gitattributes")
+		{
+			// Deleting the branch root, or writing a .gitattributes from svn, replaces ours
+			staleAttributes(target, branch);
+		}
+		const auto routedPaths = file.svn->changeType == svn::File::Change::Delete
+									 ? target.lfsRoutedPaths.find(branch)
+									 : target.lfsRoutedPaths.end();
+		if (routedPaths != target.lfsRoutedPaths.end())
+		{
+			// Deleted paths leave .gitattributes, and are routed afresh if they come back. Paths
+			// starting with the deleted one are next to each other, the ones below it among them.
+			std::string_view deleted = file.git.path;
+			if (deleted.ends_with('/'))
+			{
+				deleted.remove_suffix(1);
+			}
+			Target::PathSet& paths = routedPaths->second;
+			bool erased = false;
+			for (auto path = paths.lower_bound(deleted);
+				 path != paths.end() && path->starts_with(deleted);)
+			{
+				if (deleted.empty() || *path == deleted || IsBelow(*path, deleted))
+				{
+					path = paths.erase(path);
+					erased = true;
+				}
+				else
+				{
+					++path;
+				}
+			}
+			if (erased)
+			{
+				staleAttributes(target, branch);
+			}
 		}
 
 		if (file.svn->changeType != svn::File::Change::Delete && !file.svn->isDirectory)
 		{
-			auto fileContents = file.svn->GetContents();
+			std::expected<svn::ContentReader::Content, std::string> fileContents;
+			if (batch)
+			{
+				fileContents = batch->Next();
+			}
+			else
+			{
+				contentPool.clear();
+				auto contents = file.svn->GetContents(contentPool);
+				if (!contents)
+				{
+					return std::unexpected(contents.error());
+				}
+				fileContents = svn::ContentReader::Content{.data = std::move(*contents)};
+			}
 			if (!fileContents)
 			{
 				return std::unexpected(fileContents.error());
 			}
-			std::string_view svnFile{fileContents->get(), file.svn->size};
+			std::string_view svnFile{fileContents->data.get(), file.svn->size};
+			commitBytes += svnFile.size();
 			Mode mode = file.svn->isExecutable ? Mode::Executable : Mode::Normal;
 
-			if (file.svn->isSymlink && file.git.lfs)
+			bool lfs = file.git.lfs;
+			bool routed = file.routed;
+			if (!lfs && mConfig.lfsBinary && !file.svn->isSymlink &&
+				CanListInAttributes(file.git.path) && LooksBinary(svnFile))
+			{
+				lfs = true;
+				routed = true;
+			}
+			if (routed)
+			{
+				auto routedPaths = target.lfsRoutedPaths.find(branch);
+				if (routedPaths == target.lfsRoutedPaths.end())
+				{
+					routedPaths =
+						target.lfsRoutedPaths.emplace(std::string(branch), Target::PathSet{}).first;
+				}
+				if (routedPaths->second.emplace(file.git.path).second)
+				{
+					staleAttributes(target, branch);
+				}
+			}
+
+			if (file.svn->isSymlink && lfs)
 			{
 				mode = Mode::Symlink;
-				std::string lfsPointer = WriteLFSFile(ConvertSymlink(svnFile));
-				mWriter.Modify(static_cast<int>(mode), file.git.path, lfsPointer);
+				auto lfsPointer = WriteLFSFile(repository, ConvertSymlink(svnFile));
+				if (!lfsPointer)
+				{
+					return std::unexpected(lfsPointer.error());
+				}
+				writer.Modify(static_cast<int>(mode), file.git.path, *lfsPointer);
 			}
-			else if (file.git.lfs)
+			else if (lfs && target.deferLFS)
 			{
-				std::string lfsPointer = WriteLFSFile(svnFile);
-				mWriter.Modify(static_cast<int>(mode), file.git.path, lfsPointer);
+				auto lfsPointer = DeferLFSFile(
+					repository, svnFile, fileContents->sha256, *file.svn, rev.GetNumber()
+				);
+				if (!lfsPointer)
+				{
+					return std::unexpected(lfsPointer.error());
+				}
+				writer.Modify(static_cast<int>(mode), file.git.path, *lfsPointer);
+			}
+			else if (lfs)
+			{
+				auto lfsPointer = WriteLFSFile(repository, svnFile, fileContents->sha256);
+				if (!lfsPointer)
+				{
+					return std::unexpected(lfsPointer.error());
+				}
+				writer.Modify(static_cast<int>(mode), file.git.path, *lfsPointer);
 			}
 			else if (file.svn->isSymlink)
 			{
 				mode = Mode::Symlink;
-				mWriter.Modify(static_cast<int>(mode), file.git.path, ConvertSymlink(svnFile));
+				writer.Modify(static_cast<int>(mode), file.git.path, ConvertSymlink(svnFile));
 			}
 			else
 			{
-				mWriter.Modify(static_cast<int>(mode), file.git.path, svnFile);
+				writer.Modify(static_cast<int>(mode), file.git.path, svnFile);
 			}
 		}
-		mFirstCommit = false;
+		commitFiles++;
+		target.firstCommit = false;
+	}
+
+	if (lastRepository)
+	{
+		return finishCommit();
 	}
 
 	return {};
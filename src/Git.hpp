@@ -1,61 +1,242 @@
 #pragma once
+#include "BranchCache.hpp"
 #include "Config.hpp"
+#include "Reader.hpp"
 #include "Svn.hpp"
+#include "Utils.hpp"
 #include "Writer.hpp"
 
+#include <re2/re2.h>
+
+#include <chrono>
+#include <cstddef>
 #include <expected>
+#include <functional>
+#include <memory_resource>
 #include <optional>
+#include <set>
+#include <span>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+namespace date
+{
+class time_zone;
+} // namespace date
+
 class Git
 {
 public:
 	struct StartingState
 	{
 		bool isRepoEmpty = false;
-		std::vector<std::string> existingBranches;
+		/// Whether a branch exists in the repository on disk. Refs are looked up on demand, so
+		/// startup doesn't scale with the number of branches. Unset for a new repository.
+		std::function<bool(std::string_view branch)> branchExists;
+		/// Whether refs/tags/<tag> exists in the repository on disk. Unset for a new repository.
+		std::function<bool(std::string_view tag)> tagExists;
+		/// The paths an existing branch routes to LFS because of lfs_size_threshold or lfs_binary.
+		std::function<std::vector<std::string>(std::string_view branch)> readRoutedPaths;
+		/// The commit id an earlier run wrote as the last commit to `branch` at or before
+		/// `revision`, if that commit has a mark. Unset for a new repository.
+		std::function<std::optional<std::string>(std::string_view branch, long int revision)>
+			findBranchCommit;
+	};
+
+	/// One git repository being written to, each with its own fast-import stream and state.
+	struct Target
+	{
+		IFastImport* writer = nullptr;
+		StartingState startingState;
+		/// Revisions up to and including this one were written to the target by an earlier run.
+		long int resumeAfter = 0;
+		/// Only write LFS pointers, and list the objects in the LFS manifest for
+		/// MaterializeLFSObjects to write later.
+		bool deferLFS = false;
+		using BranchSet = std::unordered_set<std::string, StringHash, std::equal_to<>>;
+		/// Re-export only these branches from scratch, ignoring every other branch.
+		std::optional<BranchSet> onlyBranches;
+		bool firstCommit = true;
+		BranchSet seenBranches;
+		/// Per branch, git paths stored in LFS because of lfs_size_threshold or lfs_binary
+		using PathSet = std::set<std::string, std::less<>>;
+		std::unordered_map<std::string, PathSet, StringHash, std::equal_to<>> lfsRoutedPaths;
+		/// Branches whose .gitattributes this run has written, and that is still up to date
+		BranchSet currentAttributes;
+		/// Branches already looked up on disk, and whether they exist
+		std::unordered_map<std::string, bool, StringHash, std::equal_to<>> existingBranches;
+		/// Per branch, the revisions committed to it by this run in order, and whether each
+		/// commit has a mark
+		std::unordered_map<
+			std::string, std::vector<std::pair<long int, bool>>, StringHash, std::equal_to<>>
+			branchCommits;
+		/// Tags written by this run, and the commit each points at (a mark or a commit id)
+		std::unordered_map<std::string, std::string, StringHash, std::equal_to<>> tags;
+		/// The branches committed to by this run, in the order fast-import caches their trees
+		BranchWorkingSet workingSet;
 	};
 
+	/// branch and path are views into the arena passed to MapPath, and are NUL terminated.
 	struct Mapping
 	{
 		bool skip = false;
-		std::string branch;
-		std::string path;
+		/// Index into Config::gitRepos (and the Git targets)
+		size_t repository = 0;
+		std::string_view branch;
+		std::string_view path;
 		bool lfs = false;
+		/// branch names a tag
+		bool tag = false;
 	};
 
-	Git(const Config& config, IFastImport& writer, StartingState startingState) :
+	/// One target per entry in Config::gitRepos, in the same order. Without a reader, file contents
+	/// are read one at a time on the calling thread.
+	Git(const Config& config, std::vector<Target> targets, svn::ContentReader* reader = nullptr) :
 		mConfig(config),
-		mWriter(writer),
-		mStartingState(std::move(startingState)) {};
+		mTargets(std::move(targets)),
+		mReader(reader) {};
+
+	Git(
+		const Config& config, IFastImport& writer, StartingState startingState,
+		svn::ContentReader* reader = nullptr
+	) :
+		Git(
+			config, {Target{.writer = &writer, .startingState = std::move(startingState)}}, reader
+		) {};
 
 	std::string GetAuthor(const std::string& username);
 
 	std::string GetCommitMessage(const std::string& log, const std::string& username, long int rev);
 
-	std::string GetGitAttributesContent();
+	std::string GetGitAttributesContent(size_t repository, std::string_view branch);
+
+	/// The paths listed in the routed section of a .gitattributes file written by
+	/// GetGitAttributesContent.
+	static std::vector<std::string> ParseRoutedPaths(std::string_view attributes);
 
-	std::string GetTime(const std::string& svnTime);
+	/// Fails if the configured timezone isn't in the time zone database.
+	std::expected<std::string, std::string> GetTime(const std::string& svnTime);
 
-	std::string WriteLFSFile(const std::string_view input);
+	/// The pointer for `input`, once the object is in the target's LFS store.
+	std::expected<std::string, std::string> WriteLFSFile(
+		size_t repository, const std::string_view input, const std::string_view sha256 = {}
+	);
+
+	/// Like WriteLFSFile, but records where the contents can be read back from SVN instead of
+	/// writing the object.
+	std::expected<std::string, std::string> DeferLFSFile(
+		size_t repository, const std::string_view input, const std::string_view sha256,
+		const svn::File& source, long int rev
+	);
 
 	std::string ConvertSymlink(std::string_view svnSymlink);
 
-	std::optional<Mapping> MapPath(const long int rev, const std::string_view& svnPath);
+	std::optional<Mapping> MapPath(
+		const long int rev, const std::string_view& svnPath, std::pmr::memory_resource* arena
+	);
+
+	/// Whether any rule could match a path below `directory`, which ends with a '/'. Going by the
+	/// range of paths each rule's regex can match the start of, so it can answer yes for a
+	/// directory no path below will actually map from, but never no for one that does. Used to
+	/// skip whole directories when walking a tree.
+	bool CouldMapBelow(std::string_view directory);
 
-	std::optional<std::string> GetBranchOrigin(const std::string& branch);
+	std::optional<std::string> GetBranchOrigin(size_t repository, std::string_view branch);
 
 	std::expected<void, std::string> WriteCommit(const svn::Revision& rev);
 
+	const Target& GetTarget(size_t repository) const { return mTargets[repository]; }
+
+	const BranchWorkingSet& GetWorkingSet(size_t repository) const
+	{
+		return mTargets[repository].workingSet;
+	}
+
+	/// Start counting how each rule is used by MapPath. Adds a clock read around every regex match.
+	void EnableRuleProfiling();
+
+	/// The rules ranked by time spent matching them, the rules that never matched, and the most
+	/// common unmapped paths. Empty unless profiling is enabled.
+	std::string GetRuleProfileReport() const;
+
 private:
+	/// A changed svn file and where MapPath put it
+	struct MappedFile
+	{
+		const svn::File* svn;
+		Mapping git;
+		/// In LFS because of its size or content, rather than a wildmatch
+		bool routed = false;
+		/// The branch's Distance in the working set, when ordering commits
+		size_t cacheOrder = 0;
+		auto operator<=>(const MappedFile& other) const
+		{
+			return std::tie(git.repository, git.branch) <=>
+				   std::tie(other.git.repository, other.git.branch);
+		}
+	};
+
+	/// The range of svn paths a rule can match the start of
+	struct RuleRange
+	{
+		bool bounded = false;
+		std::string min;
+		std::string max;
+	};
+
+	/// How MapPath used one rule
+	struct RuleProfile
+	{
+		size_t attempts = 0;
+		size_t matches = 0;
+		/// Matches of rules without a branch, which leave the path out
+		size_t skips = 0;
+		/// Times the revision was outside min_revision and max_revision, so the regex wasn't tried
+		size_t outsideRevisions = 0;
+		std::chrono::nanoseconds matchTime{0};
+	};
+
+	/// Whether the branch existed before this run. The first lookup of each branch also loads the
+	/// paths its .gitattributes routes to LFS.
+	bool IsExistingBranch(Target& target, std::string_view branch);
+
+	/// Whether a file no wildmatch matched should go to LFS anyway, going by what is known before
+	/// its contents are read
+	bool IsRoutedToLFS(const Target& target, const svn::File& file, const Mapping& mapping) const;
+
+	/// The commit (a mark or a commit id) a new tag can point at instead of being written out.
+	/// `files` are everything `rev` maps to the tag, which must be exactly the files of one copy of
+	/// a branch's root to the tag's root, each mapping to the same path on the branch at the copied
+	/// revision as it does on the tag. The branch's last commit at or before that revision must
+	/// have a mark, from this run or an earlier one.
+	std::optional<std::string> FindTagSource(
+		const svn::Revision& rev, std::span<const MappedFile> files,
+		std::pmr::memory_resource* arena
+	);
+
 	const Config& mConfig;
-	IFastImport& mWriter;
-	const StartingState mStartingState;
+	std::vector<Target> mTargets;
+	svn::ContentReader* mReader;
+	/// Located on the first non-UTC commit
+	const date::time_zone* mTimeZone = nullptr;
+
+	// Scratch space reused by every MapPath call, so matching a path doesn't allocate
+	std::vector<std::string_view> mCaptures;
+	std::vector<RE2::Arg> mCaptureArgs;
+	std::vector<RE2::Arg*> mCaptureArgPtrs;
+	std::string mRewriteBuffer;
+
+	/// One entry per rule, worked out on the first CouldMapBelow
+	std::vector<RuleRange> mRuleRanges;
 
-	bool mFirstCommit = true;
-	std::unordered_set<std::string> mSeenBranches;
+	/// One entry per rule, when profiling
+	std::vector<RuleProfile> mRuleProfile;
+	/// Paths no rule matched, and how often, when profiling. Limited to kMaxProfiledPaths.
+	std::unordered_map<std::string, size_t, StringHash, std::equal_to<>> mUnmappedPaths;
+	size_t mUnmappedCount = 0;
 };
@@ -0,0 +1,374 @@
+#include "Lfs.hpp"
+#include "Reader.hpp"
+#include "Svn.hpp"
+
+#include <fmt/format.h>
+#include <picosha2.h>
+#include <svn_error.h>
+#include <svn_fs.h>
+#include <svn_io.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <expected>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+// Objects are streamed from svn to disk in chunks of this size, never held whole in memory
+static constexpr size_t kCopyChunkSize = 64 * 1024;
+
+std::filesystem::path LFSObjectPath(std::string_view oid)
+{
+	return fmt::format("lfs/objects/{}/{}/{}", oid.substr(0, 2), oid.substr(2, 2), oid);
+}
+
+std::string LFSPointer(std::string_view oid, size_t size)
+{
+	return fmt::format(
+		"version https://git-lfs.github.com/spec/v1\noid sha256:{}\nsize {}\n", oid, size
+	);
+}
+
+// Unique within this machine, for files written under a temporary name
+static std::filesystem::path PartialPath(const std::filesystem::path& path)
+{
+	std::filesystem::path partial = path;
+	const size_t thread = std::hash<std::thread::id>{}(std::this_thread::get_id());
+	partial += fmt::format(".incomplete.{}.{}", getpid(), thread);
+	return partial;
+}
+
+std::expected<void, std::string>
+LinkLFSObject(const std::filesystem::path& source, const std::filesystem::path& destination)
+{
+	std::error_code error;
+	std::filesystem::create_directories(destination.parent_path(), error);
+	std::filesystem::create_hard_link(source, destination, error);
+	if (!error || std::filesystem::exists(destination))
+	{
+		return {};
+	}
+
+#ifdef FICLONE
+	// Hard links can't cross file systems, but a copy-on-write clone can share the blocks on
+	// btrfs and xfs
+	const int sourceFd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+	if (sourceFd >= 0)
+	{
+		const std::filesystem::path partial = PartialPath(destination);
+		const int destinationFd =
+			open(partial.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		bool cloned = false;
+		if (destinationFd >= 0)
+		{
+			cloned = ioctl(destinationFd, FICLONE, sourceFd) == 0;
+			close(destinationFd);
+			if (cloned)
+			{
+				std::filesystem::rename(partial, destination, error);
+				cloned = !error;
+			}
+			if (!cloned)
+			{
+				std::filesystem::remove(partial, error);
+			}
+		}
+		close(sourceFd);
+		if (cloned)
+		{
+			return {};
+		}
+	}
+#endif
+
+	const std::filesystem::path partial = PartialPath(destination);
+	std::filesystem::copy_file(source, partial, error);
+	if (!error)
+	{
+		std::filesystem::rename(partial, destination, error);
+	}
+	if (error)
+	{
+		std::filesystem::remove(partial, error);
+		return std::unexpected(
+			fmt::format("Could not link {:?} to {:?}", source.c_str(), destination.c_str())
+		);
+	}
+	return {};
+}
+
+std::expected<void, std::string>
+WriteFileAtomically(const std::filesystem::path& path, std::string_view data)
+{
+	std::error_code error;
+	std::filesystem::create_directories(path.parent_path(), error);
+
+	const std::filesystem::path partial = PartialPath(path);
+	{
+		std::ofstream file{partial, std::ios::binary};
+		file.write(data.data(), static_cast<std::streamsize>(data.size()));
+		if (!file)
+		{
+			return std::unexpected(fmt::format("Could not write {:?}", partial.c_str()));
+		}
+	}
+	std::filesystem::rename(partial, path, error);
+	if (error)
+	{
+		std::filesystem::remove(partial, error);
+		return std::unexpected(fmt::format("Could not write {:?}", path.c_str()));
+	}
+	return {};
+}
+
+namespace
+{
+
+struct ManifestEntry
+{
+	std::string oid;
+	size_t size = 0;
+	long int revision = 0;
+	std::string path;
+};
+
+std::optional<ManifestEntry> ParseManifestLine(std::string_view line)
+{
+	ManifestEntry entry;
+
+	const auto oidEnd = line.find(' ');
+	if (oidEnd == std::string_view::npos)
+	{
+		return std::nullopt;
+	}
+	entry.oid = line.substr(0, oidEnd);
+	line.remove_prefix(oidEnd + 1);
+
+	const char* lineEnd = line.data() + line.size();
+	auto [sizeEnd, sizeError] = std::from_chars(line.data(), lineEnd, entry.size);
+	if (sizeError != std::errc{} || sizeEnd == lineEnd || *sizeEnd != ' ')
+	{
+		return std::nullopt;
+	}
+	line.remove_prefix(static_cast<size_t>(sizeEnd - line.data()) + 1);
+
+	auto [revEnd, revError] = std::from_chars(line.data(), lineEnd, entry.revision);
+	if (revError != std::errc{} || revEnd == lineEnd || *revEnd != ' ')
+	{
+		return std::nullopt;
+	}
+	line.remove_prefix(static_cast<size_t>(revEnd - line.data()) + 1);
+
+	entry.path = line;
+	if (entry.oid.size() != picosha2::k_digest_size * 2 || entry.path.empty())
+	{
+		return std::nullopt;
+	}
+	return entry;
+}
+
+// Stream one file out of svn into the LFS store, hashing it on the way
+std::expected<void, std::string> WriteObject(
+	svn_fs_t* fs, const ManifestEntry& entry, const std::filesystem::path& storeRoot,
+	apr_pool_t* pool
+)
+{
+	svn_fs_root_t* root = nullptr;
+	svn_error_t* err = svn_fs_revision_root(&root, fs, entry.revision, pool);
+	if (err)
+	{
+		return std::unexpected(svn::FormatSvnError(err));
+	}
+
+	svn_stream_t* stream = nullptr;
+	err = svn_fs_file_contents(&stream, root, entry.path.c_str(), pool);
+	if (err)
+	{
+		return std::unexpected(svn::FormatSvnError(err));
+	}
+
+	const std::filesystem::path objectPath = storeRoot / LFSObjectPath(entry.oid);
+	const std::filesystem::path partialPath = PartialPath(objectPath);
+	// These run on the materializing threads, so errors are returned rather than thrown
+	std::error_code error;
+	std::filesystem::create_directories(objectPath.parent_path(), error);
+	if (error)
+	{
+		const std::filesystem::path directory = objectPath.parent_path();
+		return std::unexpected(
+			fmt::format("Could not create {:?}: {}", directory.c_str(), error.message())
+		);
+	}
+
+	picosha2::hash256_one_by_one hasher;
+	size_t total = 0;
+	{
+		std::ofstream file{partialPath, std::ios::binary};
+		std::array<char, kCopyChunkSize> chunk{};
+		while (true)
+		{
+			apr_size_t length = chunk.size();
+			err = svn_stream_read_full(stream, chunk.data(), &length);
+			if (err)
+			{
+				return std::unexpected(svn::FormatSvnError(err));
+			}
+			hasher.process(chunk.begin(), chunk.begin() + static_cast<std::ptrdiff_t>(length));
+			file.write(chunk.data(), static_cast<std::streamsize>(length));
+			total += length;
+			if (length < chunk.size())
+			{
+				break;
+			}
+		}
+		if (!file)
+		{
+			return std::unexpected(fmt::format("Could not write {:?}", partialPath.c_str()));
+		}
+	}
+	hasher.finish();
+
+	const std::string oid = picosha2::get_hash_hex_string(hasher);
+	if (oid != entry.oid || total != entry.size)
+	{
+		std::filesystem::remove(partialPath, error);
+		return std::unexpected(
+			fmt::format(
+				"{:?} at r{} does not match its LFS pointer (expected {} of {} bytes, read {} of {} bytes)",
+				entry.path, entry.revision, entry.oid, entry.size, oid, total
+			)
+		);
+	}
+
+	std::filesystem::rename(partialPath, objectPath, error);
+	if (error)
+	{
+		std::filesystem::remove(partialPath, error);
+		return std::unexpected(
+			fmt::format("Could not write {:?}: {}", objectPath.c_str(), error.message())
+		);
+	}
+	return {};
+}
+
+} // namespace
+
+// With a shared store, write the object there (unless it's already there) and link it into gitRoot
+std::expected<void, std::string> MaterializeObject(
+	svn_fs_t* fs, const ManifestEntry& entry, const std::filesystem::path& gitRoot,
+	const std::optional<std::filesystem::path>& sharedStore, apr_pool_t* pool
+)
+{
+	if (!sharedStore)
+	{
+		return WriteObject(fs, entry, gitRoot, pool);
+	}
+
+	const std::filesystem::path sharedPath = *sharedStore / LFSObjectPath(entry.oid);
+	std::error_code error;
+	const bool shared = std::filesystem::exists(sharedPath, error);
+	if (error)
+	{
+		return std::unexpected(
+			fmt::format("Could not check {:?}: {}", sharedPath.c_str(), error.message())
+		);
+	}
+	if (!shared)
+	{
+		auto wrote = WriteObject(fs, entry, *sharedStore, pool);
+		if (!wrote)
+		{
+			return wrote;
+		}
+	}
+	return LinkLFSObject(sharedPath, gitRoot / LFSObjectPath(entry.oid));
+}
+
+std::expected<MaterializeResult, std::string> MaterializeLFSObjects(
+	const std::string& svnRepositoryPath, const std::filesystem::path& gitRoot,
+	const std::optional<std::filesystem::path>& sharedStore, unsigned int threads
+)
+{
+	MaterializeResult result;
+	const std::filesystem::path manifestPath = gitRoot / kLFSManifestPath;
+	if (!std::filesystem::exists(manifestPath))
+	{
+		return result;
+	}
+
+	std::vector<ManifestEntry> pending;
+	{
+		std::unordered_set<std::string> seen;
+		std::ifstream manifest{manifestPath};
+		std::string line;
+		while (std::getline(manifest, line))
+		{
+			auto entry = ParseManifestLine(line);
+			if (!entry)
+			{
+				return std::unexpected(
+					fmt::format("Invalid line in {:?}: {:?}", manifestPath.c_str(), line)
+				);
+			}
+			if (!seen.insert(entry->oid).second ||
+				std::filesystem::exists(gitRoot / LFSObjectPath(entry->oid)))
+			{
+				result.skipped++;
+				continue;
+			}
+			pending.push_back(std::move(*entry));
+		}
+	}
+
+	// Largest first, so one huge object doesn't start last and hold up the whole pass
+	std::ranges::sort(pending, std::ranges::greater{}, &ManifestEntry::size);
+
+	struct Worker
+	{
+		svn::Pool pool;
+		svn_fs_t* fs = nullptr;
+	};
+
+	// What isn't written after an error is left for the next attempt
+	std::atomic<size_t> written = 0;
+	auto workers = svn::RunInParallel(
+		svnRepositoryPath, pending.size(), threads, {}, [] { return std::make_unique<Worker>(); },
+		[&](Worker& worker, size_t i, svn::Pool& scratch) -> std::expected<void, std::string>
+		{
+			auto wrote = MaterializeObject(worker.fs, pending[i], gitRoot, sharedStore, scratch);
+			if (!wrote)
+			{
+				return std::unexpected(wrote.error());
+			}
+			written++;
+			return {};
+		}
+	);
+	if (!workers)
+	{
+		return std::unexpected(workers.error());
+	}
+	result.written = written;
+
+	std::filesystem::remove(manifestPath);
+	return result;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <expected>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/// Pointer-only LFS objects deferred during conversion (`--defer-lfs`) are listed here, relative
+/// to the git directory. One line per object: "<oid> <size> <svn revision> <svn path>".
+static constexpr std::string_view kLFSManifestPath = "svn_lfs_export_lfs_manifest";
+
+/// Where an LFS object is stored, relative to the git directory.
+std::filesystem::path LFSObjectPath(std::string_view oid);
+
+/// The contents of an LFS pointer file for an object.
+std::string LFSPointer(std::string_view oid, size_t size);
+
+/// Put `source` at `destination` without copying the data where possible: a hard link, then a
+/// reflink (copy-on-write clone) when they are on different file systems, then a plain copy.
+std::expected<void, std::string>
+LinkLFSObject(const std::filesystem::path& source, const std::filesystem::path& destination);
+
+/// Write a file under a temporary name and rename it into place, so other processes sharing the
+/// directory never see a partial object.
+std::expected<void, std::string>
+WriteFileAtomically(const std::filesystem::path& path, std::string_view data);
+
+struct MaterializeResult
+{
+	size_t written = 0;
+	/// Objects already in the LFS store, or listed more than once
+	size_t skipped = 0;
+};
+
+/// Writes every object listed in the LFS manifest of `gitRoot` into its LFS store, reading the
+/// contents back out of the SVN repository on `threads` threads. Every object is checked against
+/// its oid. With a `sharedStore`, objects are written there and linked into `gitRoot`. The
+/// manifest is removed once all objects are written.
+std::expected<MaterializeResult, std::string> MaterializeLFSObjects(
+	const std::string& svnRepositoryPath, const std::filesystem::path& gitRoot,
+	const std::optional<std::filesystem::path>& sharedStore, unsigned int threads
+);
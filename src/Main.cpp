@@ -1,33 +1,147 @@
+#include "Analyze.hpp"
+#include "BranchCache.hpp"
 #include "Config.hpp"
+#include "Dump.hpp"
 #include "ExampleConfig.hpp"
 #include "Git.hpp"
+#include "Lfs.hpp"
+#include "Marks.hpp"
+#include "Memory.hpp"
+#include "Prefetch.hpp"
+#include "Reader.hpp"
+#include "Repack.hpp"
+#include "Spool.hpp"
 #include "Svn.hpp"
 #include "Utils.hpp"
+#include "Verify.hpp"
+#include "Watch.hpp"
 #include "Writer.hpp"
 
 #include <apr_general.h>
 #include <argparse/argparse.hpp>
 #include <fmt/format.h>
 #include <fmt/ostream.h>
+#include <fmt/ranges.h>
 #include <git2.h>
-#include <git2/branch.h>
+#include <git2/blob.h>
 #include <git2/errors.h>
 #include <git2/global.h>
+#include <git2/object.h>
 #include <git2/refs.h>
 #include <git2/repository.h>
+#include <git2/revparse.h>
 #include <git2/types.h>
 #include <re2/re2.h>
 #include <subprocess.h>
 
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
+#include <cstddef>
 #include <cstdlib>
 #include <exception>
+#include <expected>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <pthread.h>
+#include <span>
 #include <string>
+#include <string_view>
 #include <sys/signal.h>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Stop revision meaning "until the dump stream ends", when reading from a dump
+static constexpr long int kEndOfDump = std::numeric_limits<long int>::max();
+static constexpr long int kDumpProgressInterval = 1000;
+// Upper bound on how long --watch sleeps between checks, in case a change notification is missed
+static constexpr std::chrono::milliseconds kWatchPollInterval{1000};
+// --watch summarizes the latency of every this many revisions, rather than keeping them all
+static constexpr size_t kLatencyReportRevisions = 1000;
+// Every checkpoint makes fast-import write a new pack, so --watch checkpoints once this long has
+// passed since the last one, or once this many revisions are waiting, rather than every batch
+static constexpr std::chrono::milliseconds kWatchCheckpointInterval{5000};
+static constexpr long int kWatchCheckpointRevisions = 1000;
+// How often --batch rechecks the heap budget while waiting to start a conversion
+static constexpr std::chrono::milliseconds kBatchPollInterval{1000};
+
+// How many of the most memory hungry revisions --memory-stats lists
+static constexpr size_t kHungriestRevisions = 10;
+static constexpr size_t kMiB = 1024 * 1024;
+
+// --active-branches is sized to hold the branches of this share of the commits in the tail of
+// the branch index that went back to a branch committed to before
+static constexpr double kActiveBranchesShare = 0.99;
+static constexpr size_t kActiveBranchesHistoryBytes = 4 * kMiB;
+// Every active branch keeps its whole tree in fast-import's memory
+static constexpr size_t kMaxActiveBranches = 512;
+
+// Set by SIGINT/SIGTERM in --watch mode, to finish the current revision and shut down cleanly
+static volatile std::sig_atomic_t gStopRequested = 0;
+
+void RequestStop(int /*signal*/)
+{
+	gStopRequested = 1;
+}
+
+/// Summarise how long new revisions took to become visible in git while watching
+void LogLatencies(std::vector<std::chrono::milliseconds> latencies)
+{
+	if (latencies.empty())
+	{
+		return;
+	}
+
+	auto percentile = [&](size_t percent)
+	{
+		const size_t index = (latencies.size() - 1) * percent / 100;
+		auto nth = latencies.begin() + static_cast<std::ptrdiff_t>(index);
+		std::ranges::nth_element(latencies, nth);
+		return nth->count();
+	};
+	Log("Converted {} new revisions while watching, latency p50 {}ms, p95 {}ms, max {}ms",
+		latencies.size(), percentile(50), percentile(95), percentile(100));
+}
+
+/// What converting one revision took, for --memory-stats
+struct RevisionMemory
+{
+	long int revision = 0;
+	size_t files = 0;
+	/// File contents read into memory
+	size_t contentBytes = 0;
+	/// The most the heap held at any point sampled while converting the revision, without the
+	/// svn cache
+	size_t heapPeak = 0;
+};
+
+/// Heap use without the svn cache. libsvn allocates the whole cache at once on first use, so
+/// it is in every figure mallinfo2 gives from then on without growing with what is converted.
+size_t WithoutSvnCache(size_t heap)
+{
+	const size_t cache = svn::GetCacheSize();
+	return heap > cache ? heap - cache : 0;
+}
+
+void LogMemoryStats(std::span<const RevisionMemory> hungriest)
+{
+	Log("Peak resident set size {} MiB, with a {} MiB svn cache",
+		GetPeakResidentBytes() / kMiB, svn::GetCacheSize() / kMiB);
+	for (const RevisionMemory& usage : hungriest)
+	{
+		Log("r{}: heap peak {} MiB, {} files, {} MiB of contents", usage.revision,
+			usage.heapPeak / kMiB, usage.files, usage.contentBytes / kMiB);
+	}
+}
 
 struct LibGit2Init
 {
@@ -60,244 +174,1624 @@ GetExistingGitStatus(const std::filesystem::path& path, Git::StartingState* outS
 		git_repository_init(&gitRepo, path.c_str(), false);
 		outState->isRepoEmpty = true;
 		gitRootPath = path / ".git";
+		git_repository_free(gitRepo);
+		return gitRootPath;
 	}
-	else
-	{
-		gitRootPath = git_repository_path(gitRepo);
-		outState->isRepoEmpty = static_cast<bool>(git_repository_is_empty(gitRepo));
 
-		git_branch_iterator* branchIt = nullptr;
-		git_branch_iterator_new(&branchIt, gitRepo, GIT_BRANCH_LOCAL);
+	gitRootPath = git_repository_path(gitRepo);
+	outState->isRepoEmpty = static_cast<bool>(git_repository_is_empty(gitRepo));
+
+	// Branches are looked up one at a time as the conversion reaches them, rather than listing
+	// every ref up front. The repository stays open for as long as the state is used.
+	std::shared_ptr<git_repository> repository(gitRepo, git_repository_free);
 
+	const auto refExists = [repository](const std::string& refName)
+	{
 		git_reference* ref = nullptr;
-		git_branch_t type{};
+		if (git_reference_lookup(&ref, repository.get(), refName.c_str()) != 0)
+		{
+			return false;
+		}
+		git_reference_free(ref);
+		return true;
+	};
+	outState->branchExists = [refExists](std::string_view branch)
+	{ return refExists(fmt::format("refs/heads/{}", branch)); };
+	outState->tagExists = [refExists](std::string_view tag)
+	{ return refExists(fmt::format("refs/tags/{}", tag)); };
 
-		while (git_branch_next(&ref, &type, branchIt) == 0)
+	outState->readRoutedPaths = [repository](std::string_view branch)
+	{
+		const std::string spec = fmt::format("refs/heads/{}:.gitattributes", branch);
+		git_object* attributes = nullptr;
+		if (git_revparse_single(&attributes, repository.get(), spec.c_str()) != 0)
 		{
-			const char* name = nullptr;
-			git_branch_name(&name, ref);
+			return std::vector<std::string>{};
+		}
 
-			outState->existingBranches.emplace_back(name);
+		std::vector<std::string> paths;
+		if (git_object_type(attributes) == GIT_OBJECT_BLOB)
+		{
+			auto* blob = reinterpret_cast<git_blob*>(attributes);
+			paths = Git::ParseRoutedPaths(
+				{static_cast<const char*>(git_blob_rawcontent(blob)),
+				 static_cast<size_t>(git_blob_rawsize(blob))}
+			);
+		}
+		git_object_free(attributes);
+		return paths;
+	};
 
-			git_reference_free(ref);
+	// Only new tags look commits up, so the indexes are read for each rather than kept open. Both
+	// grow between --watch batches.
+	outState->findBranchCommit = [gitRootPath](std::string_view branch, long int revision)
+		-> std::optional<std::string>
+	{
+		const std::string branchName(branch);
+		auto revisions = GetBranchRevisions(gitRootPath, std::span(&branchName, 1));
+		auto marks = MarkIndex::Open(gitRootPath / kMarkIndexPath);
+		if (!revisions || !marks)
+		{
+			Log("WARNING: Can't find the commit of {:?} at r{}: {}", branch, revision,
+				revisions ? marks.error() : revisions.error());
+			return std::nullopt;
 		}
-		git_branch_iterator_free(branchIt);
-	}
-	git_repository_free(gitRepo);
+		const auto next = std::ranges::upper_bound(*revisions, revision);
+		if (next == revisions->begin())
+		{
+			return std::nullopt;
+		}
+		return marks->Lookup(*std::prev(next));
+	};
 
 	return gitRootPath;
 }
 
-int main(int argc, char* argv[])
+/// The directory --spool keeps its SpoolState in
+std::filesystem::path GetSpoolDirectory(const std::string& spoolPath)
 {
-	std::signal(SIGPIPE, SIG_IGN);
-	argparse::ArgumentParser program("svn-lfs-export", PROJECT_VERSION);
-
-	std::string configPath;
+	return std::filesystem::absolute(spoolPath).parent_path();
+}
 
-	program.add_argument("-r", "--revision")
-		.help("start revision, or range of revisions FIRST:LAST, to operate on")
-		.metavar("REV");
-	program.add_argument("--config")
-		.help("location of config.toml file")
-		.metavar("FILE")
-		.default_value(std::string{"config.toml"})
-		.nargs(1)
-		.store_into(configPath);
-	program.add_argument("--example-config").help("output example config.toml file").flag();
+/// What a --spool run starts from: the branches earlier spools wrote, which the git repository
+/// doesn't have until they are replayed, as well as the branches the repository has.
+Git::StartingState
+GetSpoolStartingState(std::shared_ptr<const SpoolState> spooled, Git::StartingState repository)
+{
+	Git::StartingState state;
+	state.isRepoEmpty =
+		repository.isRepoEmpty && spooled->lastRevision == 0 && spooled->branches.empty();
+	state.branchExists = [spooled, repository](std::string_view branch)
+	{
+		return spooled->branches.contains(branch) ||
+			   (repository.branchExists && repository.branchExists(branch));
+	};
+	state.tagExists = [spooled, repository](std::string_view tag)
+	{ return spooled->tags.contains(tag) || (repository.tagExists && repository.tagExists(tag)); };
+	state.readRoutedPaths = [spooled, repository](std::string_view branch)
+	{
+		if (spooled->branches.contains(branch))
+		{
+			const auto routed = spooled->routedPaths.find(branch);
+			return routed == spooled->routedPaths.end()
+					   ? std::vector<std::string>{}
+					   : std::vector<std::string>(routed->second.begin(), routed->second.end());
+		}
+		return repository.readRoutedPaths ? repository.readRoutedPaths(branch)
+										  : std::vector<std::string>{};
+	};
+	// findBranchCommit stays unset: spooled commits aren't in the mark index until replayed
+	return state;
+}
 
-	try
+/// The SpoolState after a --spool run: what earlier spools wrote, plus what `target` wrote up to
+/// `lastRevision`.
+SpoolState
+UpdateSpoolState(const SpoolState* previous, const Git::Target& target, long int lastRevision)
+{
+	SpoolState state = previous ? *previous : SpoolState{};
+	state.lastRevision = std::max(state.lastRevision, lastRevision);
+	state.branches.insert(target.seenBranches.begin(), target.seenBranches.end());
+	for (const auto& [branch, exists] : target.existingBranches)
 	{
-		program.parse_args(argc, argv);
+		if (exists)
+		{
+			state.branches.insert(branch);
+		}
 	}
-	catch (const std::exception& err)
+	for (const auto& [tag, mark] : target.tags)
 	{
-		std::cerr << err.what() << '\n';
-		std::cerr << program;
-		return EXIT_FAILURE;
+		state.tags.insert(tag);
 	}
-
-	if (program["--example-config"] == true)
+	for (const auto& [branch, paths] : target.lfsRoutedPaths)
 	{
-		std::cout << kExampleConfig << '\n';
-		return EXIT_SUCCESS;
+		state.routedPaths[branch].insert(paths.begin(), paths.end());
 	}
+	return state;
+}
 
-	LibGit2Init libGit;
-	LibAprInit libApr;
+/// Revisions the repository's branch_origin refers to as marks (":1234"), the only marks its
+/// fast-import has to load
+std::vector<long int> GetReferencedMarks(const GitRepository& gitRepo)
+{
+	static const RE2 kMarkRe(R"(:(\d+))");
+	std::vector<long int> marks;
+	for (const auto& [branch, origin] : gitRepo.branchOrigins)
+	{
+		std::string_view input = origin;
+		long int mark = 0;
+		while (RE2::FindAndConsume(&input, kMarkRe, &mark))
+		{
+			marks.push_back(mark);
+		}
+	}
+	std::ranges::sort(marks);
+	const auto duplicates = std::ranges::unique(marks);
+	marks.erase(duplicates.begin(), duplicates.end());
+	return marks;
+}
 
-	const auto maybeConfig = Config::FromFile(configPath);
+/// Parse a -r range: "1234", "1234:5678" or "1234:HEAD"
+std::optional<std::pair<long int, long int>>
+ParseRevisionRange(const std::string& range, long int head)
+{
+	long int first = 0;
+	long int last = head;
+	if (RE2::FullMatch(range, "(\\d+):(\\d+)", &first, &last) ||
+		RE2::FullMatch(range, "(\\d+)(?::HEAD)?", &first))
+	{
+		return std::pair{first, last};
+	}
+	return std::nullopt;
+}
 
-	if (!maybeConfig)
+/// Check every git repository against svn, see VerifyConversion
+bool VerifyRepositories(
+	const Config& config, const std::optional<std::string>& revisionRange,
+	std::optional<size_t> sample, unsigned int threads
+)
+{
+	bool success = true;
+	for (size_t repository = 0; repository < config.gitRepos.size(); ++repository)
 	{
-		std::cerr << maybeConfig.error() << '\n';
-		return EXIT_FAILURE;
+		const GitRepository& gitRepo = config.gitRepos[repository];
+		Git::StartingState state;
+		const std::filesystem::path gitRoot = GetExistingGitStatus(gitRepo.path, &state);
+
+		auto marker = GetLastWrittenRevision(gitRoot);
+		auto marks = MarkIndex::Open(gitRoot / kMarkIndexPath);
+		if (!marker || !marks)
+		{
+			Log("ERROR: {}", marker ? marks.error() : marker.error());
+			return false;
+		}
+
+		const long int head = marker->value_or(0);
+		auto range = revisionRange ? ParseRevisionRange(*revisionRange, head)
+								   : std::optional{std::pair{1L, head}};
+		if (!range)
+		{
+			Log("Unknown revision range {:?}. Use the format -r 1234, -r 1234:5678 or -r 1234:HEAD",
+				*revisionRange);
+			return false;
+		}
+
+		Log("Verifying {:?} from r{} to r{}", gitRepo.path, range->first, range->second);
+		auto verified = VerifyConversion(
+			config, repository, gitRoot, *marks, range->first, range->second, sample, threads
+		);
+		if (!verified)
+		{
+			Log("ERROR: {}", verified.error());
+			return false;
+		}
+		Log("Verified {} files in {} revisions of {:?}, {} mismatches", verified->files,
+			verified->revisions, gitRepo.path, verified->mismatches);
+		success = success && verified->mismatches == 0;
 	}
+	return success;
+}
 
-	const Config& config = maybeConfig.value();
+/// Write the AnalyzeRepository report for a -r range (all of history by default) to `reportPath`
+bool AnalyzeToFile(
+	const Config& config, const std::string& reportPath,
+	const std::optional<std::string>& revisionRange, unsigned int threads
+)
+{
+	auto repository = svn::Repository::Open(config.svnRepo);
+	if (!repository)
+	{
+		Log("ERROR: {}", repository.error());
+		return false;
+	}
+	auto youngest = repository->GetYoungestRevision();
+	if (!youngest)
+	{
+		Log("ERROR: {}", youngest.error());
+		return false;
+	}
 
-	Git::StartingState gitState;
-	std::filesystem::path gitRoot = GetExistingGitStatus(config.gitRepo, &gitState);
+	auto range = revisionRange ? ParseRevisionRange(*revisionRange, *youngest)
+							   : std::optional{std::pair{1L, *youngest}};
+	if (!range)
+	{
+		Log("Unknown revision range {:?}. Use the format -r 1234, -r 1234:5678 or -r 1234:HEAD",
+			*revisionRange);
+		return false;
+	}
 
-	subprocess_s gitProcess{};
+	Log("Analyzing r{} to r{}", range->first, range->second);
+	auto report = AnalyzeRepository(config, range->first, range->second, threads);
+	if (!report)
 	{
-		std::filesystem::path marksPath = gitRoot / "svn_lfs_export_marks";
+		Log("ERROR: {}", report.error());
+		return false;
+	}
+	std::ofstream file{reportPath};
+	file << *report;
+	if (!file.flush().good())
+	{
+		Log("ERROR: Could not write the analysis to {:?}", reportPath);
+		return false;
+	}
+	Log("Wrote the analysis to {:?}", reportPath);
+	return true;
+}
 
-		std::string gitDirFlag = fmt::format("--git-dir={}", gitRoot.c_str());
-		std::string exportMarksFlag = fmt::format("--export-marks={}", marksPath.c_str());
-		std::string importMarksFlag = fmt::format("--import-marks-if-exists={}", marksPath.c_str());
+/// A git repository being written to, and the fast-import process (or spool) writing it
+struct Output
+{
+	std::string path;
+	std::filesystem::path gitRoot;
+	Git::StartingState state;
+	subprocess_s process{};
+	std::optional<FastImportProcess> writer;
+	/// With --spool, commands are recorded here and no fast-import process is started
+	std::unique_ptr<FastImportSpool> spool;
+	/// What earlier spools wrote, if any were recorded in the same directory
+	std::shared_ptr<const SpoolState> spoolState;
+	std::optional<MarkIndex> marks;
+	/// Revisions up to and including this one are already in the repository
+	long int resumeAfter = 0;
+	/// Passed to fast-import, which otherwise uses BranchWorkingSet::kFastImportDefault
+	std::optional<size_t> activeBranches;
+	/// fast-import was started, and hasn't been waited for by FinishFastImport
+	bool processCreated = false;
+	bool processRunning = false;
 
-		const std::array subprocessArgs{
-			"git",
-			gitDirFlag.c_str(),
-			"fast-import",
-			"--done",
-			exportMarksFlag.c_str(),
-			importMarksFlag.c_str(),
-			static_cast<const char*>(nullptr),
-		};
+	Output() = default;
+	Output(const Output&) = delete;
+	Output& operator=(const Output&) = delete;
 
-		int result = subprocess_create(
-			subprocessArgs.data(), subprocess_option_search_user_path, &gitProcess
-		);
-		if (result != 0)
+	/// A fast-import left running by an early return has its input closed without "done", so it
+	/// exits without updating any refs, and is waited for here.
+	~Output()
+	{
+		if (processRunning)
 		{
-			Log("ERROR: Could not create git fast-import subprocess for {:?}",
-				config.gitRepo.c_str());
-			return EXIT_FAILURE;
+			int processReturn = 0;
+			subprocess_join(&process, &processReturn);
+		}
+		if (processCreated)
+		{
+			subprocess_destroy(&process);
 		}
 	}
 
-	FastImportProcess writer(subprocess_stdin(&gitProcess), gitRoot);
-	Git git(config, writer, gitState);
+	/// Marks given to fast-import, and the marks it writes back, for this run only
+	std::filesystem::path ImportMarksPath() const
+	{
+		return gitRoot / "svn_lfs_export_marks_import";
+	}
+	std::filesystem::path ExportMarksPath() const
+	{
+		return gitRoot / "svn_lfs_export_marks_export";
+	}
+
+	IFastImport& Writer()
+	{
+		return spool ? static_cast<IFastImport&>(*spool) : static_cast<IFastImport&>(*writer);
+	}
+};
 
-	auto maybeRepository = svn::Repository::Open(config.svnRepo);
-	if (!maybeRepository)
+/// An --active-branches that holds the branches recent commits in the branch index went back to,
+/// unset if there's no history to go by.
+std::optional<size_t> SizeActiveBranches(const std::filesystem::path& gitRoot)
+{
+	auto recent = GetRecentBranchCommits(gitRoot, kActiveBranchesHistoryBytes);
+	if (!recent)
 	{
-		Log("ERROR: {}", maybeRepository.error());
-		return EXIT_FAILURE;
+		Log("WARNING: {}", recent.error());
+		return std::nullopt;
+	}
+	if (recent->empty())
+	{
+		return std::nullopt;
 	}
-	svn::Repository& repository = *maybeRepository;
 
-	auto maybeYoungest = repository.GetYoungestRevision();
-	if (!maybeYoungest)
+	BranchWorkingSet workingSet;
+	for (const std::string& branch : *recent)
 	{
-		Log("ERROR: {}", maybeYoungest.error());
-		return EXIT_FAILURE;
+		workingSet.Commit(branch);
 	}
-	long int youngestRev = *maybeYoungest;
+	const size_t size = std::clamp(
+		workingSet.CacheSizeFor(kActiveBranchesShare), BranchWorkingSet::kFastImportDefault,
+		kMaxActiveBranches
+	);
+	Log("Using --active-branches={} for {:?}, going by its last {} commits", size,
+		gitRoot.c_str(), recent->size());
+	return size;
+}
 
-	auto revisionRange = program.present<std::string>("--revision");
-	long int startRevision{};
-	long int stopRevision{};
+/// With `force`, fast-import may rewrite branches rather than only fast-forward them. Without
+/// output.activeBranches, it's sized from the branch index.
+std::expected<void, std::string> StartFastImport(
+	Output& output, const Config& config, std::span<const long int> referencedMarks, bool force
+)
+{
+	auto marks = MarkIndex::Open(output.gitRoot / kMarkIndexPath);
+	if (!marks)
+	{
+		return std::unexpected(marks.error());
+	}
+	output.marks.emplace(std::move(*marks));
 
-	if (!revisionRange.has_value())
+	// Earlier versions kept every mark in fast-import's own marks file, move them to the index
+	const std::filesystem::path legacyMarksPath = output.gitRoot / "svn_lfs_export_marks";
+	if (std::filesystem::exists(legacyMarksPath))
 	{
-		auto marker = writer.GetLastWrittenRevision();
-		if (!marker)
+		auto migrated = output.marks->AddMarksFile(legacyMarksPath);
+		if (!migrated)
 		{
-			Log("ERROR: {}", marker.error());
-			return EXIT_FAILURE;
+			return std::unexpected(migrated.error());
 		}
+		std::filesystem::remove(legacyMarksPath);
+	}
+
+	// Only the marks this run can refer to are loaded, the rest of history stays in the index
+	auto imported = output.marks->WriteMarksFile(output.ImportMarksPath(), referencedMarks);
+	if (!imported)
+	{
+		return std::unexpected(imported.error());
+	}
+
+	std::string gitDirFlag = fmt::format("--git-dir={}", output.gitRoot.c_str());
+	std::string exportMarksFlag =
+		fmt::format("--export-marks={}", output.ExportMarksPath().c_str());
+	std::string importMarksFlag =
+		fmt::format("--import-marks={}", output.ImportMarksPath().c_str());
+	if (!output.activeBranches)
+	{
+		output.activeBranches = SizeActiveBranches(output.gitRoot);
+	}
+	std::string activeBranchesFlag = fmt::format(
+		"--active-branches={}",
+		output.activeBranches.value_or(BranchWorkingSet::kFastImportDefault)
+	);
+
+	const std::array subprocessArgs{
+		"git",
+		gitDirFlag.c_str(),
+		"fast-import",
+		"--done",
+		exportMarksFlag.c_str(),
+		importMarksFlag.c_str(),
+		activeBranchesFlag.c_str(),
+		force ? "--force" : static_cast<const char*>(nullptr),
+		static_cast<const char*>(nullptr),
+	};
+
+	// Ctrl-C goes to the whole foreground process group. fast-import must not see it, so --watch
+	// can still finish the stream cleanly, and it ends anyway once its input closes. The signal
+	// mask is per thread and kept across exec, so only this thread blocks SIGINT while it starts
+	// fast-import. The process's handler stays in place and other threads still receive it.
+	sigset_t interrupt;
+	sigset_t previousMask;
+	sigemptyset(&interrupt);
+	sigaddset(&interrupt, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &interrupt, &previousMask);
+	const int result = subprocess_create(
+		subprocessArgs.data(), subprocess_option_search_user_path, &output.process
+	);
+	pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+	if (result != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not create git fast-import subprocess for {:?}", output.path)
+		);
+	}
 
-		if (marker->has_value())
+	output.processCreated = true;
+	output.processRunning = true;
+	output.writer.emplace(
+		subprocess_stdin(&output.process), subprocess_stdout(&output.process), output.gitRoot,
+		config.lfsStore
+	);
+	return {};
+}
+
+/// End fast-import's input, wait for it to finish, and add the commits it wrote to the mark
+/// index. Returns whether the run (`success` so far) succeeded.
+bool FinishFastImport(Output& output, bool success)
+{
+	if (success)
+	{
+		output.writer->Done();
+	}
+
+	int processReturn = 0;
+	int result = subprocess_join(&output.process, &processReturn);
+	output.processRunning = false;
+	if (result != 0 || processReturn != 0)
+	{
+		if (success)
 		{
-			startRevision = marker->value() + 1;
+			Log("ERROR: An error occurred waiting for git fast-import for {:?}!", output.path);
 		}
-		else if (gitState.isRepoEmpty)
+		success = false;
+	}
+
+	// Record the commits fast-import wrote before the resume marker moves past them
+	if (success)
+	{
+		auto added = output.writer->WriteBranchIndex();
+		if (added)
 		{
-			startRevision = 1;
+			added = output.marks->AddMarksFile(output.ExportMarksPath());
 		}
-		else
+		if (!added)
 		{
-			Log(
-				"ERROR: The git repository has commits but no resume marker. Pass -r <rev>:HEAD to continue manually."
-			);
-			return EXIT_FAILURE;
+			Log("ERROR: {}", added.error());
+			success = false;
 		}
-		stopRevision = youngestRev;
 	}
-	else if (RE2::FullMatch(*revisionRange, "(\\d+):(\\d+)", &startRevision, &stopRevision))
+	std::filesystem::remove(output.ImportMarksPath());
+	std::filesystem::remove(output.ExportMarksPath());
+	return success;
+}
+
+/// Feed spools recorded with --spool into the repository, skipping what it already has
+bool ReplaySpools(const Config& config, std::span<const std::string> spoolPaths)
+{
+	Output output;
+	output.path = config.gitRepos.front().path;
+	output.gitRoot = GetExistingGitStatus(output.path, &output.state);
+
+	auto marker = GetLastWrittenRevision(output.gitRoot);
+	if (!marker)
 	{
+		Log("ERROR: {}", marker.error());
+		return false;
 	}
-	else if (RE2::FullMatch(*revisionRange, "(\\d+)(?::HEAD)?", &startRevision))
+	long int lastReplayed = marker->value_or(0);
+
+	auto started =
+		StartFastImport(output, config, GetReferencedMarks(config.gitRepos.front()), false);
+	if (!started)
 	{
-		stopRevision = youngestRev;
+		Log("ERROR: {}", started.error());
+		return false;
 	}
-	else
+
+	bool success = true;
+	for (const std::string& spoolPath : spoolPaths)
 	{
-		Log("Unknown revision range {:?}. Use the format -r 1234, -r 1234:5678 or -r 1234:HEAD",
-			*revisionRange);
-		return EXIT_FAILURE;
+		auto replayed = ReplaySpool(spoolPath, *output.writer, lastReplayed);
+		if (replayed)
+		{
+			if (auto flushed = output.writer->Flush(); !flushed)
+			{
+				replayed = std::unexpected(flushed.error());
+			}
+		}
+		if (!replayed)
+		{
+			Log("ERROR: {}", replayed.error());
+			success = false;
+			break;
+		}
+		Log("Replayed {:?} up to r{} ({} of {} segments already present)", spoolPath,
+			replayed->lastRevision, replayed->skipped, replayed->segments);
+		lastReplayed = replayed->lastRevision;
 	}
 
-	if (startRevision > stopRevision)
+	success = FinishFastImport(output, success);
+	if (success)
 	{
-		Log("Already up to date at r{}", stopRevision);
+		SaveLastWrittenRevision(output.gitRoot, lastReplayed);
 	}
-	else
+	return success;
+}
+
+/// What one Convert() call did
+struct ConversionStats
+{
+	long int revisions = 0;
+	/// The last revision converted, or the one before the first if none were
+	long int lastRevision = 0;
+};
+
+/// Convert the svn history of `config` into its git repositories, as the command line asks.
+/// Returns the exit code. `stats`, if given, is filled in with what was converted.
+int Convert(
+	const Config& config, const argparse::ArgumentParser& program,
+	std::chrono::steady_clock::time_point startTime, ConversionStats* stats = nullptr
+)
+{
+	const bool deferLFS = program["--defer-lfs"] == true;
+	const auto onlyBranches = program.present<std::vector<std::string>>("--only-branch");
+	const bool watch = program["--watch"] == true;
+	const auto bootstrapRevision = program.present<long int>("--bootstrap");
+	const auto spoolPath = program.present<std::string>("--spool");
+	const auto activeBranches = program.present<size_t>("--active-branches");
+
+	// One fast-import process per git repository, all fed from the same pass over SVN
+	std::vector<std::unique_ptr<Output>> outputs;
+	for (const GitRepository& gitRepo : config.gitRepos)
 	{
-		Log("Running from r{} to r{}", startRevision, stopRevision);
+		Output& output = *outputs.emplace_back(std::make_unique<Output>());
+		output.path = gitRepo.path;
+		output.gitRoot = GetExistingGitStatus(gitRepo.path, &output.state);
+		output.activeBranches = activeBranches;
+
+		if (spoolPath)
+		{
+			auto spool = FastImportSpool::Create(*spoolPath);
+			if (!spool)
+			{
+				Log("ERROR: {}", spool.error());
+				return EXIT_FAILURE;
+			}
+			output.spool = std::move(*spool);
+
+			auto spooled = ReadSpoolState(GetSpoolDirectory(*spoolPath));
+			if (!spooled)
+			{
+				Log("ERROR: {}", spooled.error());
+				return EXIT_FAILURE;
+			}
+			if (*spooled)
+			{
+				output.spoolState = std::make_shared<const SpoolState>(std::move(**spooled));
+				output.state = GetSpoolStartingState(output.spoolState, std::move(output.state));
+				Log("Carrying on from the spools recorded up to r{}",
+					output.spoolState->lastRevision);
+			}
+		}
 	}
 
-	const long int totalRevisions = stopRevision - startRevision + 1;
-	const long int progressInterval = std::max(1L, totalRevisions / 100);
+	// Revisions either come from an on-disk repository, or are parsed from a dump stream in one
+	// pass, in which case the youngest revision isn't known up front
+	std::optional<svn::Repository> repository;
+	std::unique_ptr<svn::ContentReader> reader;
+	std::unique_ptr<svn::DumpSource> dump;
+	long int youngestRev = kEndOfDump;
 
-	bool success = true;
-	for (long int revNum = startRevision; revNum <= stopRevision; revNum++)
+	if (config.svnDump)
 	{
-		auto svnRevision = repository.GetRevision(revNum);
-		if (!svnRevision)
+		std::filesystem::path spool = outputs.front()->gitRoot / "svn_lfs_export_dump_spool";
+		auto maybeDump =
+			svn::DumpSource::Open(*config.svnDump, spool, program["--prune-dump-texts"] == true);
+		if (!maybeDump)
 		{
-			success = false;
-			Log("Error converting r{}:\n{}", revNum, svnRevision.error());
-			break;
+			Log("ERROR: {}", maybeDump.error());
+			return EXIT_FAILURE;
 		}
-		auto result = git.WriteCommit(*svnRevision);
-
-		if (!result.has_value())
+		dump = std::move(*maybeDump);
+	}
+	else
+	{
+		auto maybeRepository = svn::Repository::Open(config.svnRepo);
+		if (!maybeRepository)
 		{
-			success = false;
-			Log("Error converting r{}:\n{}", revNum, result.error());
-			break;
+			Log("ERROR: {}", maybeRepository.error());
+			return EXIT_FAILURE;
 		}
+		repository = std::move(*maybeRepository);
 
-		if (!writer.Flush())
+		const auto jobs = program.get<unsigned int>("--jobs");
+		auto maybeReader = svn::ContentReader::Open(config.svnRepo, jobs);
+		if (!maybeReader)
 		{
-			success = false;
-			Log("Error git fast-import pipe broke at r{} (process died?)", revNum);
-			break;
+			Log("ERROR: {}", maybeReader.error());
+			return EXIT_FAILURE;
 		}
+		reader = std::move(*maybeReader);
 
-		const long int converted = revNum - startRevision + 1;
-		if (converted % progressInterval == 0 || revNum == stopRevision)
+		auto maybeYoungest = repository->GetYoungestRevision();
+		if (!maybeYoungest)
 		{
-			const long int percent = 100 * converted / totalRevisions;
-			Log("Converting {}% [{}/{}]", percent, converted, totalRevisions);
+			Log("ERROR: {}", maybeYoungest.error());
+			return EXIT_FAILURE;
 		}
+		youngestRev = *maybeYoungest;
 	}
-	if (success)
+
+	auto revisionRange = program.present<std::string>("--revision");
+	long int startRevision{};
+	long int stopRevision{};
+
+	if (onlyBranches.has_value() && !revisionRange.has_value())
 	{
-		writer.Done();
+		startRevision = 1;
+		stopRevision = youngestRev;
 	}
-
-	int processReturn = 0;
-	int result = subprocess_join(&gitProcess, &processReturn);
-	if (result != 0 || processReturn != 0)
+	else if (!revisionRange.has_value())
 	{
-		if (success)
+		// Resume from the repository that is furthest behind, the others skip revisions they
+		// already have
+		startRevision = kEndOfDump;
+		for (auto& output : outputs)
 		{
-			Log("ERROR: An error occurred waiting for git fast-import!");
+			// Spools carry on from each other, the repository only moves on when they're replayed
+			auto marker = output->spoolState
+							  ? std::expected<std::optional<long int>, std::string>(
+									output->spoolState->lastRevision
+								)
+							  : GetLastWrittenRevision(output->gitRoot);
+			if (!marker)
+			{
+				Log("ERROR: {}", marker.error());
+				return EXIT_FAILURE;
+			}
+
+			if (marker->has_value())
+			{
+				output->resumeAfter = marker->value();
+			}
+			else if (output->state.isRepoEmpty)
+			{
+				output->resumeAfter = 0;
+			}
+			else
+			{
+				Log(
+					"ERROR: The git repository {:?} has commits but no resume marker. Pass -r <rev>:HEAD to continue manually.",
+					output->path
+				);
+				return EXIT_FAILURE;
+			}
+			startRevision = std::min(startRevision, output->resumeAfter + 1);
 		}
-		success = false;
+		stopRevision = youngestRev;
 	}
-
-	if (success && !revisionRange.has_value())
+	else if (auto range = ParseRevisionRange(*revisionRange, youngestRev))
 	{
-		writer.SaveLastWrittenRevision(stopRevision);
+		std::tie(startRevision, stopRevision) = *range;
+	}
+	else
+	{
+		Log("Unknown revision range {:?}. Use the format -r 1234, -r 1234:5678 or -r 1234:HEAD",
+			*revisionRange);
+		return EXIT_FAILURE;
 	}
 
-	subprocess_destroy(&gitProcess);
+	if (bootstrapRevision)
+	{
+		for (const auto& output : outputs)
+		{
+			if (!output->state.isRepoEmpty || output->resumeAfter != 0)
+			{
+				Log("ERROR: --bootstrap only starts new git repositories, and {:?} isn't empty.",
+					output->path);
+				return EXIT_FAILURE;
+			}
+		}
+		if (*bootstrapRevision > youngestRev)
+		{
+			Log("ERROR: Can't bootstrap from r{}, the youngest revision is r{}.",
+				*bootstrapRevision, youngestRev);
+			return EXIT_FAILURE;
+		}
+		startRevision = *bootstrapRevision;
+	}
+
+	// Re-exporting branches only visits the revisions the branch index says wrote to them
+	std::optional<std::vector<long int>> selectedRevisions;
+	if (onlyBranches.has_value())
+	{
+		selectedRevisions.emplace();
+		for (auto& output : outputs)
+		{
+			auto revisions = GetBranchRevisions(output->gitRoot, *onlyBranches);
+			if (!revisions)
+			{
+				Log("ERROR: {}", revisions.error());
+				return EXIT_FAILURE;
+			}
+			for (const long int revision : *revisions)
+			{
+				if (revision >= startRevision && revision <= stopRevision)
+				{
+					selectedRevisions->push_back(revision);
+				}
+			}
+		}
+		std::ranges::sort(*selectedRevisions);
+		const auto duplicates = std::ranges::unique(*selectedRevisions);
+		selectedRevisions->erase(duplicates.begin(), duplicates.end());
+		Log("Re-exporting {} from {} revisions", fmt::join(*onlyBranches, ", "),
+			selectedRevisions->size());
+	}
+
+	// Only started once everything above has been checked, so nothing is left to clean up
+	// after a mistake on the command line
+	for (size_t i = 0; i < outputs.size(); ++i)
+	{
+		Output& output = *outputs[i];
+		if (output.spool)
+		{
+			continue;
+		}
+		auto started = StartFastImport(
+			output, config, GetReferencedMarks(config.gitRepos[i]), onlyBranches.has_value()
+		);
+		if (!started)
+		{
+			Log("ERROR: {}", started.error());
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (startRevision > stopRevision)
+	{
+		Log("Already up to date at r{}", stopRevision);
+	}
+	else if (stopRevision == kEndOfDump)
+	{
+		Log("Running from r{} to the end of the dump", startRevision);
+	}
+	else
+	{
+		Log("Running from r{} to r{}", startRevision, stopRevision);
+	}
+
+	std::optional<Git::Target::BranchSet> branchSet;
+	if (onlyBranches.has_value())
+	{
+		branchSet.emplace(onlyBranches->begin(), onlyBranches->end());
+	}
+
+	std::vector<Git::Target> targets;
+	for (auto& output : outputs)
+	{
+		targets.push_back(
+			{.writer = &output->Writer(),
+			 .startingState = output->state,
+			 .resumeAfter = output->resumeAfter,
+			 .deferLFS = deferLFS,
+			 .onlyBranches = branchSet}
+		);
+	}
+	Git git(config, std::move(targets), reader.get());
+	const auto profilePath = program.present<std::string>("--profile-rules");
+	if (profilePath)
+	{
+		git.EnableRuleProfiling();
+	}
+
+	std::optional<std::ofstream> memoryStats;
+	std::vector<RevisionMemory> hungriest;
+	if (const auto memoryStatsPath = program.present<std::string>("--memory-stats"))
+	{
+		EnableMemoryAccounting();
+		memoryStats.emplace(*memoryStatsPath);
+		*memoryStats << "revision files content_bytes heap_peak_bytes\n";
+		Log("Heap before converting {} MiB", GetHeapInUse() / kMiB);
+	}
+
+	// The end of a dump isn't known, and subtracting from kEndOfDump would overflow
+	long int totalRevisions = 0;
+	if (selectedRevisions)
+	{
+		totalRevisions = static_cast<long int>(selectedRevisions->size());
+	}
+	else if (stopRevision != kEndOfDump)
+	{
+		totalRevisions = stopRevision - startRevision + 1;
+	}
+	const long int progressInterval =
+		stopRevision == kEndOfDump ? kDumpProgressInterval : std::max(1L, totalRevisions / 100);
+	long int lastConverted = startRevision - 1;
+	long int converted = 0;
+
+	const auto isSelected = [&](long int revNum)
+	{
+		return !selectedRevisions || std::ranges::binary_search(*selectedRevisions, revNum);
+	};
+
+	auto convert = [&](const svn::Revision& svnRevision) -> std::expected<void, std::string>
+	{
+		const long int revNum = svnRevision.GetNumber();
+		SampleHeap();
+		auto result = git.WriteCommit(svnRevision);
+
+		if (!result.has_value())
+		{
+			return std::unexpected(
+				fmt::format("Error converting r{}:\n{}", revNum, result.error())
+			);
+		}
+
+		for (auto& output : outputs)
+		{
+			if (output->spool)
+			{
+				auto ended = output->spool->EndRevision(revNum);
+				if (!ended)
+				{
+					return std::unexpected(ended.error());
+				}
+			}
+			else if (auto flushed = output->writer->Flush(); !flushed)
+			{
+				return std::unexpected(
+					fmt::format(
+						"Error writing r{} to {:?}: {}", revNum, output->path, flushed.error()
+					)
+				);
+			}
+		}
+		lastConverted = revNum;
+
+		if (memoryStats)
+		{
+			SampleHeap();
+			const RevisionMemory usage{
+				.revision = revNum,
+				.files = svnRevision.GetFiles().size(),
+				.contentBytes = TakeContentBytes(),
+				.heapPeak = WithoutSvnCache(TakeHeapPeak()),
+			};
+			fmt::print(
+				*memoryStats, "{} {} {} {}\n", usage.revision, usage.files, usage.contentBytes,
+				usage.heapPeak
+			);
+
+			hungriest.push_back(usage);
+			std::ranges::sort(hungriest, std::ranges::greater{}, &RevisionMemory::heapPeak);
+			if (hungriest.size() > kHungriestRevisions)
+			{
+				hungriest.pop_back();
+			}
+		}
+
+		converted++;
+		if (converted == 1)
+		{
+			// Dominates the run time of small incremental runs, so keep an eye on it
+			const auto startup = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - startTime
+			);
+			Log("First revision written {}ms after starting", startup.count());
+		}
+		if (revNum > stopRevision)
+		{
+			// Revisions found by --watch are logged as they become visible
+			return {};
+		}
+		if (stopRevision == kEndOfDump)
+		{
+			if (converted % progressInterval == 0)
+			{
+				Log("Converting r{}", revNum);
+			}
+		}
+		else if (converted % progressInterval == 0 || converted == totalRevisions)
+		{
+			const long int percent = 100 * converted / totalRevisions;
+			Log("Converting {}% [{}/{}]", percent, converted, totalRevisions);
+		}
+		return {};
+	};
+
+	bool success = true;
+	if (dump)
+	{
+		auto parsed = dump->Parse(
+			[&](const svn::Revision& svnRevision) -> std::expected<bool, std::string>
+			{
+				// Earlier revisions still have to be parsed, to know the state of the tree
+				if (svnRevision.GetNumber() < startRevision)
+				{
+					return true;
+				}
+				if (svnRevision.GetNumber() > stopRevision)
+				{
+					return false;
+				}
+				if (!isSelected(svnRevision.GetNumber()))
+				{
+					return true;
+				}
+				auto result = convert(svnRevision);
+				if (!result)
+				{
+					return std::unexpected(result.error());
+				}
+				return true;
+			},
+			startRevision - 1
+		);
+		if (!parsed)
+		{
+			success = false;
+			Log("{}", parsed.error());
+		}
+	}
+	else
+	{
+		auto prefetcher = svn::ShardPrefetcher::Open(config.svnRepo);
+		const auto couldMapBelow = [&](std::string_view directory)
+		{ return git.CouldMapBelow(directory); };
+		auto convertRange = [&](long int first, long int last)
+		{
+			for (long int revNum = first; revNum <= last && !gStopRequested; revNum++)
+			{
+				if (!isSelected(revNum))
+				{
+					continue;
+				}
+
+				prefetcher.Advance(revNum);
+				auto svnRevision = revNum == bootstrapRevision
+									   ? repository->GetSnapshot(revNum, couldMapBelow)
+									   : repository->GetRevision(revNum);
+				if (!svnRevision)
+				{
+					Log("Error converting r{}:\n{}", revNum, svnRevision.error());
+					return false;
+				}
+
+				auto result = convert(*svnRevision);
+				if (!result)
+				{
+					Log("{}", result.error());
+					return false;
+				}
+			}
+			return true;
+		};
+
+		// Make everything written so far visible in git, then move the resume markers past it
+		auto checkpoint = [&]
+		{
+			for (auto& output : outputs)
+			{
+				if (!output->writer->Checkpoint())
+				{
+					Log("ERROR: git fast-import for {:?} didn't checkpoint (process died?)",
+						output->path);
+					return false;
+				}
+				auto added = output->writer->WriteBranchIndex();
+				if (added)
+				{
+					added = output->marks->AddMarksFile(output->ExportMarksPath());
+				}
+				if (!added)
+				{
+					Log("ERROR: {}", added.error());
+					return false;
+				}
+				const long int written = std::max(lastConverted, output->resumeAfter);
+				SaveLastWrittenRevision(output->gitRoot, written);
+			}
+			return true;
+		};
+
+		success = convertRange(startRevision, stopRevision);
+
+		// Keep the repositories, rules and fast-import processes warm, and convert each new
+		// revision as soon as it's committed
+		if (success && watch)
+		{
+			auto watcher = svn::RevisionWatcher::Open(config.svnRepo);
+			if (!watcher)
+			{
+				Log("ERROR: {}", watcher.error());
+				success = false;
+			}
+			success = success && checkpoint();
+			if (success)
+			{
+				Log("Watching {:?} for new revisions", config.svnRepo);
+			}
+
+			std::vector<std::chrono::milliseconds> latencies;
+			// Batches converted since the last checkpoint: first revision and when it was seen
+			std::vector<std::pair<long int, std::chrono::steady_clock::time_point>> pending;
+			auto lastCheckpoint = std::chrono::steady_clock::now();
+			while (success && !gStopRequested)
+			{
+				watcher->Wait(kWatchPollInterval);
+
+				auto youngest = repository->GetYoungestRevision();
+				if (!youngest)
+				{
+					Log("ERROR: {}", youngest.error());
+					success = false;
+					break;
+				}
+				if (*youngest > lastConverted)
+				{
+					const auto detected = std::chrono::steady_clock::now();
+					const long int first = lastConverted + 1;
+					success = convertRange(first, *youngest);
+					if (lastConverted >= first)
+					{
+						pending.emplace_back(first, detected);
+					}
+				}
+				if (!success || pending.empty() ||
+					(std::chrono::steady_clock::now() - lastCheckpoint < kWatchCheckpointInterval &&
+					 lastConverted - pending.front().first + 1 < kWatchCheckpointRevisions))
+				{
+					continue;
+				}
+
+				success = checkpoint();
+				if (success)
+				{
+					lastCheckpoint = std::chrono::steady_clock::now();
+					for (size_t i = 0; i < pending.size(); ++i)
+					{
+						const auto [first, detected] = pending[i];
+						const long int last =
+							i + 1 < pending.size() ? pending[i + 1].first - 1 : lastConverted;
+						const auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+							lastCheckpoint - detected
+						);
+						latencies.insert(
+							latencies.end(), static_cast<size_t>(last - first + 1), latency
+						);
+						Log("r{}:r{} visible in {}ms", first, last, latency.count());
+					}
+					pending.clear();
+					if (latencies.size() >= kLatencyReportRevisions)
+					{
+						LogLatencies(std::exchange(latencies, {}));
+					}
+				}
+			}
+			LogLatencies(std::move(latencies));
+		}
+	}
+	if (stats)
+	{
+		*stats = {.revisions = converted, .lastRevision = lastConverted};
+	}
+
+	if (memoryStats)
+	{
+		LogMemoryStats(hungriest);
+	}
+
+	// The conversion itself still finishes without the profile, but the run fails
+	bool profileWritten = true;
+	if (profilePath)
+	{
+		std::ofstream profile{*profilePath};
+		profile << git.GetRuleProfileReport();
+		profileWritten = profile.flush().good();
+		if (profileWritten)
+		{
+			Log("Wrote the rule profile to {:?}", *profilePath);
+		}
+		else
+		{
+			Log("ERROR: Could not write the rule profile to {:?}", *profilePath);
+		}
+	}
+
+	for (size_t i = 0; i < outputs.size(); ++i)
+	{
+		const BranchWorkingSet& workingSet = git.GetWorkingSet(i);
+		if (workingSet.Commits() == 0)
+		{
+			continue;
+		}
+		const size_t cacheSize =
+			outputs[i]->activeBranches.value_or(BranchWorkingSet::kFastImportDefault);
+		Log("{:?}: {} commits, {} branch switches, {} branch tree loads with --active-branches={} "
+			"({} would have kept {}% of the branches committed to again cached)",
+			outputs[i]->path, workingSet.Commits(), workingSet.Switches(),
+			workingSet.Loads(cacheSize), cacheSize,
+			workingSet.CacheSizeFor(kActiveBranchesShare), kActiveBranchesShare * 100);
+	}
+
+	// Nothing reaches the repository until the spool is replayed, so the resume marker stays put
+	if (spoolPath)
+	{
+		if (success)
+		{
+			Output& output = *outputs.front();
+			auto closed = output.spool->Close();
+			if (closed)
+			{
+				const long int spooled = std::max(lastConverted, output.resumeAfter);
+				closed = WriteSpoolState(
+					GetSpoolDirectory(*spoolPath),
+					UpdateSpoolState(output.spoolState.get(), git.GetTarget(0), spooled)
+				);
+			}
+			if (!closed)
+			{
+				Log("ERROR: {}", closed.error());
+				success = false;
+			}
+		}
+		return success && profileWritten ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	for (auto& output : outputs)
+	{
+		success = FinishFastImport(*output, success);
+	}
+
+	if (success && !revisionRange.has_value() && !onlyBranches.has_value())
+	{
+		for (auto& output : outputs)
+		{
+			const long int written = std::max(lastConverted, output->resumeAfter);
+			SaveLastWrittenRevision(output->gitRoot, written);
+		}
+	}
+
+	if (success && program["--repack"] == true)
+	{
+		for (auto& output : outputs)
+		{
+			auto repacked = RepackRepository(output->gitRoot, program.get<unsigned int>("--jobs"));
+			if (!repacked)
+			{
+				Log("ERROR: {}", repacked.error());
+				success = false;
+			}
+		}
+	}
+
+	return success && profileWritten ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/// Limits on the conversions --batch runs at once
+struct BatchLimits
+{
+	size_t conversions = 1;
+	/// Don't start another conversion while the heap is bigger than this
+	std::optional<size_t> heapBytes;
+	/// Most fast-import processes running at once, counting one per git repository
+	std::optional<size_t> fastImports;
+};
+
+/// Convert every config listed in `listPath`, one path per line, in one process. A fixed pool of
+/// limits.conversions threads takes the configs in order, each starting its next one only while
+/// the heap and fast-import budgets allow (a conversion always runs if nothing else is).
+bool ConvertBatch(
+	const argparse::ArgumentParser& program, const std::string& listPath,
+	const BatchLimits& limits
+)
+{
+	std::ifstream list{listPath};
+	if (!list)
+	{
+		Log("ERROR: Could not read the batch list {:?}", listPath);
+		return false;
+	}
+
+	// Every config is loaded up front, so a broken one is found before anything runs
+	std::vector<std::string> configPaths;
+	std::vector<Config> configs;
+	std::string line;
+	while (std::getline(list, line))
+	{
+		if (line.empty() || line.starts_with('#'))
+		{
+			continue;
+		}
+		auto config = Config::FromFile(line);
+		if (!config)
+		{
+			Log("ERROR: {}: {}", line, config.error());
+			return false;
+		}
+		if (config->svnDump)
+		{
+			Log("ERROR: {}: --batch converts svn_repository, not an svn_dump.", line);
+			return false;
+		}
+		configPaths.push_back(line);
+		configs.push_back(std::move(*config));
+	}
+	if (configs.empty())
+	{
+		Log("The batch list {:?} has no configs", listPath);
+		return true;
+	}
+
+	// libsvn loads its filesystem modules lazily, which is only safe across threads once this
+	// has run
+	svn::Pool fsPool;
+	if (svn_error_t* err = svn_fs_initialize(fsPool))
+	{
+		Log("ERROR: {}", svn::FormatSvnError(err));
+		return false;
+	}
+
+	struct BatchResult
+	{
+		int exitCode = EXIT_FAILURE;
+		ConversionStats stats;
+		std::chrono::seconds duration{0};
+	};
+	std::vector<BatchResult> results(configs.size());
+
+	std::mutex mutex;
+	std::condition_variable finished;
+	size_t next = 0;
+	size_t running = 0;
+	size_t runningFastImports = 0;
+
+	const auto canStart = [&]
+	{
+		if (running == 0)
+		{
+			return true;
+		}
+		const size_t fastImports = configs[next].gitRepos.size();
+		if (limits.fastImports && runningFastImports + fastImports > *limits.fastImports)
+		{
+			return false;
+		}
+		// The svn cache is shared, it doesn't grow with more conversions
+		return !limits.heapBytes || WithoutSvnCache(GetHeapInUse()) <= *limits.heapBytes;
+	};
+
+	const auto work = [&]
+	{
+		std::unique_lock lock(mutex);
+		while (next < configs.size())
+		{
+			// The heap isn't announced, so keep checking it
+			if (!canStart())
+			{
+				finished.wait_for(lock, kBatchPollInterval);
+				continue;
+			}
+			const size_t index = next++;
+			const size_t fastImports = configs[index].gitRepos.size();
+			running++;
+			runningFastImports += fastImports;
+			Log("Starting {} [{}/{}]", configPaths[index], index + 1, configs.size());
+			lock.unlock();
+
+			BatchResult result;
+			const auto started = std::chrono::steady_clock::now();
+			tLogPrefix = fmt::format("[{}] ", configPaths[index]);
+			result.exitCode = Convert(configs[index], program, started, &result.stats);
+			tLogPrefix.clear();
+			result.duration = std::chrono::duration_cast<std::chrono::seconds>(
+				std::chrono::steady_clock::now() - started
+			);
+
+			lock.lock();
+			running--;
+			runningFastImports -= fastImports;
+			results[index] = result;
+			Log("Finished {}: {} revisions in {}s{}", configPaths[index], result.stats.revisions,
+				result.duration.count(), result.exitCode == EXIT_SUCCESS ? "" : ", FAILED");
+			finished.notify_all();
+		}
+	};
+
+	{
+		std::vector<std::jthread> pool;
+		for (size_t i = 0; i < std::clamp<size_t>(limits.conversions, 1, configs.size()); ++i)
+		{
+			pool.emplace_back(work);
+		}
+	}
+
+	bool success = true;
+	Log("{:>8} {:>10} {:>10} {:>10}  {}", "result", "revisions", "last", "seconds", "config");
+	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		const BatchResult& result = results[i];
+		Log("{:>8} {:>10} {:>10} {:>10}  {}", result.exitCode == EXIT_SUCCESS ? "ok" : "FAILED",
+			result.stats.revisions, result.stats.lastRevision, result.duration.count(),
+			configPaths[i]);
+		success = success && result.exitCode == EXIT_SUCCESS;
+	}
+	return success;
+}
+
+int main(int argc, char* argv[])
+{
+	std::signal(SIGPIPE, SIG_IGN);
+	argparse::ArgumentParser program("svn-lfs-export", PROJECT_VERSION);
+
+	std::string configPath;
+
+	program.add_argument("-r", "--revision")
+		.help("start revision, or range of revisions FIRST:LAST, to operate on")
+		.metavar("REV");
+	program.add_argument("--config")
+		.help("location of config.toml file")
+		.metavar("FILE")
+		.default_value(std::string{"config.toml"})
+		.nargs(1)
+		.store_into(configPath);
+	program.add_argument("-j", "--jobs")
+		.help("number of threads used to read file contents from svn")
+		.metavar("N")
+		.default_value(std::max(1U, std::thread::hardware_concurrency()))
+		.nargs(1)
+		.scan<'u', unsigned int>();
+	program.add_argument("--defer-lfs")
+		.help("only write LFS pointers, leaving the objects for --materialize-lfs to write")
+		.flag();
+	program.add_argument("--materialize-lfs")
+		.help("write the LFS objects left by --defer-lfs, then exit")
+		.flag();
+	program.add_argument("--prune-dump-texts")
+		.help("delete texts spooled from svn_dump once no path refers to them, for dumps that "
+			  "never copy files from revisions they have changed since")
+		.flag();
+	program.add_argument("--only-branch")
+		.help("re-export only this git branch from scratch, visiting just the revisions that wrote "
+			  "to it (can be repeated)")
+		.metavar("BRANCH")
+		.append();
+	program.add_argument("--watch")
+		.help("keep running after catching up, converting new svn revisions as they are committed")
+		.flag();
+	program.add_argument("--spool")
+		.help("record the fast-import stream to FILE instead of running git fast-import")
+		.metavar("FILE")
+		.nargs(1);
+	program.add_argument("--replay")
+		.help("feed a file recorded with --spool into the git repository, then exit (can be "
+			  "repeated)")
+		.metavar("FILE")
+		.append();
+	program.add_argument("--profile-rules")
+		.help("count how often each rule is tried and matches, and write a report to FILE")
+		.metavar("FILE")
+		.nargs(1);
+	program.add_argument("--memory-stats")
+		.help("write the heap peak, file count and content bytes of every revision to FILE, and "
+			  "log the most memory hungry revisions")
+		.metavar("FILE")
+		.nargs(1);
+	program.add_argument("--verify")
+		.help("check the converted git history against svn, then exit")
+		.flag();
+	program.add_argument("--sample")
+		.help("with --verify, only check N revisions spread over the range")
+		.metavar("N")
+		.nargs(1)
+		.scan<'u', size_t>();
+	program.add_argument("--bootstrap")
+		.help("start a new git history at REV, with one commit per branch holding its whole tree "
+			  "at REV, then carry on from there")
+		.metavar("REV")
+		.nargs(1)
+		.scan<'i', long int>();
+	program.add_argument("--analyze")
+		.help("report the sizes, versions and binary share of files by extension and directory, "
+			  "and the projected git and LFS sizes under the config, to FILE, then exit")
+		.metavar("FILE")
+		.nargs(1);
+	program.add_argument("--batch")
+		.help("convert every config.toml listed in FILE (one path per line) in this process, then "
+			  "exit")
+		.metavar("FILE")
+		.nargs(1);
+	program.add_argument("--batch-jobs")
+		.help("with --batch, how many conversions run at once (defaults to the number of cores "
+			  "divided by --jobs)")
+		.metavar("N")
+		.nargs(1)
+		.scan<'u', size_t>();
+	program.add_argument("--batch-memory")
+		.help("with --batch, don't start another conversion while the heap is over MIB mebibytes, "
+			  "not counting the svn cache")
+		.metavar("MIB")
+		.nargs(1)
+		.scan<'u', size_t>();
+	program.add_argument("--batch-fast-imports")
+		.help("with --batch, the most git fast-import processes running at once")
+		.metavar("N")
+		.nargs(1)
+		.scan<'u', size_t>();
+	program.add_argument("--active-branches")
+		.help("how many branches git fast-import keeps in memory (defaults to enough for the "
+			  "branches recent commits went back to)")
+		.metavar("N")
+		.nargs(1)
+		.scan<'u', size_t>();
+	program.add_argument("--svn-cache")
+		.help("MIB mebibytes of memory for svn to cache file contents, deltas and properties in, "
+			  "shared by all threads (defaults to libsvn's default, or with --batch a quarter of "
+			  "physical memory, up to 16 GiB)")
+		.metavar("MIB")
+		.nargs(1)
+		.scan<'u', size_t>();
+	program.add_argument("--repack")
+		.help("after converting, repack what git fast-import wrote since the last repack on -j "
+			  "threads and write a commit-graph")
+		.flag();
+	program.add_argument("--example-config").help("output example config.toml file").flag();
+
+	try
+	{
+		program.parse_args(argc, argv);
+	}
+	catch (const std::exception& err)
+	{
+		std::cerr << err.what() << '\n';
+		std::cerr << program;
+		return EXIT_FAILURE;
+	}
+
+	if (program["--example-config"] == true)
+	{
+		std::cout << kExampleConfig << '\n';
+		return EXIT_SUCCESS;
+	}
+
+	const auto startTime = std::chrono::steady_clock::now();
+	LibGit2Init libGit;
+	LibAprInit libApr;
+
+	// A single conversion keeps libsvn's default cache unless asked for more, --batch conversions
+	// share one sized for the machine
+	if (const auto svnCacheMebibytes = program.present<size_t>("--svn-cache"))
+	{
+		svn::ConfigureCache(*svnCacheMebibytes * kMiB);
+	}
+	else if (program.is_used("--batch"))
+	{
+		svn::ConfigureCache(svn::DefaultCacheSize());
+	}
+
+	if (const auto batchPath = program.present<std::string>("--batch"))
+	{
+		static constexpr std::array kSingleConversionOptions = {
+			"--revision", "--only-branch", "--watch", "--spool", "--replay", "--verify",
+			"--analyze", "--bootstrap", "--profile-rules", "--memory-stats", "--materialize-lfs",
+		};
+		for (const char* option : kSingleConversionOptions)
+		{
+			if (program.is_used(option))
+			{
+				Log("ERROR: {} can't be used with --batch.", option);
+				return EXIT_FAILURE;
+			}
+		}
+
+		// Without a heap figure the limit would never hold anything back
+		if (program.is_used("--batch-memory") && !CanMeasureHeap())
+		{
+			Log("ERROR: --batch-memory needs glibc 2.33 or later to measure the heap.");
+			return EXIT_FAILURE;
+		}
+
+		const unsigned int jobs = std::max(1U, program.get<unsigned int>("--jobs"));
+		const size_t defaultConversions = std::max(1U, std::thread::hardware_concurrency() / jobs);
+		const BatchLimits limits{
+			.conversions = program.present<size_t>("--batch-jobs").value_or(defaultConversions),
+			.heapBytes = program.present<size_t>("--batch-memory").transform(
+				[](size_t mebibytes) { return mebibytes * kMiB; }
+			),
+			.fastImports = program.present<size_t>("--batch-fast-imports"),
+		};
+		return ConvertBatch(program, *batchPath, limits) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	const auto maybeConfig = Config::FromFile(configPath);
+
+	if (!maybeConfig)
+	{
+		std::cerr << maybeConfig.error() << '\n';
+		return EXIT_FAILURE;
+	}
+
+	const Config& config = maybeConfig.value();
+
+	const bool deferLFS = program["--defer-lfs"] == true;
+	const auto onlyBranches = program.present<std::vector<std::string>>("--only-branch");
+	if ((deferLFS || program["--materialize-lfs"] == true) && config.svnDump)
+	{
+		Log("ERROR: Deferred LFS objects are read back from svn_repository, not an svn_dump.");
+		return EXIT_FAILURE;
+	}
+
+	const bool watch = program["--watch"] == true;
+	if (watch && (config.svnDump || onlyBranches || program.is_used("--revision")))
+	{
+		Log("ERROR: --watch needs svn_repository, and can't be used with --only-branch or -r.");
+		return EXIT_FAILURE;
+	}
+	const auto bootstrapRevision = program.present<long int>("--bootstrap");
+	const bool bootstrapConflicts =
+		config.svnDump || onlyBranches || program.is_used("--revision");
+	if (bootstrapRevision && (bootstrapConflicts || *bootstrapRevision < 1))
+	{
+		Log("ERROR: --bootstrap needs svn_repository and a revision above 0, and can't be used "
+			"with --only-branch or -r.");
+		return EXIT_FAILURE;
+	}
+	const auto spoolPath = program.present<std::string>("--spool");
+	const auto replayPaths = program.present<std::vector<std::string>>("--replay");
+	if ((spoolPath || replayPaths) && config.gitRepos.size() > 1)
+	{
+		Log("ERROR: --spool and --replay only support a single git repository.");
+		return EXIT_FAILURE;
+	}
+	if (spoolPath && watch)
+	{
+		Log("ERROR: --watch writes to git as it goes, and can't be used with --spool.");
+		return EXIT_FAILURE;
+	}
+	if (program["--verify"] == true)
+	{
+		if (config.svnDump)
+		{
+			Log("ERROR: --verify reads svn_repository, not an svn_dump.");
+			return EXIT_FAILURE;
+		}
+		const bool verified = VerifyRepositories(
+			config, program.present<std::string>("--revision"), program.present<size_t>("--sample"),
+			program.get<unsigned int>("--jobs")
+		);
+		return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (const auto analyzePath = program.present<std::string>("--analyze"))
+	{
+		if (config.svnDump)
+		{
+			Log("ERROR: --analyze reads svn_repository, not an svn_dump.");
+			return EXIT_FAILURE;
+		}
+		const bool analyzed = AnalyzeToFile(
+			config, *analyzePath, program.present<std::string>("--revision"),
+			program.get<unsigned int>("--jobs")
+		);
+		return analyzed ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (replayPaths)
+	{
+		return ReplaySpools(config, *replayPaths) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (watch)
+	{
+		std::signal(SIGINT, RequestStop);
+		std::signal(SIGTERM, RequestStop);
+	}
+
+	if (program["--materialize-lfs"] == true)
+	{
+		const auto jobs = program.get<unsigned int>("--jobs");
+		bool success = true;
+		for (const GitRepository& gitRepo : config.gitRepos)
+		{
+			Git::StartingState state;
+			const std::filesystem::path gitRoot = GetExistingGitStatus(gitRepo.path, &state);
+			auto materialized =
+				MaterializeLFSObjects(config.svnRepo, gitRoot, config.lfsStore, jobs);
+			if (!materialized)
+			{
+				Log("ERROR: Writing LFS objects for {:?}: {}", gitRepo.path, materialized.error());
+				success = false;
+				continue;
+			}
+			Log("Wrote {} LFS objects to {:?} ({} already present)", materialized->written,
+				gitRepo.path, materialized->skipped);
+		}
+		return success ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+	return Convert(config, program, startTime);
 }
@@ -0,0 +1,291 @@
+#include "Marks.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+// File layout: an 8 byte magic, the commit id size as a uint32, 4 bytes of padding, then one
+// record of that size per revision (all zero for revisions without a commit). Revisions that
+// were never written are holes in a sparse file.
+static constexpr std::array<char, 8> kMagic = {'S', 'L', 'E', 'M', 'A', 'R', 'K', '1'};
+static constexpr size_t kHeaderSize = 16;
+static constexpr size_t kIdSizeOffset = 8;
+
+static std::string ErrnoMessage(std::string_view action, const std::filesystem::path& path)
+{
+	return fmt::format(
+		"Could not {} {:?}: {}", action, path.c_str(), std::system_category().message(errno)
+	);
+}
+
+static std::optional<int> HexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	return std::nullopt;
+}
+
+std::expected<MarkIndex, std::string> MarkIndex::Open(const std::filesystem::path& path)
+{
+	MarkIndex index;
+	index.mPath = path;
+	index.mFd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (index.mFd < 0)
+	{
+		return std::unexpected(ErrnoMessage("open", path));
+	}
+
+	std::array<char, kHeaderSize> header{};
+	const ssize_t headerRead = pread(index.mFd, header.data(), header.size(), 0);
+	if (headerRead == 0)
+	{
+		std::ranges::copy(kMagic, header.begin());
+		if (pwrite(index.mFd, header.data(), header.size(), 0) != ssize_t{kHeaderSize})
+		{
+			return std::unexpected(ErrnoMessage("write", path));
+		}
+	}
+	else if (headerRead != ssize_t{kHeaderSize} ||
+			 !std::ranges::equal(kMagic, std::span(header).first(kMagic.size())))
+	{
+		return std::unexpected(fmt::format("{:?} is not a revision index", path.c_str()));
+	}
+
+	std::uint32_t idSize = 0;
+	std::memcpy(&idSize, header.data() + kIdSizeOffset, sizeof(idSize));
+	index.mIdSize = idSize;
+
+	auto mapped = index.Map();
+	if (!mapped)
+	{
+		return std::unexpected(mapped.error());
+	}
+	return index;
+}
+
+MarkIndex::~MarkIndex()
+{
+	Unmap();
+	if (mFd >= 0)
+	{
+		close(mFd);
+	}
+}
+
+MarkIndex::MarkIndex(MarkIndex&& other) noexcept :
+	mPath(std::move(other.mPath)),
+	mFd(std::exchange(other.mFd, -1)),
+	mData(std::exchange(other.mData, nullptr)),
+	mSize(std::exchange(other.mSize, 0)),
+	mIdSize(other.mIdSize)
+{
+}
+
+MarkIndex& MarkIndex::operator=(MarkIndex&& other) noexcept
+{
+	if (this != &other)
+	{
+		Unmap();
+		if (mFd >= 0)
+		{
+			close(mFd);
+		}
+		mPath = std::move(other.mPath);
+		mFd = std::exchange(other.mFd, -1);
+		mData = std::exchange(other.mData, nullptr);
+		mSize = std::exchange(other.mSize, 0);
+		mIdSize = other.mIdSize;
+	}
+	return *this;
+}
+
+std::expected<void, std::string> MarkIndex::Map()
+{
+	struct stat status{};
+	if (fstat(mFd, &status) != 0)
+	{
+		return std::unexpected(ErrnoMessage("stat", mPath));
+	}
+
+	mSize = static_cast<size_t>(status.st_size);
+	void* data = mmap(nullptr, mSize, PROT_READ, MAP_SHARED, mFd, 0);
+	if (data == MAP_FAILED)
+	{
+		mSize = 0;
+		return std::unexpected(ErrnoMessage("map", mPath));
+	}
+	mData = static_cast<std::byte*>(data);
+	return {};
+}
+
+void MarkIndex::Unmap()
+{
+	if (mData)
+	{
+		munmap(mData, mSize);
+		mData = nullptr;
+		mSize = 0;
+	}
+}
+
+std::optional<std::string> MarkIndex::Lookup(long int revision) const
+{
+	if (mIdSize == 0 || revision < 0)
+	{
+		return std::nullopt;
+	}
+
+	const size_t offset = kHeaderSize + (static_cast<size_t>(revision) * mIdSize);
+	if (offset + mIdSize > mSize)
+	{
+		return std::nullopt;
+	}
+
+	const std::span<const std::byte> id(mData + offset, mIdSize);
+	if (std::ranges::all_of(id, [](std::byte b) { return b == std::byte{0}; }))
+	{
+		return std::nullopt;
+	}
+
+	std::string hex;
+	hex.reserve(mIdSize * 2);
+	for (const std::byte b : id)
+	{
+		fmt::format_to(std::back_inserter(hex), "{:02x}", static_cast<unsigned int>(b));
+	}
+	return hex;
+}
+
+std::expected<void, std::string> MarkIndex::AddMarksFile(const std::filesystem::path& marksPath)
+{
+	std::ifstream marks{marksPath};
+	if (!marks)
+	{
+		return std::unexpected(fmt::format("Could not read marks file {:?}", marksPath.c_str()));
+	}
+
+	std::string line;
+	std::string id;
+	while (std::getline(marks, line))
+	{
+		// ":<revision> <hex commit id>"
+		const auto invalidLine = [&]
+		{
+			return std::unexpected(
+				fmt::format("Invalid line in marks file {:?}: {:?}", marksPath.c_str(), line)
+			);
+		};
+
+		std::string_view rest = line;
+		if (!rest.starts_with(':'))
+		{
+			return invalidLine();
+		}
+		rest.remove_prefix(1);
+
+		long int revision = 0;
+		const char* restEnd = rest.data() + rest.size();
+		auto [revisionEnd, error] = std::from_chars(rest.data(), restEnd, revision);
+		const auto revisionLength = static_cast<size_t>(revisionEnd - rest.data());
+		if (error != std::errc{} || revision < 0 || revisionLength >= rest.size() ||
+			rest[revisionLength] != ' ')
+		{
+			return invalidLine();
+		}
+
+		const std::string_view hex = rest.substr(revisionLength + 1);
+		if (hex.size() != 40 && hex.size() != 64)
+		{
+			return invalidLine();
+		}
+
+		if (mIdSize == 0)
+		{
+			mIdSize = hex.size() / 2;
+			const auto idSize = static_cast<std::uint32_t>(mIdSize);
+			if (pwrite(mFd, &idSize, sizeof(idSize), kIdSizeOffset) != ssize_t{sizeof(idSize)})
+			{
+				return std::unexpected(ErrnoMessage("write", mPath));
+			}
+		}
+		if (hex.size() != mIdSize * 2)
+		{
+			return std::unexpected(
+				fmt::format(
+					"Commit ids in {:?} are a different size to those in {:?}", marksPath.c_str(),
+					mPath.c_str()
+				)
+			);
+		}
+
+		id.clear();
+		for (size_t i = 0; i < hex.size(); i += 2)
+		{
+			const auto high = HexValue(hex[i]);
+			const auto low = HexValue(hex[i + 1]);
+			if (!high || !low)
+			{
+				return invalidLine();
+			}
+			id.push_back(static_cast<char>((*high << 4) | *low));
+		}
+
+		const size_t offset = kHeaderSize + (static_cast<size_t>(revision) * mIdSize);
+		if (pwrite(mFd, id.data(), id.size(), static_cast<off_t>(offset)) !=
+			static_cast<ssize_t>(id.size()))
+		{
+			return std::unexpected(ErrnoMessage("write", mPath));
+		}
+	}
+
+	// Pick up the new size
+	Unmap();
+	return Map();
+}
+
+std::expected<size_t, std::string> MarkIndex::WriteMarksFile(
+	const std::filesystem::path& marksPath, std::span<const long int> revisions
+) const
+{
+	std::ofstream marks{marksPath};
+	size_t written = 0;
+	for (const long int revision : revisions)
+	{
+		if (const auto id = Lookup(revision))
+		{
+			marks << ':' << revision << ' ' << *id << '\n';
+			written++;
+		}
+	}
+	if (!marks)
+	{
+		return std::unexpected(fmt::format("Could not write marks file {:?}", marksPath.c_str()));
+	}
+	return written;
+}
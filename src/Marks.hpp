@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <expected>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+/// Where the mark index is kept, relative to the git directory.
+static constexpr std::string_view kMarkIndexPath = "svn_lfs_export_commits";
+
+/// The git commit written for every unambiguous SVN revision, kept between runs.
+///
+/// git fast-import's own marks file is text, and is read in full at every start and rewritten
+/// at every exit, so it costs O(history) per run. The index is instead a memory-mapped array of
+/// fixed-size records indexed by revision number: looking up a revision is a single read, and
+/// adding the commits from one run only touches their records. fast-import is then only given
+/// the marks a run can actually refer to.
+class MarkIndex
+{
+public:
+	static std::expected<MarkIndex, std::string> Open(const std::filesystem::path& path);
+
+	~MarkIndex();
+
+	MarkIndex(const MarkIndex&) = delete;
+	MarkIndex& operator=(const MarkIndex&) = delete;
+	MarkIndex(MarkIndex&& other) noexcept;
+	MarkIndex& operator=(MarkIndex&& other) noexcept;
+
+	/// Hex id of the commit written for `revision`, if it has one.
+	std::optional<std::string> Lookup(long int revision) const;
+
+	/// Add every mark in a marks file exported by fast-import (":<revision> <commit id>" lines).
+	std::expected<void, std::string> AddMarksFile(const std::filesystem::path& marksPath);
+
+	/// Write the marks for `revisions` in fast-import's format, for --import-marks. Revisions
+	/// without a commit are left out. Returns the number of marks written.
+	std::expected<size_t, std::string> WriteMarksFile(
+		const std::filesystem::path& marksPath, std::span<const long int> revisions
+	) const;
+
+private:
+	MarkIndex() = default;
+
+	std::expected<void, std::string> Map();
+	void Unmap();
+
+	std::filesystem::path mPath;
+	int mFd = -1;
+	std::byte* mData = nullptr;
+	size_t mSize = 0;
+	/// Bytes per commit id, 20 for SHA-1 and 32 for SHA-256 repositories. 0 until the first mark.
+	size_t mIdSize = 0;
+};
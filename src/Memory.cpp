@@ -0,0 +1,91 @@
+#include "Memory.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static std::atomic<bool> gAccounting = false;
+static std::atomic<size_t> gHeapPeak = 0;
+static std::atomic<size_t> gContentBytes = 0;
+
+void EnableMemoryAccounting()
+{
+	gAccounting = true;
+}
+
+size_t GetHeapInUse()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	// mallinfo2 walks every arena, so it is only called while accounting
+	const struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+bool CanMeasureHeap()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return true;
+#else
+	return false;
+#endif
+}
+
+void SampleHeap()
+{
+	if (!gAccounting)
+	{
+		return;
+	}
+	const size_t inUse = GetHeapInUse();
+	size_t peak = gHeapPeak;
+	while (inUse > peak && !gHeapPeak.compare_exchange_weak(peak, inUse))
+	{
+	}
+}
+
+size_t TakeHeapPeak()
+{
+	return gHeapPeak.exchange(0);
+}
+
+void CountContentBuffer(size_t bytes)
+{
+	if (gAccounting)
+	{
+		gContentBytes += bytes;
+		SampleHeap();
+	}
+}
+
+size_t TakeContentBytes()
+{
+	return gContentBytes.exchange(0);
+}
+
+size_t GetPeakResidentBytes()
+{
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	// ru_maxrss is in kilobytes on Linux
+	return static_cast<size_t>(std::max(usage.ru_maxrss, 0L)) * 1024;
+}
+
+size_t GetPhysicalMemory()
+{
+	const long pages = sysconf(_SC_PHYS_PAGES);
+	const long pageSize = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || pageSize <= 0)
+	{
+		return 0;
+	}
+	return static_cast<size_t>(pages) * static_cast<size_t>(pageSize);
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+
+/// Memory accounting for --memory-stats. Nothing is counted until EnableMemoryAccounting().
+///
+/// Heap figures come from malloc's own counters, so they cover APR pools (every top level
+/// svn::Pool has its own allocator, which gets its blocks from malloc and frees them with the
+/// pool) as well as file contents and everything else on the C++ heap. They are process wide,
+/// including the reader threads.
+void EnableMemoryAccounting();
+
+/// Bytes malloc has handed out and not had back. 0 where malloc can't say.
+size_t GetHeapInUse();
+
+/// Whether GetHeapInUse() can say, which needs glibc's mallinfo2.
+bool CanMeasureHeap();
+
+/// Count the current heap use towards the peak returned by TakeHeapPeak().
+void SampleHeap();
+
+/// The highest heap use sampled since the last call.
+size_t TakeHeapPeak();
+
+/// Count a buffer allocated for file contents.
+void CountContentBuffer(size_t bytes);
+
+/// Bytes of file contents buffered since the last call.
+size_t TakeContentBytes();
+
+/// The largest the resident set of the process has been.
+size_t GetPeakResidentBytes();
+
+/// The machine's physical memory. 0 where it can't be found out.
+size_t GetPhysicalMemory();
@@ -0,0 +1,114 @@
+#include "Prefetch.hpp"
+
+#include <fmt/format.h>
+
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
+
+namespace svn
+{
+
+// db/format is the format number, then options such as "layout sharded 1000"
+static long int ReadShardSize(const std::filesystem::path& formatPath)
+{
+	std::ifstream format{formatPath};
+	std::string line;
+	constexpr std::string_view kShardedLayout = "layout sharded ";
+	while (std::getline(format, line))
+	{
+		if (line.starts_with(kShardedLayout))
+		{
+			try
+			{
+				return std::stol(line.substr(kShardedLayout.size()));
+			}
+			catch (const std::exception&)
+			{
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+// Revisions below db/min-unpacked-rev have been packed into a single file per shard
+static long int ReadMinUnpackedRevision(const std::filesystem::path& path)
+{
+	std::ifstream file{path};
+	long int revision = 0;
+	file >> revision;
+	return file ? revision : 0;
+}
+
+static void WillNeed(const std::filesystem::path& path)
+{
+#ifdef POSIX_FADV_WILLNEED
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+#else
+	(void)path;
+#endif
+}
+
+ShardPrefetcher ShardPrefetcher::Open(const std::filesystem::path& repositoryPath)
+{
+	ShardPrefetcher prefetcher;
+	const std::filesystem::path db = repositoryPath / "db";
+#ifdef POSIX_FADV_WILLNEED
+	prefetcher.mShardSize = ReadShardSize(db / "format");
+#endif
+	prefetcher.mRevsPath = db / "revs";
+	return prefetcher;
+}
+
+void ShardPrefetcher::Advance(long int revision)
+{
+	if (mShardSize <= 0)
+	{
+		return;
+	}
+	const long int shard = revision / mShardSize;
+	if (shard == mShard)
+	{
+		return;
+	}
+	if (mShard < 0 || shard != mShard + 1)
+	{
+		// First revision, or a jump: nothing has been prefetched for this shard yet
+		Prefetch(shard);
+	}
+	mShard = shard;
+	Prefetch(shard + 1);
+}
+
+void ShardPrefetcher::Prefetch(long int shard) const
+{
+	// Re-read every time, svnadmin pack may run while converting
+	const long int minUnpacked =
+		ReadMinUnpackedRevision(mRevsPath.parent_path() / "min-unpacked-rev");
+	if (shard * mShardSize < minUnpacked)
+	{
+		WillNeed(mRevsPath / fmt::format("{}.pack", shard) / "pack");
+		return;
+	}
+
+	std::error_code ec;
+	for (const auto& entry :
+		 std::filesystem::directory_iterator(mRevsPath / std::to_string(shard), ec))
+	{
+		WillNeed(entry.path());
+	}
+}
+
+} // namespace svn
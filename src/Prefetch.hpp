@@ -0,0 +1,31 @@
+#pragma once
+#include <filesystem>
+
+namespace svn
+{
+
+/// Has the kernel read ahead the revision files of the shard after the one being converted, so
+/// that reading history front to back overlaps disk reads with conversion instead of waiting on
+/// every rev file in turn. Only sharded FSFS repositories are prefetched, and only on systems with
+/// posix_fadvise. Elsewhere Advance() does nothing.
+class ShardPrefetcher
+{
+public:
+	static ShardPrefetcher Open(const std::filesystem::path& repositoryPath);
+
+	/// Call before reading each revision, in increasing order. Entering a new shard prefetches
+	/// it and the one after.
+	void Advance(long int revision);
+
+private:
+	ShardPrefetcher() = default;
+
+	void Prefetch(long int shard) const;
+
+	std::filesystem::path mRevsPath;
+	/// Revisions per shard, 0 if the repository isn't sharded
+	long int mShardSize = 0;
+	long int mShard = -1;
+};
+
+} // namespace svn
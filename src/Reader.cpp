@@ -0,0 +1,224 @@
+#include "Reader.hpp"
+#include "Svn.hpp"
+#include "Utils.hpp"
+
+#include <picosha2.h>
+#include <svn_error.h>
+#include <svn_fs.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <expected>
+#include <memory>
+#include <numeric>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace svn
+{
+
+std::expected<std::unique_ptr<ContentReader>, std::string>
+ContentReader::Open(const std::string& repositoryPath, unsigned int threads)
+{
+	std::unique_ptr<ContentReader> reader(new ContentReader());
+
+	// Repositories are opened here on the calling thread, so libsvn's lazy module loading never
+	// races. Only revision roots and content streams are created on the workers.
+	for (unsigned int i = 0; i < std::max(1U, threads); ++i)
+	{
+		auto worker = std::make_unique<Worker>();
+		auto fs = OpenFilesystem(repositoryPath, worker->pool);
+		if (!fs)
+		{
+			return std::unexpected(fs.error());
+		}
+		worker->fs = *fs;
+		reader->mWorkers.push_back(std::move(worker));
+	}
+
+	// The log prefix is per thread, so workers take on the one of the thread that opened them
+	for (auto& worker : reader->mWorkers)
+	{
+		worker->thread = std::jthread(
+			[self = reader.get(), w = worker.get(), prefix = tLogPrefix]
+			{
+				tLogPrefix = prefix;
+				self->Run(*w);
+			}
+		);
+	}
+
+	return reader;
+}
+
+ContentReader::~ContentReader()
+{
+	{
+		std::lock_guard lock(mMutex);
+		mStopping = true;
+	}
+	mWorkReady.notify_all();
+	// Joins every worker before the synchronisation primitives are destroyed
+	mWorkers.clear();
+}
+
+void ContentReader::Schedule()
+{
+	mSchedule.resize(mRequests.size());
+	std::iota(mSchedule.begin(), mSchedule.end(), size_t{0});
+
+	// Sorting within fixed windows (rather than the whole revision) keeps the reorder buffer
+	// bounded: nothing is claimed more than one window ahead of the consumer.
+	for (size_t begin = 0; begin < mSchedule.size(); begin += kMaxBufferedFiles)
+	{
+		const size_t end = std::min(begin + kMaxBufferedFiles, mSchedule.size());
+		std::stable_sort(
+			mSchedule.begin() + static_cast<std::ptrdiff_t>(begin),
+			mSchedule.begin() + static_cast<std::ptrdiff_t>(end),
+			[this](size_t lhs, size_t rhs)
+			{ return mRequests[lhs].file->location < mRequests[rhs].file->location; }
+		);
+	}
+}
+
+bool ContentReader::CanClaim() const
+{
+	if (mNextClaim >= mSchedule.size() || mNextClaim >= mRequests.size())
+	{
+		return false;
+	}
+	// Until the file the consumer is waiting on has been claimed, keep going regardless of the
+	// buffer size; it is at most one window away.
+	if (!mClaimed[mNextConsume])
+	{
+		return true;
+	}
+	const size_t next = mSchedule[mNextClaim];
+	return next - mNextConsume < kMaxBufferedFiles && mBufferedBytes < kMaxBufferedBytes;
+}
+
+void ContentReader::Run(Worker& worker)
+{
+	Pool revisionPool(worker.pool);
+	Pool filePool(worker.pool);
+	svn_fs_root_t* root = nullptr;
+	long int rootRevision = -1;
+
+	std::unique_lock lock(mMutex);
+	while (true)
+	{
+		mWorkReady.wait(lock, [this] { return mStopping || CanClaim(); });
+		if (mStopping)
+		{
+			return;
+		}
+
+		const size_t index = mSchedule[mNextClaim++];
+		mClaimed[index] = true;
+		const Request request = mRequests[index];
+		const long int revision = mRevision;
+		mBufferedBytes += request.file->size;
+		mInFlight++;
+		lock.unlock();
+
+		std::expected<Content, std::string> result = Content{};
+		if (revision != rootRevision)
+		{
+			revisionPool.clear();
+			rootRevision = -1;
+			svn_error_t* err = svn_fs_revision_root(&root, worker.fs, revision, revisionPool);
+			if (err)
+			{
+				result = std::unexpected(FormatSvnError(err));
+			}
+			else
+			{
+				rootRevision = revision;
+			}
+		}
+
+		if (result)
+		{
+			filePool.clear();
+			auto contents = request.file->GetContents(root, filePool);
+			if (!contents)
+			{
+				result = std::unexpected(contents.error());
+			}
+			else
+			{
+				if (request.hash && *contents)
+				{
+					const char* begin = contents->get();
+					const char* end = begin + request.file->size;
+					result->sha256 = picosha2::hash256_hex_string(begin, end);
+				}
+				result->data = std::move(*contents);
+			}
+		}
+
+		lock.lock();
+		mResults[index] = std::move(result);
+		mInFlight--;
+		mResultReady.notify_all();
+		if (mInFlight == 0)
+		{
+			mIdle.notify_all();
+		}
+	}
+}
+
+ContentReader::Batch::Batch(
+	ContentReader& reader, long int revision, std::span<const Request> requests
+) :
+	mReader(reader)
+{
+	{
+		std::lock_guard lock(mReader.mMutex);
+		mReader.mRevision = revision;
+		mReader.mRequests.assign(requests.begin(), requests.end());
+		mReader.mResults.clear();
+		mReader.mResults.resize(requests.size());
+		mReader.mClaimed.assign(requests.size(), false);
+		mReader.Schedule();
+		mReader.mNextClaim = 0;
+		mReader.mNextConsume = 0;
+		mReader.mBufferedBytes = 0;
+	}
+	mReader.mWorkReady.notify_all();
+}
+
+ContentReader::Batch::~Batch()
+{
+	std::unique_lock lock(mReader.mMutex);
+	// Stop any further claims, then wait for reads that already started
+	mReader.mRequests.clear();
+	mReader.mIdle.wait(lock, [this] { return mReader.mInFlight == 0; });
+	mReader.mResults.clear();
+}
+
+std::expected<ContentReader::Content, std::string> ContentReader::Batch::Next()
+{
+	std::unique_lock lock(mReader.mMutex);
+	const size_t index = mReader.mNextConsume;
+	if (index >= mReader.mRequests.size())
+	{
+		return std::unexpected("Content reader was asked for more files than were requested");
+	}
+
+	mReader.mResultReady.wait(lock, [&] { return mReader.mResults[index].has_value(); });
+
+	std::expected<Content, std::string> result = std::move(*mReader.mResults[index]);
+	mReader.mResults[index].reset();
+	mReader.mBufferedBytes -= mReader.mRequests[index].file->size;
+	mReader.mNextConsume++;
+	lock.unlock();
+
+	mReader.mWorkReady.notify_all();
+	return result;
+}
+
+} // namespace svn
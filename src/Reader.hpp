@@ -0,0 +1,192 @@
+#pragma once
+#include "Svn.hpp"
+#include "Utils.hpp"
+
+#include <svn_fs.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace svn
+{
+
+/// Reads the contents of many files from one revision on a pool of worker threads. An svn_fs_t
+/// (and every root opened from it) must only ever be used by one thread, so each worker opens
+/// the repository itself. Results are buffered and handed back in the order they were requested.
+///
+/// Reads are not issued in request order: each window of requests is scheduled by where the
+/// node is stored (File::location), so packed shards are read front to back instead of seeking
+/// back and forth for every path.
+class ContentReader
+{
+public:
+	struct Request
+	{
+		const File* file;
+		/// Also compute the SHA-256 of the contents, used for LFS objects.
+		bool hash = false;
+	};
+
+	struct Content
+	{
+		std::unique_ptr<char[]> data;
+		/// Hex SHA-256 if the request asked for a hash, otherwise empty.
+		std::string sha256;
+	};
+
+	/// One revision's worth of reads. Files must be consumed in order with Next(). Destroying a
+	/// batch early waits for reads in flight, so no worker touches a revision after it is freed.
+	class Batch
+	{
+	public:
+		Batch(ContentReader& reader, long int revision, std::span<const Request> requests);
+		~Batch();
+
+		Batch(const Batch&) = delete;
+		Batch& operator=(const Batch&) = delete;
+		Batch(Batch&&) = delete;
+		Batch& operator=(Batch&&) = delete;
+
+		/// Blocks until the next file in request order has been read.
+		std::expected<Content, std::string> Next();
+
+	private:
+		ContentReader& mReader;
+	};
+
+	static std::expected<std::unique_ptr<ContentReader>, std::string>
+	Open(const std::string& repositoryPath, unsigned int threads);
+
+	~ContentReader();
+
+	ContentReader(const ContentReader&) = delete;
+	ContentReader& operator=(const ContentReader&) = delete;
+	ContentReader(ContentReader&&) = delete;
+	ContentReader& operator=(ContentReader&&) = delete;
+
+private:
+	ContentReader() = default;
+
+	struct Worker
+	{
+		Pool pool;
+		svn_fs_t* fs = nullptr;
+		std::jthread thread;
+	};
+
+	void Run(Worker& worker);
+	bool CanClaim() const;
+	void Schedule();
+
+	// Upper bounds on what may be read ahead of the consumer
+	static constexpr size_t kMaxBufferedFiles = 1024;
+	static constexpr size_t kMaxBufferedBytes = size_t{256} * 1024 * 1024;
+
+	std::vector<std::unique_ptr<Worker>> mWorkers;
+
+	std::mutex mMutex;
+	std::condition_variable mWorkReady;
+	std::condition_variable mResultReady;
+	std::condition_variable mIdle;
+
+	bool mStopping = false;
+	long int mRevision = 0;
+	std::vector<Request> mRequests;
+	std::vector<std::optional<std::expected<Content, std::string>>> mResults;
+	// Request indices in the order workers claim them, and whether each request was claimed
+	std::vector<size_t> mSchedule;
+	std::vector<bool> mClaimed;
+	size_t mNextClaim = 0;
+	size_t mNextConsume = 0;
+	size_t mBufferedBytes = 0;
+	size_t mInFlight = 0;
+};
+
+/// Call `work(worker, index, scratch)` for every index below `count`, on up to `threads` threads
+/// that each take the next index once done with the last. Every thread has its own worker from
+/// `makeWorker()`, which needs a `pool` and an `fs`. Workers are made and their repositories
+/// opened on this thread, as in ContentReader, so libsvn's lazy module loading never races.
+/// Stops at the first error from `work`. Unless `progress` is empty, logs
+/// "<progress> N% [done/count]" every percent. Returns the workers, with whatever they gathered.
+template <typename MakeWorker, typename Work>
+std::expected<std::vector<std::invoke_result_t<const MakeWorker&>>, std::string> RunInParallel(
+	const std::string& repositoryPath, size_t count, unsigned int threads,
+	std::string_view progress, const MakeWorker& makeWorker, const Work& work
+)
+{
+	const size_t workerCount = std::clamp<size_t>(threads, 1, std::max<size_t>(count, 1));
+	std::vector<std::invoke_result_t<const MakeWorker&>> workers;
+	for (size_t i = 0; i < workerCount; ++i)
+	{
+		auto worker = makeWorker();
+		auto fs = OpenFilesystem(repositoryPath, worker->pool);
+		if (!fs)
+		{
+			return std::unexpected(fs.error());
+		}
+		worker->fs = *fs;
+		workers.push_back(std::move(worker));
+	}
+
+	const size_t progressInterval = std::max<size_t>(1, count / 100);
+	const std::string logPrefix = tLogPrefix;
+	std::atomic<size_t> next = 0;
+	std::atomic<size_t> done = 0;
+	std::mutex logMutex;
+	std::optional<std::string> firstError;
+
+	{
+		std::vector<std::jthread> running;
+		for (auto& worker : workers)
+		{
+			running.emplace_back(
+				[&, w = worker.get()]
+				{
+					tLogPrefix = logPrefix;
+					Pool scratch(w->pool);
+					for (size_t i = next++; i < count; i = next++)
+					{
+						scratch.clear();
+						const std::expected<void, std::string> result = work(*w, i, scratch);
+						if (!result)
+						{
+							std::lock_guard lock(logMutex);
+							firstError = firstError.value_or(result.error());
+							next = count;
+							return;
+						}
+
+						const size_t doneCount = ++done;
+						if (!progress.empty() &&
+							(doneCount % progressInterval == 0 || doneCount == count))
+						{
+							std::lock_guard lock(logMutex);
+							Log("{} {}% [{}/{}]", progress, 100 * doneCount / count, doneCount,
+								count);
+						}
+					}
+				}
+			);
+		}
+	}
+
+	if (firstError)
+	{
+		return std::unexpected(*firstError);
+	}
+	return workers;
+}
+
+} // namespace svn
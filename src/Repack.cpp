@@ -0,0 +1,498 @@
+#include "Repack.hpp"
+#include "Utils.hpp"
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+#include <git2.h>
+#include <git2/sys/commit_graph.h>
+#include <git2/sys/odb_backend.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <expected>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+using OdbPtr = std::unique_ptr<git_odb, decltype(&git_odb_free)>;
+
+/// What the last repack saw, read from kRepackStatePath
+struct RepackState
+{
+	std::unordered_set<std::string> packs;
+	std::vector<git_oid> tips;
+};
+
+/// Everything the walk needs to hand objects to the packbuilder
+struct PackInput
+{
+	git_repository* repository = nullptr;
+	git_packbuilder* builder = nullptr;
+	/// The packs being repacked. Objects that aren't in them are already in a repacked pack.
+	git_odb* fresh = nullptr;
+	std::unordered_set<std::string> seenTrees;
+};
+
+std::string GitErrorMessage()
+{
+	const git_error* error = git_error_last();
+	return error ? error->message : "unknown libgit2 error";
+}
+
+// The names of the packs in objects/pack, as in "pack-<name>.pack". Packs with a .keep file are
+// being written, or were kept on purpose, and are left out.
+std::vector<std::string> ListPacks(const std::filesystem::path& packDirectory)
+{
+	constexpr std::string_view kPrefix = "pack-";
+	constexpr std::string_view kExtension = ".pack";
+	std::vector<std::string> packs;
+	std::error_code ec;
+	for (const auto& entry : std::filesystem::directory_iterator(packDirectory, ec))
+	{
+		const std::string filename = entry.path().filename().string();
+		if (!filename.starts_with(kPrefix) || !filename.ends_with(kExtension))
+		{
+			continue;
+		}
+		std::string name =
+			filename.substr(kPrefix.size(), filename.size() - kPrefix.size() - kExtension.size());
+		const auto sibling = [&](std::string_view extension)
+		{ return packDirectory / fmt::format("{}{}{}", kPrefix, name, extension); };
+		if (std::filesystem::exists(sibling(".idx")) && !std::filesystem::exists(sibling(".keep")))
+		{
+			packs.push_back(std::move(name));
+		}
+	}
+	std::ranges::sort(packs);
+	return packs;
+}
+
+RepackState ReadState(const std::filesystem::path& path)
+{
+	RepackState state;
+	std::ifstream file{path};
+	std::string kind;
+	std::string value;
+	while (file >> kind >> value)
+	{
+		git_oid tip{};
+		if (kind == "pack")
+		{
+			state.packs.insert(value);
+		}
+		else if (kind == "tip" && git_oid_fromstr(&tip, value.c_str()) == 0)
+		{
+			state.tips.push_back(tip);
+		}
+	}
+	return state;
+}
+
+void WriteState(
+	const std::filesystem::path& path, std::span<const std::string> packs,
+	std::span<const git_oid> tips
+)
+{
+	std::ofstream file{path};
+	for (const std::string& pack : packs)
+	{
+		fmt::print(file, "pack {}\n", pack);
+	}
+	for (const git_oid& tip : tips)
+	{
+		fmt::print(file, "tip {}\n", git_oid_tostr_s(&tip));
+	}
+}
+
+// What every ref points at, with symbolic refs resolved
+std::expected<std::vector<git_oid>, std::string> ListTips(git_repository* repository)
+{
+	git_reference_iterator* iterator = nullptr;
+	if (git_reference_iterator_new(&iterator, repository) != 0)
+	{
+		return std::unexpected(fmt::format("Could not list refs: {}", GitErrorMessage()));
+	}
+
+	std::vector<git_oid> tips;
+	git_reference* ref = nullptr;
+	while (git_reference_next(&ref, iterator) == 0)
+	{
+		git_reference* resolved = nullptr;
+		if (git_reference_resolve(&resolved, ref) == 0)
+		{
+			tips.push_back(*git_reference_target(resolved));
+			git_reference_free(resolved);
+		}
+		git_reference_free(ref);
+	}
+	git_reference_iterator_free(iterator);
+
+	std::ranges::sort(
+		tips, [](const git_oid& a, const git_oid& b) { return git_oid_cmp(&a, &b) < 0; }
+	);
+	const auto duplicates = std::ranges::unique(
+		tips, [](const git_oid& a, const git_oid& b) { return git_oid_equal(&a, &b) != 0; }
+	);
+	tips.erase(duplicates.begin(), duplicates.end());
+	return tips;
+}
+
+// An object database holding only `packs`
+std::expected<OdbPtr, std::string>
+OpenPacks(const std::filesystem::path& packDirectory, std::span<const std::string> packs)
+{
+	git_odb* odb = nullptr;
+	if (git_odb_new(&odb) != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not create an object database: {}", GitErrorMessage())
+		);
+	}
+	OdbPtr owned(odb, git_odb_free);
+
+	for (const std::string& pack : packs)
+	{
+		const std::filesystem::path index = packDirectory / fmt::format("pack-{}.idx", pack);
+		git_odb_backend* backend = nullptr;
+		if (git_odb_backend_one_pack(&backend, index.c_str()) != 0)
+		{
+			return std::unexpected(
+				fmt::format("Could not open {:?}: {}", index.c_str(), GitErrorMessage())
+			);
+		}
+		if (git_odb_add_backend(owned.get(), backend, 1) != 0)
+		{
+			backend->free(backend);
+			return std::unexpected(
+				fmt::format("Could not open {:?}: {}", index.c_str(), GitErrorMessage())
+			);
+		}
+	}
+	return owned;
+}
+
+// Adds the tree and everything below it that is in the packs being repacked. A tree that isn't
+// was repacked before along with everything below it, so it isn't walked.
+std::expected<void, std::string>
+InsertTree(PackInput& input, const git_oid& id, std::string& path)
+{
+	const bool seen = !input.seenTrees.emplace(git_oid_tostr_s(&id)).second;
+	if (seen || !git_odb_exists(input.fresh, &id))
+	{
+		return {};
+	}
+	if (git_packbuilder_insert(input.builder, &id, path.empty() ? nullptr : path.c_str()) != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not add tree {:?}: {}", path, GitErrorMessage())
+		);
+	}
+
+	git_tree* tree = nullptr;
+	if (git_tree_lookup(&tree, input.repository, &id) != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not read tree {:?}: {}", path, GitErrorMessage())
+		);
+	}
+	std::unique_ptr<git_tree, decltype(&git_tree_free)> owned(tree, git_tree_free);
+
+	const size_t parentLength = path.size();
+	for (size_t i = 0; i < git_tree_entrycount(tree); ++i)
+	{
+		const git_tree_entry* entry = git_tree_entry_byindex(tree, i);
+		const git_oid* entryId = git_tree_entry_id(entry);
+		if (parentLength > 0)
+		{
+			path.push_back('/');
+		}
+		path.append(git_tree_entry_name(entry));
+
+		// The path is what the packbuilder groups delta candidates by
+		if (git_tree_entry_type(entry) == GIT_OBJECT_TREE)
+		{
+			if (auto inserted = InsertTree(input, *entryId, path); !inserted)
+			{
+				return inserted;
+			}
+		}
+		else if (git_tree_entry_type(entry) == GIT_OBJECT_BLOB &&
+				 git_odb_exists(input.fresh, entryId))
+		{
+			if (git_packbuilder_insert(input.builder, entryId, path.c_str()) != 0)
+			{
+				return std::unexpected(
+					fmt::format("Could not add {:?}: {}", path, GitErrorMessage())
+				);
+			}
+		}
+		path.resize(parentLength);
+	}
+	return {};
+}
+
+// Whether every object in `pack` is also in `repacked`
+std::expected<bool, std::string> IsRepacked(
+	const std::filesystem::path& packDirectory, const std::string& pack, git_odb* repacked
+)
+{
+	const std::array packs{pack};
+	auto odb = OpenPacks(packDirectory, packs);
+	if (!odb)
+	{
+		return std::unexpected(odb.error());
+	}
+
+	const auto callback = [](const git_oid* id, void* payload)
+	{ return git_odb_exists(static_cast<git_odb*>(payload), id) ? 0 : 1; };
+	const int result = git_odb_foreach(odb->get(), callback, repacked);
+	if (result < 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not list pack {}: {}", pack, GitErrorMessage())
+		);
+	}
+	return result == 0;
+}
+
+std::expected<void, std::string>
+WriteCommitGraph(git_repository* repository, std::span<const git_oid> tips)
+{
+	git_revwalk* walk = nullptr;
+	if (git_revwalk_new(&walk, repository) != 0)
+	{
+		return std::unexpected(fmt::format("Could not walk history: {}", GitErrorMessage()));
+	}
+	std::unique_ptr<git_revwalk, decltype(&git_revwalk_free)> ownedWalk(walk, git_revwalk_free);
+	for (const git_oid& tip : tips)
+	{
+		if (git_revwalk_push(walk, &tip) != 0)
+		{
+			return std::unexpected(
+				fmt::format("Could not walk from {}: {}", git_oid_tostr_s(&tip), GitErrorMessage())
+			);
+		}
+	}
+
+	const std::filesystem::path infoDirectory =
+		std::filesystem::path(git_repository_path(repository)) / "objects" / "info";
+	git_commit_graph_writer* writer = nullptr;
+	git_commit_graph_writer_options options = GIT_COMMIT_GRAPH_WRITER_OPTIONS_INIT;
+	// libgit2 1.9 moved the options from writing to creating the writer
+#if LIBGIT2_VER_MAJOR > 1 || LIBGIT2_VER_MINOR >= 9
+	int result = git_commit_graph_writer_new(&writer, infoDirectory.c_str(), &options);
+#else
+	int result = git_commit_graph_writer_new(&writer, infoDirectory.c_str());
+#endif
+	if (result != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not create a commit-graph writer: {}", GitErrorMessage())
+		);
+	}
+	std::unique_ptr<git_commit_graph_writer, decltype(&git_commit_graph_writer_free)> owned(
+		writer, git_commit_graph_writer_free
+	);
+
+	result = git_commit_graph_writer_add_revwalk(writer, walk);
+#if LIBGIT2_VER_MAJOR > 1 || LIBGIT2_VER_MINOR >= 9
+	result = result != 0 ? result : git_commit_graph_writer_commit(writer);
+#else
+	result = result != 0 ? result : git_commit_graph_writer_commit(writer, &options);
+#endif
+	if (result != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not write the commit-graph: {}", GitErrorMessage())
+		);
+	}
+	return {};
+}
+
+} // namespace
+
+std::expected<void, std::string>
+RepackRepository(const std::filesystem::path& gitRoot, unsigned int threads)
+{
+	const auto start = std::chrono::steady_clock::now();
+	const std::filesystem::path packDirectory = gitRoot / "objects" / "pack";
+	const RepackState state = ReadState(gitRoot / kRepackStatePath);
+
+	std::vector<std::string> fresh;
+	std::ranges::copy_if(
+		ListPacks(packDirectory), std::back_inserter(fresh),
+		[&](const std::string& pack) { return !state.packs.contains(pack); }
+	);
+
+	git_repository* repository = nullptr;
+	if (git_repository_open(&repository, gitRoot.c_str()) != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not open {:?}: {}", gitRoot.c_str(), GitErrorMessage())
+		);
+	}
+	std::unique_ptr<git_repository, decltype(&git_repository_free)> ownedRepository(
+		repository, git_repository_free
+	);
+
+	auto tips = ListTips(repository);
+	if (!tips)
+	{
+		return std::unexpected(tips.error());
+	}
+
+	std::string written;
+	if (!fresh.empty())
+	{
+		auto freshObjects = OpenPacks(packDirectory, fresh);
+		if (!freshObjects)
+		{
+			return std::unexpected(freshObjects.error());
+		}
+
+		git_packbuilder* builder = nullptr;
+		if (git_packbuilder_new(&builder, repository) != 0)
+		{
+			return std::unexpected(fmt::format("Could not create a pack: {}", GitErrorMessage()));
+		}
+		std::unique_ptr<git_packbuilder, decltype(&git_packbuilder_free)> ownedBuilder(
+			builder, git_packbuilder_free
+		);
+		const unsigned int packThreads = git_packbuilder_set_threads(builder, threads);
+
+		// Only the commits since the last repack, their parents were walked then
+		git_revwalk* walk = nullptr;
+		if (git_revwalk_new(&walk, repository) != 0)
+		{
+			return std::unexpected(fmt::format("Could not walk history: {}", GitErrorMessage()));
+		}
+		std::unique_ptr<git_revwalk, decltype(&git_revwalk_free)> ownedWalk(walk, git_revwalk_free);
+		for (const git_oid& tip : *tips)
+		{
+			git_revwalk_push(walk, &tip);
+		}
+		for (const git_oid& tip : state.tips)
+		{
+			// A tip that has since gone, such as a rewritten branch, just isn't a boundary
+			git_revwalk_hide(walk, &tip);
+		}
+
+		PackInput input{
+			.repository = repository, .builder = builder, .fresh = freshObjects->get()
+		};
+		std::string path;
+		git_oid id{};
+		size_t commits = 0;
+		while (git_revwalk_next(&id, walk) == 0)
+		{
+			if (!git_odb_exists(input.fresh, &id))
+			{
+				continue;
+			}
+			git_commit* commit = nullptr;
+			if (git_packbuilder_insert(builder, &id, nullptr) != 0 ||
+				git_commit_lookup(&commit, repository, &id) != 0)
+			{
+				return std::unexpected(
+					fmt::format(
+						"Could not add commit {}: {}", git_oid_tostr_s(&id), GitErrorMessage()
+					)
+				);
+			}
+			const git_oid treeId = *git_commit_tree_id(commit);
+			git_commit_free(commit);
+
+			path.clear();
+			if (auto inserted = InsertTree(input, treeId, path); !inserted)
+			{
+				return std::unexpected(inserted.error());
+			}
+			commits++;
+		}
+
+		const size_t objects = git_packbuilder_object_count(builder);
+		Log("Repacking {} objects from {} commits in {} packs on {} threads", objects, commits,
+			fresh.size(), packThreads);
+		if (objects > 0)
+		{
+			if (git_packbuilder_write(builder, packDirectory.c_str(), 0, nullptr, nullptr) != 0)
+			{
+				return std::unexpected(
+					fmt::format("Could not write the pack: {}", GitErrorMessage())
+				);
+			}
+			written = git_packbuilder_name(builder);
+		}
+	}
+
+	// The packs that are now covered by the new one go
+	if (!written.empty())
+	{
+		const std::array repackedPacks{written};
+		auto repacked = OpenPacks(packDirectory, repackedPacks);
+		if (!repacked)
+		{
+			return std::unexpected(repacked.error());
+		}
+		size_t removed = 0;
+		for (const std::string& pack : fresh)
+		{
+			if (pack == written)
+			{
+				continue;
+			}
+			auto covered = IsRepacked(packDirectory, pack, repacked->get());
+			if (!covered)
+			{
+				return std::unexpected(covered.error());
+			}
+			if (!*covered)
+			{
+				Log("Keeping pack {}, it has objects no ref reaches", pack);
+				continue;
+			}
+			for (const std::string_view extension : {".pack", ".idx", ".rev", ".bitmap"})
+			{
+				const std::string filename = fmt::format("pack-{}{}", pack, extension);
+				std::error_code ec;
+				std::filesystem::remove(packDirectory / filename, ec);
+			}
+			removed++;
+		}
+		Log("Wrote pack {}, replacing {} packs", written, removed);
+	}
+
+	// Reopened, so the deleted packs aren't looked in
+	ownedRepository.reset();
+	if (git_repository_open(&repository, gitRoot.c_str()) != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not open {:?}: {}", gitRoot.c_str(), GitErrorMessage())
+		);
+	}
+	ownedRepository.reset(repository);
+	auto graph = WriteCommitGraph(repository, *tips);
+	if (!graph)
+	{
+		return std::unexpected(graph.error());
+	}
+
+	WriteState(gitRoot / kRepackStatePath, ListPacks(packDirectory), *tips);
+	const auto elapsed =
+		std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start);
+	Log("Repacked {:?} in {}s", gitRoot.c_str(), elapsed.count());
+	return {};
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <expected>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+/// What the last repack left in the git directory: the packs it saw, and the ref tips it walked
+/// from. Relative to the git directory.
+static constexpr std::string_view kRepackStatePath = "svn_lfs_export_repack";
+
+/// Repacks the packs fast-import added to the repository at `gitRoot` since the last repack into
+/// one, with libgit2's packbuilder on `threads` threads, then writes a commit-graph for the whole
+/// history.
+///
+/// Objects are found by walking the trees of the commits added since the last repack, and each
+/// is handed to the packbuilder with its full path so files at the same path are tried as delta
+/// bases for each other. A pack is only deleted once every object in it is in the new pack, so
+/// anything unreachable (such as commits replaced by --only-branch) is left where it was.
+std::expected<void, std::string>
+RepackRepository(const std::filesystem::path& gitRoot, unsigned int threads);
@@ -0,0 +1,468 @@
+#include "Spool.hpp"
+#include "Svn.hpp"
+#include "Writer.hpp"
+
+#include <fmt/format.h>
+#include <svn_error.h>
+#include <svn_io.h>
+#include <svn_string.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <fstream>
+#include <ios>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+// File layout: an 8 byte magic, then segments. Each segment is a SegmentHeader followed by its
+// compressed records. A record is "<type> <size>[ <name>]\n" and then <size> bytes of data:
+//   C  fast-import commands
+//   W  a file written into the git directory, if it doesn't exist (name is the path)
+//   A  data appended to a file in the git directory (name is the path)
+//   L  an LFS object (name is the oid)
+static constexpr std::array<char, 8> kMagic = {'S', 'L', 'E', 'S', 'P', 'O', 'O', 'L'};
+
+// Segments end at the first revision boundary after this many uncompressed bytes
+static constexpr size_t kSegmentSize = 4 * 1024 * 1024;
+
+// Stored as four little endian 64 bit fields, in this order, so spools move between machines
+struct SegmentHeader
+{
+	std::int64_t firstRevision = 0;
+	std::int64_t lastRevision = 0;
+	std::uint64_t compressedSize = 0;
+	std::uint64_t size = 0;
+};
+static constexpr size_t kSegmentHeaderSize = 4 * sizeof(std::uint64_t);
+
+static void AppendUint64(std::string& out, std::uint64_t value)
+{
+	for (size_t i = 0; i < sizeof(value); ++i)
+	{
+		out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+	}
+}
+
+static std::uint64_t ReadUint64(const char* data)
+{
+	std::uint64_t value = 0;
+	for (size_t i = 0; i < sizeof(value); ++i)
+	{
+		value |= static_cast<std::uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+	}
+	return value;
+}
+
+static std::string EncodeHeader(const SegmentHeader& header)
+{
+	std::string encoded;
+	AppendUint64(encoded, static_cast<std::uint64_t>(header.firstRevision));
+	AppendUint64(encoded, static_cast<std::uint64_t>(header.lastRevision));
+	AppendUint64(encoded, header.compressedSize);
+	AppendUint64(encoded, header.size);
+	return encoded;
+}
+
+static SegmentHeader DecodeHeader(const std::array<char, kSegmentHeaderSize>& encoded)
+{
+	const auto field = [&](size_t index) { return ReadUint64(encoded.data() + 8 * index); };
+	return {
+		.firstRevision = static_cast<std::int64_t>(field(0)),
+		.lastRevision = static_cast<std::int64_t>(field(1)),
+		.compressedSize = field(2),
+		.size = field(3),
+	};
+}
+
+static std::expected<std::string, std::string> Compress(std::string_view data)
+{
+	svn::Pool pool;
+	svn_stringbuf_t* compressed = svn_stringbuf_create_empty(pool);
+	svn_stream_t* stream =
+		svn_stream_compressed(svn_stream_from_stringbuf(compressed, pool), pool);
+
+	apr_size_t length = data.size();
+	svn_error_t* err = svn_stream_write(stream, data.data(), &length);
+	if (!err)
+	{
+		err = svn_stream_close(stream);
+	}
+	if (err)
+	{
+		return std::unexpected(svn::FormatSvnError(err));
+	}
+	return std::string(compressed->data, compressed->len);
+}
+
+static std::expected<std::string, std::string>
+Decompress(std::string_view compressed, size_t size)
+{
+	svn::Pool pool;
+	svn_string_t input{compressed.data(), compressed.size()};
+	svn_stream_t* stream = svn_stream_compressed(svn_stream_from_string(&input, pool), pool);
+
+	std::string data(size, '\0');
+	apr_size_t length = size;
+	svn_error_t* err = svn_stream_read_full(stream, data.data(), &length);
+	if (err)
+	{
+		return std::unexpected(svn::FormatSvnError(err));
+	}
+	if (length != size)
+	{
+		return std::unexpected(fmt::format("expected {} bytes, decompressed {}", size, length));
+	}
+	return data;
+}
+
+std::expected<std::unique_ptr<FastImportSpool>, std::string>
+FastImportSpool::Create(const std::filesystem::path& path)
+{
+	std::unique_ptr<FastImportSpool> spool(new FastImportSpool());
+	spool->mPath = path;
+	spool->mFile.open(path, std::ios::binary | std::ios::trunc);
+	spool->mFile.write(kMagic.data(), kMagic.size());
+	if (!spool->mFile)
+	{
+		return std::unexpected(fmt::format("Could not create spool file {:?}", path.c_str()));
+	}
+	return spool;
+}
+
+void FastImportSpool::WriteToGitDirectory(std::filesystem::path path, const std::string_view data)
+{
+	AddRecord('W', path.native(), data);
+}
+
+std::expected<void, std::string>
+FastImportSpool::AppendToGitDirectory(std::filesystem::path path, const std::string_view data)
+{
+	AddRecord('A', path.native(), data);
+	return {};
+}
+
+std::expected<void, std::string>
+FastImportSpool::WriteLFSObject(std::string_view oid, const std::string_view data)
+{
+	AddRecord('L', oid, data);
+	return {};
+}
+
+void FastImportSpool::Write(std::string_view content)
+{
+	mCommands.append(content);
+}
+
+void FastImportSpool::AddRecord(char type, std::string_view name, std::string_view data)
+{
+	FlushCommands();
+	if (name.empty())
+	{
+		fmt::format_to(std::back_inserter(mSegment), "{} {}\n", type, data.size());
+	}
+	else
+	{
+		fmt::format_to(std::back_inserter(mSegment), "{} {} {}\n", type, data.size(), name);
+	}
+	mSegment.append(data);
+}
+
+void FastImportSpool::FlushCommands()
+{
+	if (mCommands.empty())
+	{
+		return;
+	}
+	const std::string commands = std::exchange(mCommands, {});
+	AddRecord('C', {}, commands);
+}
+
+std::expected<void, std::string> FastImportSpool::EndRevision(long int revision)
+{
+	FlushCommands();
+	if (mFirstRevision < 0)
+	{
+		mFirstRevision = revision;
+	}
+	mLastRevision = revision;
+
+	if (mSegment.size() < kSegmentSize)
+	{
+		return {};
+	}
+	return WriteSegment();
+}
+
+std::expected<void, std::string> FastImportSpool::Close()
+{
+	FlushCommands();
+	auto written = WriteSegment();
+	mFile.close();
+	return written;
+}
+
+std::expected<void, std::string> FastImportSpool::WriteSegment()
+{
+	if (mSegment.empty())
+	{
+		return {};
+	}
+
+	auto compressed = Compress(mSegment);
+	if (!compressed)
+	{
+		return std::unexpected(compressed.error());
+	}
+
+	const SegmentHeader header{
+		.firstRevision = mFirstRevision,
+		.lastRevision = mLastRevision,
+		.compressedSize = compressed->size(),
+		.size = mSegment.size(),
+	};
+	const std::string encodedHeader = EncodeHeader(header);
+	mFile.write(encodedHeader.data(), static_cast<std::streamsize>(encodedHeader.size()));
+	mFile.write(compressed->data(), static_cast<std::streamsize>(compressed->size()));
+	mFile.flush();
+	if (!mFile)
+	{
+		return std::unexpected(fmt::format("Could not write spool file {:?}", mPath.c_str()));
+	}
+
+	mSegment.clear();
+	mFirstRevision = -1;
+	return {};
+}
+
+static std::expected<void, std::string> ReplayRecords(std::string_view records, IFastImport& writer)
+{
+	while (!records.empty())
+	{
+		const auto headerEnd = records.find('\n');
+		if (headerEnd == std::string_view::npos || headerEnd < 3 || records[1] != ' ')
+		{
+			return std::unexpected("invalid record");
+		}
+		const char type = records[0];
+		const std::string_view header = records.substr(2, headerEnd - 2);
+		records.remove_prefix(headerEnd + 1);
+
+		size_t size = 0;
+		const char* headerEndPtr = header.data() + header.size();
+		auto [sizeEnd, error] = std::from_chars(header.data(), headerEndPtr, size);
+		std::string_view name(sizeEnd, headerEndPtr);
+		if (error != std::errc{} || size > records.size() ||
+			(!name.empty() && !name.starts_with(' ')))
+		{
+			return std::unexpected("invalid record");
+		}
+		if (!name.empty())
+		{
+			name.remove_prefix(1);
+		}
+
+		const std::string_view data = records.substr(0, size);
+		records.remove_prefix(size);
+
+		switch (type)
+		{
+		case 'C':
+			writer.WriteCommands(data);
+			break;
+		case 'W':
+			writer.WriteToGitDirectory(name, data);
+			break;
+		case 'A':
+			if (auto appended = writer.AppendToGitDirectory(name, data); !appended)
+			{
+				return std::unexpected(appended.error());
+			}
+			break;
+		case 'L':
+			if (auto written = writer.WriteLFSObject(name, data); !written)
+			{
+				return std::unexpected(written.error());
+			}
+			break;
+		default:
+			return std::unexpected(fmt::format("unknown record type {:?}", type));
+		}
+	}
+	return {};
+}
+
+std::expected<ReplayResult, std::string>
+ReplaySpool(const std::filesystem::path& path, IFastImport& writer, long int after)
+{
+	std::ifstream file{path, std::ios::binary};
+	std::array<char, kMagic.size()> magic{};
+	file.read(magic.data(), magic.size());
+	if (!file || magic != kMagic)
+	{
+		return std::unexpected(fmt::format("{:?} is not a spool file", path.c_str()));
+	}
+
+	ReplayResult result{.lastRevision = after};
+	std::string compressed;
+	while (true)
+	{
+		std::array<char, kSegmentHeaderSize> encodedHeader{};
+		file.read(encodedHeader.data(), encodedHeader.size());
+		if (file.gcount() == 0 && file.eof())
+		{
+			break;
+		}
+		if (!file)
+		{
+			return std::unexpected(fmt::format("Spool file {:?} is truncated", path.c_str()));
+		}
+		const SegmentHeader header = DecodeHeader(encodedHeader);
+		result.segments++;
+
+		if (header.lastRevision <= after)
+		{
+			file.seekg(static_cast<std::streamoff>(header.compressedSize), std::ios::cur);
+			result.skipped++;
+			continue;
+		}
+		if (header.firstRevision <= result.lastRevision)
+		{
+			return std::unexpected(
+				fmt::format(
+					"Spool file {:?} has r{}:r{}, which overlaps r{} already in the repository",
+					path.c_str(), header.firstRevision, header.lastRevision, result.lastRevision
+				)
+			);
+		}
+
+		compressed.resize(header.compressedSize);
+		file.read(compressed.data(), static_cast<std::streamsize>(compressed.size()));
+		if (!file)
+		{
+			return std::unexpected(fmt::format("Spool file {:?} is truncated", path.c_str()));
+		}
+
+		auto records = Decompress(compressed, header.size);
+		if (!records)
+		{
+			return std::unexpected(
+				fmt::format(
+					"Could not read r{}:r{} from spool file {:?}: {}", header.firstRevision,
+					header.lastRevision, path.c_str(), records.error()
+				)
+			);
+		}
+		auto replayed = ReplayRecords(*records, writer);
+		if (!replayed)
+		{
+			return std::unexpected(
+				fmt::format(
+					"Could not replay r{}:r{} from spool file {:?}: {}", header.firstRevision,
+					header.lastRevision, path.c_str(), replayed.error()
+				)
+			);
+		}
+		result.lastRevision = header.lastRevision;
+	}
+	return result;
+}
+
+// One "<kind> <value>" line per entry, routed paths as "routed <branch> <path>". Git refuses
+// spaces in branch names, and paths with a newline are never routed.
+std::expected<std::optional<SpoolState>, std::string>
+ReadSpoolState(const std::filesystem::path& directory)
+{
+	const std::filesystem::path path = directory / kSpoolStatePath;
+	if (!std::filesystem::exists(path))
+	{
+		return std::nullopt;
+	}
+
+	SpoolState state;
+	std::ifstream file{path};
+	std::string line;
+	while (std::getline(file, line))
+	{
+		const auto space = line.find(' ');
+		const std::string_view kind = std::string_view(line).substr(0, space);
+		const std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+		if (kind == "revision")
+		{
+			auto [end, error] =
+				std::from_chars(value.data(), value.data() + value.size(), state.lastRevision);
+			if (error != std::errc{})
+			{
+				return std::unexpected(fmt::format("Spool state {:?} is invalid", path.c_str()));
+			}
+		}
+		else if (kind == "branch")
+		{
+			state.branches.insert(value);
+		}
+		else if (kind == "tag")
+		{
+			state.tags.insert(value);
+		}
+		else if (kind == "routed" && value.contains(' '))
+		{
+			const auto branchEnd = value.find(' ');
+			state.routedPaths[value.substr(0, branchEnd)].insert(value.substr(branchEnd + 1));
+		}
+		else
+		{
+			return std::unexpected(fmt::format("Spool state {:?} is invalid", path.c_str()));
+		}
+	}
+	return state;
+}
+
+std::expected<void, std::string>
+WriteSpoolState(const std::filesystem::path& directory, const SpoolState& state)
+{
+	std::string contents = fmt::format("revision {}\n", state.lastRevision);
+	for (const std::string& branch : state.branches)
+	{
+		fmt::format_to(std::back_inserter(contents), "branch {}\n", branch);
+	}
+	for (const std::string& tag : state.tags)
+	{
+		fmt::format_to(std::back_inserter(contents), "tag {}\n", tag);
+	}
+	for (const auto& [branch, paths] : state.routedPaths)
+	{
+		for (const std::string& path : paths)
+		{
+			fmt::format_to(std::back_inserter(contents), "routed {} {}\n", branch, path);
+		}
+	}
+
+	// Replaced in one step, so an interrupted run leaves the previous state
+	const std::filesystem::path path = directory / kSpoolStatePath;
+	const std::filesystem::path temporary = directory / fmt::format("{}.tmp", kSpoolStatePath);
+	std::ofstream file{temporary, std::ios::trunc};
+	file << contents;
+	file.close();
+	if (file.fail())
+	{
+		return std::unexpected(fmt::format("Could not write spool state {:?}", path.c_str()));
+	}
+	std::error_code ec;
+	std::filesystem::rename(temporary, path, ec);
+	if (ec)
+	{
+		return std::unexpected(
+			fmt::format("Could not write spool state {:?}: {}", path.c_str(), ec.message())
+		);
+	}
+	return {};
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "Writer.hpp"
+
+#include <cstddef>
+#include <expected>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+
+/// Where --spool keeps what the spools recorded so far wrote, relative to the directory the spool
+/// is written to.
+static constexpr std::string_view kSpoolStatePath = "svn_lfs_export_spool_state";
+
+/// Records the fast-import stream, and the files written into the git directory alongside it
+/// (LFS objects, the branch index, ...), to a spool file instead of running git fast-import.
+/// ReplaySpool() feeds it into fast-import later, possibly on another machine, so the svn side
+/// and the git side of a conversion don't have to run together, and the git side can be run
+/// again without reading svn.
+///
+/// A spool is a series of independently compressed segments, each ending at a revision boundary
+/// and starting with a header giving its revision range and size. Replaying skips the segments a
+/// repository already has without decompressing them.
+class FastImportSpool : public IFastImport
+{
+public:
+	static std::expected<std::unique_ptr<FastImportSpool>, std::string>
+	Create(const std::filesystem::path& path);
+
+	void WriteToGitDirectory(std::filesystem::path path, const std::string_view data) final;
+	std::expected<void, std::string>
+	AppendToGitDirectory(std::filesystem::path path, const std::string_view data) final;
+	std::expected<void, std::string>
+	WriteLFSObject(std::string_view oid, const std::string_view data) final;
+
+	/// Mark the end of the commands for `revision`. Starts a new segment once the current one is
+	/// big enough.
+	std::expected<void, std::string> EndRevision(long int revision);
+
+	/// Write out the last segment.
+	std::expected<void, std::string> Close();
+
+private:
+	FastImportSpool() = default;
+
+	void Write(std::string_view content) final;
+
+	void AddRecord(char type, std::string_view name, std::string_view data);
+	void FlushCommands();
+	std::expected<void, std::string> WriteSegment();
+
+	std::filesystem::path mPath;
+	std::ofstream mFile;
+	/// Uncompressed records of the segment being built
+	std::string mSegment;
+	/// Commands since the last record, so consecutive writes become one record
+	std::string mCommands;
+	long int mFirstRevision = -1;
+	long int mLastRevision = -1;
+};
+
+/// What the spools recorded so far wrote, so the next --spool carries on from them rather than
+/// from the git repository, which doesn't have any of it until the spools are replayed.
+struct SpoolState
+{
+	/// Every revision up to and including this one has been spooled
+	long int lastRevision = 0;
+	using NameSet = std::set<std::string, std::less<>>;
+	NameSet branches;
+	NameSet tags;
+	/// Per branch, the paths routed to LFS by lfs_size_threshold or lfs_binary
+	std::map<std::string, NameSet, std::less<>> routedPaths;
+};
+
+/// The state in `directory`, unset if no spool has been recorded there yet.
+std::expected<std::optional<SpoolState>, std::string>
+ReadSpoolState(const std::filesystem::path& directory);
+
+std::expected<void, std::string>
+WriteSpoolState(const std::filesystem::path& directory, const SpoolState& state);
+
+struct ReplayResult
+{
+	/// The last revision replayed, or the `after` given if the spool had nothing newer
+	long int lastRevision = 0;
+	size_t segments = 0;
+	/// Segments holding only revisions the repository already has
+	size_t skipped = 0;
+};
+
+/// Feed the spool at `path` into `writer`, skipping the segments that only hold revisions up to
+/// and including `after`.
+std::expected<ReplayResult, std::string>
+ReplaySpool(const std::filesystem::path& path, IFastImport& writer, long int after);
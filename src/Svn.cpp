@@ -1,9 +1,13 @@
+#include "Dump.hpp"
+#include "Memory.hpp"
 #include "Svn.hpp"
 #include "Utils.hpp"
 
 #include <apr_hash.h>
 #include <apr_pools.h>
+#include <apr_strings.h>
 #include <fmt/format.h>
+#include <svn_cache_config.h>
 #include <svn_dirent_uri.h>
 #include <svn_error.h>
 #include <svn_fs.h>
@@ -14,7 +18,10 @@
 #include <svn_string.h>
 #include <svn_types.h>
 
+#include <algorithm>
+#include <charconv>
 #include <cstddef>
+#include <cstdint>
 #include <expected>
 #include <functional>
 #include <memory>
@@ -22,6 +29,7 @@
 #include <source_location>
 #include <string>
 #include <string_view>
+#include <system_error>
 
 std::optional<std::string> HashGet(apr_hash_t* hash, const char* key)
 {
@@ -36,8 +44,36 @@ std::optional<std::string> HashGet(apr_hash_t* hash, const char* key)
 namespace svn
 {
 
-std::string
-FormatSvnError(svn_error_t* err, std::source_location loc = std::source_location::current())
+// FSFS node revision ids look like "<node>.<copy>.r<rev>/<offset>". Other backends, and
+// uncommitted transaction ids, don't have a location and are left as unknown.
+static File::Location ParseLocation(std::string_view id)
+{
+	File::Location location;
+	const auto revStart = id.rfind(".r");
+	if (revStart == std::string_view::npos)
+	{
+		return location;
+	}
+	id.remove_prefix(revStart + 2);
+
+	const auto slash = id.find('/');
+	if (slash == std::string_view::npos)
+	{
+		return location;
+	}
+
+	long int rev = 0;
+	std::uint64_t offset = 0;
+	const auto revResult = std::from_chars(id.data(), id.data() + slash, rev);
+	const auto offsetResult = std::from_chars(id.data() + slash + 1, id.data() + id.size(), offset);
+	if (revResult.ec == std::errc{} && offsetResult.ec == std::errc{})
+	{
+		location = {.rev = rev, .offset = offset};
+	}
+	return location;
+}
+
+std::string FormatSvnError(svn_error_t* err, std::source_location loc)
 {
 	char buf[256];
 	const char* message = svn_err_best_message(err, buf, sizeof(buf));
@@ -50,7 +86,8 @@ FormatSvnError(svn_error_t* err, std::source_location loc = std::source_location
 using FileCallback = std::function<std::expected<void, std::string>(const char* path)>;
 
 std::expected<void, std::string> WalkAllChildren(
-	svn_fs_root_t* root, const char* path, apr_pool_t* pool, const FileCallback& callback
+	svn_fs_root_t* root, const char* path, apr_pool_t* pool, const FileCallback& callback,
+	const DirectoryFilter& descend = {}
 )
 {
 	apr_hash_t* entries = nullptr;
@@ -72,7 +109,11 @@ std::expected<void, std::string> WalkAllChildren(
 
 		if (dirent->kind == svn_node_dir)
 		{
-			if (auto r = WalkAllChildren(root, childPath, pool, callback); !r)
+			if (descend && !descend(fmt::format("{}/", childPath)))
+			{
+				continue;
+			}
+			if (auto r = WalkAllChildren(root, childPath, pool, callback, descend); !r)
 			{
 				return r;
 			}
@@ -88,17 +129,63 @@ std::expected<void, std::string> WalkAllChildren(
 	return {};
 }
 
-std::expected<Repository, std::string> Repository::Open(const std::string& path)
+// DefaultCacheSize takes this share of physical memory, within the bounds below
+static constexpr size_t kCacheMemoryDivisor = 4;
+static constexpr size_t kMinCacheSize = size_t{64} * 1024 * 1024;
+static constexpr size_t kMaxCacheSize = size_t{16} * 1024 * 1024 * 1024;
+
+void ConfigureCache(size_t bytes)
 {
-	Repository repo;
-	svn_error_t* err = svn_repos_open3(
-		&repo.mRepos, path.c_str(), nullptr, repo.mRepositoryPool, repo.mRepositoryPool
-	);
+	svn_cache_config_t settings = *svn_cache_config_get();
+	settings.cache_size = bytes;
+	// The reader threads share the cache
+	settings.single_threaded = false;
+	svn_cache_config_set(&settings);
+}
+
+size_t DefaultCacheSize()
+{
+	const size_t physical = GetPhysicalMemory();
+	if (physical == 0)
+	{
+		return kMinCacheSize;
+	}
+	return std::clamp(physical / kCacheMemoryDivisor, kMinCacheSize, kMaxCacheSize);
+}
+
+size_t GetCacheSize()
+{
+	return static_cast<size_t>(svn_cache_config_get()->cache_size);
+}
+
+std::expected<svn_fs_t*, std::string> OpenFilesystem(const std::string& path, apr_pool_t* pool)
+{
+	// These only apply to FSFS, other backends ignore them
+	apr_hash_t* fsConfig = apr_hash_make(pool);
+	apr_hash_set(fsConfig, SVN_FS_CONFIG_FSFS_BLOCK_READ, APR_HASH_KEY_STRING, "1");
+	apr_hash_set(fsConfig, SVN_FS_CONFIG_FSFS_CACHE_DELTAS, APR_HASH_KEY_STRING, "1");
+	apr_hash_set(fsConfig, SVN_FS_CONFIG_FSFS_CACHE_FULLTEXTS, APR_HASH_KEY_STRING, "1");
+	apr_hash_set(fsConfig, SVN_FS_CONFIG_FSFS_CACHE_NODEPROPS, APR_HASH_KEY_STRING, "1");
+	apr_hash_set(fsConfig, SVN_FS_CONFIG_FSFS_CACHE_REVPROPS, APR_HASH_KEY_STRING, "1");
+
+	svn_repos_t* repos = nullptr;
+	svn_error_t* err = svn_repos_open3(&repos, path.c_str(), fsConfig, pool, pool);
 	if (err)
 	{
 		return std::unexpected(FormatSvnError(err));
 	}
-	repo.mFs = svn_repos_fs(repo.mRepos);
+	return svn_repos_fs(repos);
+}
+
+std::expected<Repository, std::string> Repository::Open(const std::string& path)
+{
+	Repository repo;
+	auto fs = OpenFilesystem(path, repo.mRepositoryPool);
+	if (!fs)
+	{
+		return std::unexpected(fs.error());
+	}
+	repo.mFs = *fs;
 
 	return repo;
 }
@@ -122,31 +209,92 @@ std::expected<Revision, std::string> Repository::GetRevision(long int revision)
 	return Revision::Create(mFs, revision);
 }
 
-std::expected<Revision, std::string> Revision::Create(svn_fs_t* repositoryFs, long int revision)
+std::expected<Revision, std::string>
+Repository::GetSnapshot(long int revision, const DirectoryFilter& descend)
+{
+	return Revision::CreateSnapshot(mFs, revision, descend);
+}
+
+std::expected<void, std::string> Revision::ReadProperties(svn_fs_t* repositoryFs)
+{
+	apr_hash_t* revProps = nullptr;
+	svn_error_t* err = svn_fs_revision_proplist2(
+		&revProps, repositoryFs, mRevNum, false, mRevisionPool, mRevisionPool
+	);
+	if (err)
+	{
+		return std::unexpected(FormatSvnError(err));
+	}
+
+	static constexpr const char* kEpoch = "1970-01-01T00:00:00Z";
+	mAuthor = HashGet(revProps, SVN_PROP_REVISION_AUTHOR).value_or("");
+	mLog = HashGet(revProps, SVN_PROP_REVISION_LOG).value_or("");
+	mDate = HashGet(revProps, SVN_PROP_REVISION_DATE).value_or(kEpoch);
+	return {};
+}
+
+std::expected<Revision, std::string> Revision::CreateSnapshot(
+	svn_fs_t* repositoryFs, long int revision, const DirectoryFilter& descend
+)
 {
 	Revision rev(revision);
-	svn_error_t* err = nullptr;
+	rev.mSnapshot = true;
 
 	svn_fs_root_t* revisionFs = nullptr;
-	err = svn_fs_revision_root(&revisionFs, repositoryFs, rev.mRevNum, rev.mRevisionPool);
+	svn_error_t* err =
+		svn_fs_revision_root(&revisionFs, repositoryFs, rev.mRevNum, rev.mRevisionPool);
 	if (err)
 	{
 		return std::unexpected(FormatSvnError(err));
 	}
 
-	apr_hash_t* revProps = nullptr;
-	err = svn_fs_revision_proplist2(
-		&revProps, repositoryFs, rev.mRevNum, false, rev.mRevisionPool, rev.mRevisionPool
+	auto read = rev.ReadProperties(repositoryFs);
+	if (!read)
+	{
+		return std::unexpected(read.error());
+	}
+	rev.mLog = fmt::format("Snapshot of r{}", revision);
+
+	svn::Pool iterPool(rev.mRevisionPool);
+	auto walk = WalkAllChildren(
+		revisionFs, "/", rev.mRevisionPool,
+		[&](const char* filePath) -> std::expected<void, std::string>
+		{
+			iterPool.clear();
+			auto file = File::Create(revisionFs, filePath, false, File::Change::Add, iterPool);
+			if (!file)
+			{
+				return std::unexpected(file.error());
+			}
+			rev.mFiles.emplace_back(std::move(*file));
+			return {};
+		},
+		descend
 	);
+	if (!walk)
+	{
+		return std::unexpected(walk.error());
+	}
+	return rev;
+}
+
+std::expected<Revision, std::string> Revision::Create(svn_fs_t* repositoryFs, long int revision)
+{
+	Revision rev(revision);
+	svn_error_t* err = nullptr;
+
+	svn_fs_root_t* revisionFs = nullptr;
+	err = svn_fs_revision_root(&revisionFs, repositoryFs, rev.mRevNum, rev.mRevisionPool);
 	if (err)
 	{
 		return std::unexpected(FormatSvnError(err));
 	}
 
-	static constexpr const char* kEpoch = "1970-01-01T00:00:00Z";
-	rev.mAuthor = HashGet(revProps, SVN_PROP_REVISION_AUTHOR).value_or("");
-	rev.mLog = HashGet(revProps, SVN_PROP_REVISION_LOG).value_or("");
-	rev.mDate = HashGet(revProps, SVN_PROP_REVISION_DATE).value_or(kEpoch);
+	auto read = rev.ReadProperties(repositoryFs);
+	if (!read)
+	{
+		return std::unexpected(read.error());
+	}
 
 	svn_fs_path_change_iterator_t* changesIt = nullptr;
 	err = svn_fs_paths_changed3(&changesIt, revisionFs, rev.mRevisionPool, rev.mRevisionPool);
@@ -155,6 +303,9 @@ std::expected<Revision, std::string> Revision::Create(svn_fs_t* repositoryFs, lo
 		return std::unexpected(FormatSvnError(err));
 	}
 
+	// Per file temporary allocations, cleared after every file rather than growing the revision
+	svn::Pool iterPool(rev.mRevisionPool);
+
 	svn_fs_path_change3_t* change = nullptr;
 	while ((err = svn_fs_path_change_get(&change, changesIt)) == SVN_NO_ERROR && change)
 	{
@@ -169,10 +320,15 @@ std::expected<Revision, std::string> Revision::Create(svn_fs_t* repositoryFs, lo
 		}
 
 		const bool isDir = change->node_kind == svn_node_dir;
-		const std::string path = {change->path.data, change->path.len};
-
-		auto maybeFile =
-			File::Create(revisionFs, path, isDir, static_cast<File::Change>(change->change_kind));
+		const std::string_view path = {
+			apr_pstrmemdup(rev.mRevisionPool, change->path.data, change->path.len),
+			change->path.len
+		};
+
+		iterPool.clear();
+		auto maybeFile = File::Create(
+			revisionFs, path, isDir, static_cast<File::Change>(change->change_kind), iterPool
+		);
 		if (!maybeFile)
 		{
 			return std::unexpected(maybeFile.error());
@@ -183,17 +339,23 @@ std::expected<Revision, std::string> Revision::Create(svn_fs_t* repositoryFs, lo
 		// valid!!!
 		if (change->copyfrom_known && change->copyfrom_path && change->copyfrom_rev != -1)
 		{
-			file.copiedFrom = {.path = change->copyfrom_path, .rev = change->copyfrom_rev};
+			file.copiedFrom = {
+				.path = apr_pstrdup(rev.mRevisionPool, change->copyfrom_path),
+				.rev = change->copyfrom_rev
+			};
 		}
 
 		if (file.copiedFrom.has_value() && file.isDirectory)
 		{
 			auto walk = WalkAllChildren(
-				revisionFs, path.c_str(), rev.mRevisionPool,
+				revisionFs, path.data(), rev.mRevisionPool,
 				[&](const char* subFilePath) -> std::expected<void, std::string>
 				{
-					auto maybeChild =
-						File::Create(revisionFs, subFilePath, false, File::Change::Add);
+					// subFilePath is already allocated in the revision pool
+					iterPool.clear();
+					auto maybeChild = File::Create(
+						revisionFs, subFilePath, false, File::Change::Add, iterPool
+					);
 					if (!maybeChild)
 					{
 						return std::unexpected(maybeChild.error());
@@ -217,7 +379,8 @@ std::expected<Revision, std::string> Revision::Create(svn_fs_t* repositoryFs, lo
 }
 
 std::expected<File, std::string> File::Create(
-	svn_fs_root_t* revisionFs, const std::string& path, bool isDirectory, Change changeType
+	svn_fs_root_t* revisionFs, std::string_view path, bool isDirectory, Change changeType,
+	apr_pool_t* scratchPool
 )
 {
 	File self;
@@ -226,7 +389,7 @@ std::expected<File, std::string> File::Create(
 	self.isDirectory = isDirectory;
 	self.changeType = changeType;
 	svn_error_t* err = nullptr;
-	svn::Pool pool;
+	apr_pool_t* pool = scratchPool;
 
 	if (self.changeType == Change::Delete)
 	{
@@ -234,7 +397,7 @@ std::expected<File, std::string> File::Create(
 	}
 
 	apr_hash_t* props = nullptr;
-	err = svn_fs_node_proplist(&props, revisionFs, path.c_str(), pool);
+	err = svn_fs_node_proplist(&props, revisionFs, path.data(), pool);
 	if (err)
 	{
 		return std::unexpected(FormatSvnError(err));
@@ -267,7 +430,7 @@ std::expected<File, std::string> File::Create(
 			else if (propName == SVN_PROP_EXTERNALS)
 			{
 				Log("WARNING: svn external {:?} in {} is not supported in git", propValue->data,
-					path.c_str());
+					path);
 				continue;
 			}
 		}
@@ -276,34 +439,50 @@ std::expected<File, std::string> File::Create(
 	if (!isDirectory)
 	{
 		svn_filesize_t fileSize = 0;
-		err = svn_fs_file_length(&fileSize, self.mRevisionFs, path.c_str(), pool);
+		err = svn_fs_file_length(&fileSize, self.mRevisionFs, path.data(), pool);
 		if (err)
 		{
 			return std::unexpected(FormatSvnError(err));
 		}
 		self.size = static_cast<size_t>(fileSize);
+
+		const svn_fs_id_t* nodeId = nullptr;
+		err = svn_fs_node_id(&nodeId, self.mRevisionFs, path.data(), pool);
+		if (err)
+		{
+			return std::unexpected(FormatSvnError(err));
+		}
+		const svn_string_t* unparsedId = svn_fs_unparse_id(nodeId, pool);
+		self.location = ParseLocation({unparsedId->data, unparsedId->len});
 	}
 
 	return self;
 }
 
-std::expected<std::unique_ptr<char[]>, std::string> File::GetContents() const
+std::expected<std::unique_ptr<char[]>, std::string>
+File::GetContents(svn_fs_root_t* revisionFs, apr_pool_t* scratchPool) const
 {
 	if (size == 0)
 	{
 		return nullptr;
 	}
+	if (mDumpSource)
+	{
+		auto contents = mDumpSource->ReadContents(mContentId, size);
+		CountContentBuffer(size);
+		return contents;
+	}
 	svn_error_t* err = nullptr;
-	svn::Pool pool;
 
 	svn_stream_t* contentStream = nullptr;
-	err = svn_fs_file_contents(&contentStream, mRevisionFs, path.c_str(), pool);
+	err = svn_fs_file_contents(&contentStream, revisionFs, path.data(), scratchPool);
 	if (err)
 	{
 		return std::unexpected(FormatSvnError(err));
 	}
 
 	std::unique_ptr<char[]> fileBuffer = std::make_unique<char[]>(size);
+	CountContentBuffer(size);
 
 	size_t readSize = size;
 	err = svn_stream_read_full(contentStream, fileBuffer.get(), &readSize);
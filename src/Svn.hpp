@@ -7,17 +7,46 @@
 #include <cstddef>
 #include <cstdint>
 #include <expected>
+#include <functional>
 #include <memory>
 #include <optional>
+#include <source_location>
 #include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace svn
 {
 
+class DumpSource;
 class Revision;
 
+/// Given a directory path ending with a '/', whether to walk into it
+using DirectoryFilter = std::function<bool(std::string_view directory)>;
+
+/// Consumes (clears) err and formats it with the location it was raised from.
+std::string
+FormatSvnError(svn_error_t* err, std::source_location loc = std::source_location::current());
+
+/// Size the cache libsvn keeps delta windows, fulltexts, properties and revision properties in.
+/// There is one cache for the whole process, shared by every filesystem opened afterwards on any
+/// thread, so the content reader threads and --batch conversions warm it for each other. Call it
+/// once, before opening any repository.
+void ConfigureCache(size_t bytes);
+
+/// The cache size for --batch on this machine when none is given: a share of its physical memory.
+size_t DefaultCacheSize();
+
+/// The size set by ConfigureCache, or libsvn's default.
+size_t GetCacheSize();
+
+/// Open the filesystem of an on-disk repository, configured for reading history front to back:
+/// FSFS reads whole blocks at a time, and caches delta windows, fulltexts and revision properties
+/// so the delta chains consecutive revisions share are only reconstructed once. It stays open as
+/// long as `pool`.
+std::expected<svn_fs_t*, std::string> OpenFilesystem(const std::string& path, apr_pool_t* pool);
+
 class Pool
 {
 	apr_pool_t* ptr = nullptr;
@@ -27,6 +56,10 @@ public:
 		ptr(svn_pool_create(nullptr))
 	{
 	}
+	explicit Pool(apr_pool_t* parent) :
+		ptr(svn_pool_create(parent))
+	{
+	}
 	~Pool()
 	{
 		if (ptr)
@@ -74,28 +107,57 @@ struct File
 
 	struct CopyFrom
 	{
-		std::string path;
+		std::string_view path;
 		long int rev;
 	};
 
-	static std::expected<File, std::string>
-	Create(svn_fs_root_t* revisionFs, const std::string& path, bool isDirectory, Change changeType);
+	/// Where the node revision is stored in the repository, parsed from the FSFS node id
+	/// (r<rev>/<offset>). With logical addressing the offset is an item index rather than a byte
+	/// offset, but both increase through a revision/pack file. Unknown locations compare first.
+	struct Location
+	{
+		long int rev = 0;
+		std::uint64_t offset = 0;
+		auto operator<=>(const Location&) const = default;
+	};
+
+	/// `path` must be NUL terminated and outlive the File, normally it is allocated in the owning
+	/// revision's pool. Temporary allocations are made in, but not cleared from, `scratchPool`.
+	static std::expected<File, std::string> Create(
+		svn_fs_root_t* revisionFs, std::string_view path, bool isDirectory, Change changeType,
+		apr_pool_t* scratchPool
+	);
+
+	std::expected<std::unique_ptr<char[]>, std::string> GetContents(apr_pool_t* scratchPool) const
+	{
+		return GetContents(mRevisionFs, scratchPool);
+	}
 
-	std::expected<std::unique_ptr<char[]>, std::string> GetContents() const;
+	/// Read the contents through a different root of the same revision, e.g. one opened by a
+	/// reader thread with its own svn_fs_t.
+	std::expected<std::unique_ptr<char[]>, std::string>
+	GetContents(svn_fs_root_t* revisionFs, apr_pool_t* scratchPool) const;
 
-	std::string path;
+	/// View into the owning revision's pool, always NUL terminated.
+	std::string_view path;
 	bool isDirectory = false;
 	bool isExecutable = false;
 	bool isSymlink = false;
 	bool isBinary = false;
 	Change changeType = Change::Add;
 	size_t size = 0;
+	Location location;
 	std::optional<CopyFrom> copiedFrom;
 
 	svn_fs_root_t* mRevisionFs = nullptr;
+	/// Set instead of mRevisionFs for files parsed from a dump stream.
+	const DumpSource* mDumpSource = nullptr;
+	std::uint64_t mContentId = 0;
 
 private:
 	File() = default;
+
+	friend class DumpSource;
 };
 
 class Repository
@@ -105,11 +167,15 @@ public:
 	std::expected<long int, std::string> GetYoungestRevision();
 	std::expected<Revision, std::string> GetRevision(long int revision);
 
+	/// Every file in the tree at `revision` as an added file, leaving out the directories
+	/// `descend` rejects. Its log names the revision, the other properties are the revision's.
+	std::expected<Revision, std::string>
+	GetSnapshot(long int revision, const DirectoryFilter& descend);
+
 private:
 	Repository() = default;
 
 	Pool mRepositoryPool;
-	svn_repos_t* mRepos = nullptr;
 	svn_fs_t* mFs = nullptr;
 };
 
@@ -121,6 +187,8 @@ public:
 	const std::string& GetDate() const { return mDate; }
 	long int GetNumber() const { return mRevNum; }
 	std::span<const File> GetFiles() const { return mFiles; }
+	/// Holds the whole tree rather than the changes, see Repository::GetSnapshot
+	bool IsSnapshot() const { return mSnapshot; }
 
 private:
 	explicit Revision(long int revision) :
@@ -129,8 +197,13 @@ private:
 	}
 
 	static std::expected<Revision, std::string> Create(svn_fs_t* repositoryFs, long int revision);
+	static std::expected<Revision, std::string>
+	CreateSnapshot(svn_fs_t* repositoryFs, long int revision, const DirectoryFilter& descend);
+
+	std::expected<void, std::string> ReadProperties(svn_fs_t* repositoryFs);
 
 	long int mRevNum;
+	bool mSnapshot = false;
 	std::string mAuthor;
 	std::string mLog;
 	std::string mDate;
@@ -138,6 +211,7 @@ private:
 
 	svn::Pool mRevisionPool;
 
+	friend class DumpSource;
 	friend class Repository;
 };
 
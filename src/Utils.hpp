@@ -1,10 +1,32 @@
+#pragma once
 #include <fmt/base.h>
+#include <fmt/format.h>
 #include <fmt/ostream.h>
 
+#include <cstddef>
+#include <functional>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/// Put in front of every line this thread logs, so conversions running side by side in --batch
+/// can be told apart.
+inline thread_local std::string tLogPrefix;
 
 template <typename... T>
 inline void Log(fmt::format_string<T...> fmt, T&&... args)
 {
-	fmt::println(std::cerr, fmt, std::forward<T>(args)...);
+	fmt::println(std::cerr, "{}{}", tLogPrefix, fmt::format(fmt, std::forward<T>(args)...));
 }
+
+/// Transparent hash so string keyed containers can be queried with a std::string_view without
+/// constructing a temporary std::string.
+struct StringHash
+{
+	using is_transparent = void;
+	size_t operator()(std::string_view value) const
+	{
+		return std::hash<std::string_view>{}(value);
+	}
+};
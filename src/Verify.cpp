@@ -0,0 +1,444 @@
+#include "Config.hpp"
+#include "Git.hpp"
+#include "Marks.hpp"
+#include "Reader.hpp"
+#include "Svn.hpp"
+#include "Utils.hpp"
+#include "Verify.hpp"
+#include "Writer.hpp"
+
+#include <apr_hash.h>
+#include <fmt/format.h>
+#include <git2.h>
+#include <re2/re2.h>
+#include <svn_checksum.h>
+#include <svn_error.h>
+#include <svn_fs.h>
+
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <expected>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+static constexpr std::string_view kLFSPointerPrefix =
+	"version https://git-lfs.github.com/spec/v1\n";
+
+namespace
+{
+
+struct Commit
+{
+	long int revision = 0;
+	std::string branch;
+	std::string id;
+};
+
+struct GitEntry
+{
+	git_filemode_t mode = GIT_FILEMODE_UNREADABLE;
+	git_oid id{};
+};
+
+struct ExpectedFile
+{
+	std::string svnPath;
+	bool lfs = false;
+};
+
+using ReportFn = std::function<void(std::string_view path, std::string_view problem)>;
+
+std::string GitErrorMessage()
+{
+	const git_error* error = git_error_last();
+	return error ? error->message : "unknown libgit2 error";
+}
+
+std::expected<void, std::string> ReadGitTree(
+	git_repository* repository, const std::string& commitId,
+	std::map<std::string, GitEntry>& entries
+)
+{
+	git_oid oid{};
+	git_commit* commit = nullptr;
+	if (git_oid_fromstr(&oid, commitId.c_str()) != 0 ||
+		git_commit_lookup(&commit, repository, &oid) != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not read commit {}: {}", commitId, GitErrorMessage())
+		);
+	}
+
+	git_tree* tree = nullptr;
+	const int treeError = git_commit_tree(&tree, commit);
+	git_commit_free(commit);
+	if (treeError != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not read commit {}: {}", commitId, GitErrorMessage())
+		);
+	}
+
+	auto collect = +[](const char* root, const git_tree_entry* entry, void* payload) -> int
+	{
+		if (git_tree_entry_type(entry) == GIT_OBJECT_BLOB)
+		{
+			auto& collected = *static_cast<std::map<std::string, GitEntry>*>(payload);
+			collected.emplace(
+				fmt::format("{}{}", root, git_tree_entry_name(entry)),
+				GitEntry{git_tree_entry_filemode(entry), *git_tree_entry_id(entry)}
+			);
+		}
+		return 0;
+	};
+	const int walkError = git_tree_walk(tree, GIT_TREEWALK_PRE, collect, &entries);
+	git_tree_free(tree);
+	if (walkError != 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not read commit {}: {}", commitId, GitErrorMessage())
+		);
+	}
+	return {};
+}
+
+// What is wrong with the git contents of one file, if anything
+std::expected<std::optional<std::string>, std::string> CompareContents(
+	svn_fs_root_t* root, const svn::File& file, bool expectLFS, std::string_view gitContents,
+	apr_pool_t* pool
+)
+{
+	size_t svnSize = file.size;
+	std::string symlinkTarget;
+	if (file.isSymlink)
+	{
+		// svn symlinks are in the format "link path/to/target", git only stores the target
+		auto contents = file.GetContents(pool);
+		if (!contents)
+		{
+			return std::unexpected(contents.error());
+		}
+		symlinkTarget.assign(contents->get(), file.size);
+		if (symlinkTarget.starts_with("link "))
+		{
+			symlinkTarget.erase(0, 5);
+		}
+		svnSize = symlinkTarget.size();
+	}
+
+	// The oid is a SHA-256, which svn doesn't store, so pointers are only checked by size
+	if (gitContents.starts_with(kLFSPointerPrefix))
+	{
+		static const RE2 kSizeRe(R"(\nsize (\d+)\n)");
+		size_t pointerSize = 0;
+		if (!RE2::PartialMatch(gitContents, kSizeRe, &pointerSize))
+		{
+			return "invalid LFS pointer";
+		}
+		if (pointerSize != svnSize)
+		{
+			return fmt::format("LFS pointer is for {} bytes, svn has {}", pointerSize, svnSize);
+		}
+		return std::nullopt;
+	}
+	if (expectLFS)
+	{
+		return "not an LFS pointer";
+	}
+
+	if (gitContents.size() != svnSize)
+	{
+		return fmt::format("{} bytes, svn has {}", gitContents.size(), svnSize);
+	}
+	if (file.isSymlink)
+	{
+		if (gitContents != symlinkTarget)
+		{
+			return fmt::format("symlink to {:?}, svn has {:?}", gitContents, symlinkTarget);
+		}
+		return std::nullopt;
+	}
+
+	// svn stores a SHA-1 of every file (and an MD5 in older repositories), so only git is read
+	for (const svn_checksum_kind_t kind : {svn_checksum_sha1, svn_checksum_md5})
+	{
+		svn_checksum_t* stored = nullptr;
+		svn_error_t* err =
+			svn_fs_file_checksum(&stored, kind, root, file.path.data(), false, pool);
+		if (err)
+		{
+			return std::unexpected(svn::FormatSvnError(err));
+		}
+		if (!stored)
+		{
+			continue;
+		}
+
+		svn_checksum_t* actual = nullptr;
+		err = svn_checksum(&actual, kind, gitContents.data(), gitContents.size(), pool);
+		if (err)
+		{
+			return std::unexpected(svn::FormatSvnError(err));
+		}
+		if (!svn_checksum_match(stored, actual))
+		{
+			return "contents differ";
+		}
+		return std::nullopt;
+	}
+	return std::nullopt;
+}
+
+struct Worker
+{
+	explicit Worker(const Config& config) :
+		mapper(config, std::vector<Git::Target>{})
+	{
+	}
+	~Worker() { git_repository_free(repository); }
+
+	Worker(const Worker&) = delete;
+	Worker& operator=(const Worker&) = delete;
+
+	svn::Pool pool;
+	svn_fs_t* fs = nullptr;
+	/// Opened by the worker's thread on first use
+	git_repository* repository = nullptr;
+	/// Only used for MapPath, which needs its own scratch space per thread
+	Git mapper;
+};
+
+// Returns the number of files checked
+std::expected<size_t, std::string> VerifyCommit(
+	Worker& worker, size_t repository, const Commit& commit, const ReportFn& report,
+	apr_pool_t* pool
+)
+{
+	svn_fs_root_t* root = nullptr;
+	svn_error_t* err = svn_fs_revision_root(&root, worker.fs, commit.revision, pool);
+	if (err)
+	{
+		return std::unexpected(svn::FormatSvnError(err));
+	}
+
+	// Every file the rules put on the commit's branch, by git path
+	std::map<std::string, ExpectedFile> expected;
+	std::pmr::monotonic_buffer_resource arena;
+	std::function<std::expected<void, std::string>(const std::string&)> walk =
+		[&](const std::string& directory) -> std::expected<void, std::string>
+	{
+		const std::string fsPath =
+			directory.size() > 1 ? directory.substr(0, directory.size() - 1) : directory;
+		apr_hash_t* entries = nullptr;
+		svn_error_t* listError = svn_fs_dir_entries(&entries, root, fsPath.c_str(), pool);
+		if (listError)
+		{
+			return std::unexpected(svn::FormatSvnError(listError));
+		}
+
+		for (apr_hash_index_t* hi = apr_hash_first(pool, entries); hi; hi = apr_hash_next(hi))
+		{
+			const void* key = nullptr;
+			void* value = nullptr;
+			apr_hash_this(hi, &key, nullptr, &value);
+			const auto* dirent = static_cast<svn_fs_dirent_t*>(value);
+			std::string path = directory + static_cast<const char*>(key);
+
+			if (dirent->kind == svn_node_dir)
+			{
+				path.push_back('/');
+				if (worker.mapper.CouldMapBelow(path))
+				{
+					if (auto walked = walk(path); !walked)
+					{
+						return walked;
+					}
+				}
+				continue;
+			}
+
+			const auto mapping = worker.mapper.MapPath(commit.revision, path, &arena);
+			if (mapping && !mapping->skip && mapping->repository == repository &&
+				mapping->branch == commit.branch)
+			{
+				expected.emplace(
+					std::string(mapping->path), ExpectedFile{std::move(path), mapping->lfs}
+				);
+			}
+		}
+		return {};
+	};
+	if (auto walked = walk("/"); !walked)
+	{
+		return std::unexpected(walked.error());
+	}
+
+	std::map<std::string, GitEntry> entries;
+	auto read = ReadGitTree(worker.repository, commit.id, entries);
+	if (!read)
+	{
+		return std::unexpected(read.error());
+	}
+
+	svn::Pool scratch(pool);
+	for (const auto& [gitPath, svnFile] : expected)
+	{
+		const auto found = entries.find(gitPath);
+		if (found == entries.end())
+		{
+			report(gitPath, fmt::format("missing, svn has {:?}", svnFile.svnPath));
+			continue;
+		}
+		const GitEntry entry = found->second;
+		entries.erase(found);
+
+		scratch.clear();
+		auto file =
+			svn::File::Create(root, svnFile.svnPath, false, svn::File::Change::Add, scratch);
+		if (!file)
+		{
+			return std::unexpected(file.error());
+		}
+
+		git_filemode_t mode = GIT_FILEMODE_BLOB;
+		if (file->isSymlink)
+		{
+			mode = GIT_FILEMODE_LINK;
+		}
+		else if (file->isExecutable)
+		{
+			mode = GIT_FILEMODE_BLOB_EXECUTABLE;
+		}
+		if (entry.mode != mode)
+		{
+			report(
+				gitPath, fmt::format("mode {:o}, expected {:o}", static_cast<int>(entry.mode),
+									 static_cast<int>(mode))
+			);
+		}
+
+		git_blob* blob = nullptr;
+		if (git_blob_lookup(&blob, worker.repository, &entry.id) != 0)
+		{
+			return std::unexpected(
+				fmt::format("Could not read {:?} from git: {}", gitPath, GitErrorMessage())
+			);
+		}
+		const std::string_view gitContents(
+			static_cast<const char*>(git_blob_rawcontent(blob)),
+			static_cast<size_t>(git_blob_rawsize(blob))
+		);
+		auto problem = CompareContents(root, *file, svnFile.lfs, gitContents, scratch);
+		git_blob_free(blob);
+		if (!problem)
+		{
+			return std::unexpected(problem.error());
+		}
+		if (*problem)
+		{
+			report(gitPath, **problem);
+		}
+	}
+
+	for (const auto& [gitPath, entry] : entries)
+	{
+		// Written by the conversion itself, for LFS
+		if (gitPath != ".gitattributes")
+		{
+			report(gitPath, "not in svn");
+		}
+	}
+	return expected.size();
+}
+
+} // namespace
+
+std::expected<VerifyResult, std::string> VerifyConversion(
+	const Config& config, size_t repository, const std::filesystem::path& gitRoot,
+	const MarkIndex& marks, long int first, long int last, std::optional<size_t> sample,
+	unsigned int threads
+)
+{
+	auto branches = GetRevisionBranches(gitRoot);
+	if (!branches)
+	{
+		return std::unexpected(branches.error());
+	}
+
+	// Only revisions that wrote a single commit have a mark
+	std::vector<Commit> commits;
+	for (long int revision = first; revision <= last; ++revision)
+	{
+		const auto branch = branches->find(revision);
+		if (branch == branches->end() || branch->second.empty())
+		{
+			continue;
+		}
+		auto id = marks.Lookup(revision);
+		if (id)
+		{
+			commits.push_back({revision, branch->second, std::move(*id)});
+		}
+	}
+
+	if (sample && *sample < commits.size())
+	{
+		std::vector<Commit> sampled;
+		for (size_t i = 0; i < *sample; ++i)
+		{
+			sampled.push_back(std::move(commits[i * commits.size() / *sample]));
+		}
+		commits = std::move(sampled);
+	}
+
+	std::atomic<size_t> files = 0;
+	std::atomic<size_t> mismatches = 0;
+	std::mutex reportMutex;
+	auto workers = svn::RunInParallel(
+		config.svnRepo, commits.size(), threads, "Verifying",
+		[&] { return std::make_unique<Worker>(config); },
+		[&](Worker& worker, size_t i, svn::Pool& scratch) -> std::expected<void, std::string>
+		{
+			if (!worker.repository &&
+				git_repository_open(&worker.repository, gitRoot.c_str()) != 0)
+			{
+				return std::unexpected(
+					fmt::format("Could not open {:?}: {}", gitRoot.c_str(), GitErrorMessage())
+				);
+			}
+
+			const Commit& commit = commits[i];
+			auto report = [&](std::string_view path, std::string_view problem)
+			{
+				mismatches++;
+				std::lock_guard lock(reportMutex);
+				Log("MISMATCH r{} {}:{}: {}", commit.revision, commit.branch, path, problem);
+			};
+			auto checked = VerifyCommit(worker, repository, commit, report, scratch);
+			if (!checked)
+			{
+				return std::unexpected(
+					fmt::format("Verifying r{}: {}", commit.revision, checked.error())
+				);
+			}
+			files += *checked;
+			return {};
+		}
+	);
+	if (!workers)
+	{
+		return std::unexpected(workers.error());
+	}
+	return VerifyResult{.revisions = commits.size(), .files = files, .mismatches = mismatches};
+}
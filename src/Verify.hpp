@@ -0,0 +1,31 @@
+#pragma once
+#include "Config.hpp"
+#include "Marks.hpp"
+
+#include <cstddef>
+#include <expected>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+struct VerifyResult
+{
+	size_t revisions = 0;
+	size_t files = 0;
+	size_t mismatches = 0;
+};
+
+/// Checks the commits written to one of config.gitRepos for revisions `first` to `last` against
+/// svn, on `threads` threads. With a `sample`, only that many revisions, spread evenly over the
+/// range, are checked.
+///
+/// Each revision's commit is found through the mark index and its branch through the branch
+/// index. Every file the rules map to that branch at that revision must be in the commit with the
+/// same mode, size and contents, and nothing else may be. Contents are checked against the
+/// checksums svn already stores and LFS pointers by size, so svn file contents are never read
+/// (symlinks aside). Each mismatch is logged.
+std::expected<VerifyResult, std::string> VerifyConversion(
+	const Config& config, size_t repository, const std::filesystem::path& gitRoot,
+	const MarkIndex& marks, long int first, long int last, std::optional<size_t> sample,
+	unsigned int threads
+);
@@ -0,0 +1,83 @@
+#include "Watch.hpp"
+
+#include <fmt/format.h>
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <expected>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+namespace svn
+{
+
+std::expected<RevisionWatcher, std::string>
+RevisionWatcher::Open(const std::filesystem::path& repositoryPath)
+{
+	RevisionWatcher watcher;
+#ifdef __linux__
+	watcher.mFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (watcher.mFd < 0)
+	{
+		return std::unexpected(
+			fmt::format("Could not start inotify: {}", std::system_category().message(errno))
+		);
+	}
+
+	// db/current is written to a temporary file then renamed over, so watch the directory
+	const std::filesystem::path db = repositoryPath / "db";
+	if (inotify_add_watch(watcher.mFd, db.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE) < 0)
+	{
+		return std::unexpected(
+			fmt::format(
+				"Could not watch {:?}: {}", db.c_str(), std::system_category().message(errno)
+			)
+		);
+	}
+#else
+	(void)repositoryPath;
+#endif
+	return watcher;
+}
+
+RevisionWatcher::~RevisionWatcher()
+{
+	if (mFd >= 0)
+	{
+		close(mFd);
+	}
+}
+
+RevisionWatcher::RevisionWatcher(RevisionWatcher&& other) noexcept :
+	mFd(std::exchange(other.mFd, -1))
+{
+}
+
+void RevisionWatcher::Wait(std::chrono::milliseconds timeout)
+{
+#ifdef __linux__
+	pollfd watch{.fd = mFd, .events = POLLIN, .revents = 0};
+	if (poll(&watch, 1, static_cast<int>(timeout.count())) > 0)
+	{
+		// Only the wake up matters, not which files changed
+		std::array<char, 4096> events{};
+		while (read(mFd, events.data(), events.size()) > 0)
+		{
+		}
+	}
+#else
+	std::this_thread::sleep_for(timeout);
+#endif
+}
+
+} // namespace svn
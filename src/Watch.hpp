@@ -0,0 +1,36 @@
+#pragma once
+#include <chrono>
+#include <expected>
+#include <filesystem>
+#include <string>
+
+namespace svn
+{
+
+/// Wakes up when new revisions may have been committed to an on-disk repository. FSFS replaces
+/// db/current on every commit, so on Linux the db directory is watched with inotify. Elsewhere
+/// Wait() just sleeps, and the caller polls.
+class RevisionWatcher
+{
+public:
+	static std::expected<RevisionWatcher, std::string>
+	Open(const std::filesystem::path& repositoryPath);
+
+	~RevisionWatcher();
+
+	RevisionWatcher(const RevisionWatcher&) = delete;
+	RevisionWatcher& operator=(const RevisionWatcher&) = delete;
+	RevisionWatcher(RevisionWatcher&& other) noexcept;
+	RevisionWatcher& operator=(RevisionWatcher&& other) = delete;
+
+	/// Blocks until the repository changes, a signal arrives, or `timeout` passes. Spurious
+	/// wake ups are possible, so check the youngest revision after each call.
+	void Wait(std::chrono::milliseconds timeout);
+
+private:
+	RevisionWatcher() = default;
+
+	int mFd = -1;
+};
+
+} // namespace svn
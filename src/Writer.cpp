@@ -1,3 +1,4 @@
+#include "Lfs.hpp"
 #include "Utils.hpp"
 #include "Writer.hpp"
 
@@ -5,20 +6,31 @@
 #include <fmt/ranges.h>
 #include <git2.h>
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <expected>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <system_error>
 #include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 void IFastImport::BeginCommit(BeginCommitArgInfo args)
 {
-	std::string command = fmt::format(
+	// fmt::memory_buffer keeps small commands on the stack
+	fmt::memory_buffer command;
+	fmt::format_to(
+		std::back_inserter(command),
 		"commit refs/heads/{}\n"
 		"{}"
 		"original-oid r{}\n"
@@ -29,17 +41,23 @@ void IFastImport::BeginCommit(BeginCommitArgInfo args)
 		args.branch, args.mark, args.revision, args.committer, args.time, args.message.length(),
 		args.message, args.from
 	);
-	Write(command);
+	Write({command.data(), command.size()});
 }
 
 void IFastImport::Delete(const std::string_view path)
 {
-	Write(fmt::format("D {}\n", path));
+	fmt::memory_buffer command;
+	fmt::format_to(std::back_inserter(command), "D {}\n", path);
+	Write({command.data(), command.size()});
 }
 
 void IFastImport::Modify(int mode, const std::string_view path, const std::string_view data)
 {
-	Write(fmt::format("M {} inline {}\ndata {}\n", mode, path, data.size()));
+	fmt::memory_buffer header;
+	fmt::format_to(
+		std::back_inserter(header), "M {} inline {}\ndata {}\n", mode, path, data.size()
+	);
+	Write({header.data(), header.size()});
 	Write(data);
 }
 
@@ -48,6 +66,27 @@ void IFastImport::Done()
 	Write("done\n");
 }
 
+void IFastImport::Reset(std::string_view ref, std::string_view from)
+{
+	fmt::memory_buffer command;
+	fmt::format_to(std::back_inserter(command), "reset {}\nfrom {}\n\n", ref, from);
+	Write({command.data(), command.size()});
+}
+
+void IFastImport::WriteCommands(std::string_view commands)
+{
+	Write(commands);
+}
+
+std::expected<void, std::string> IFastImport::RecordBranchCommit(
+	long int revision, std::string_view branch, size_t files, size_t bytes
+)
+{
+	fmt::memory_buffer line;
+	fmt::format_to(std::back_inserter(line), "{} {} {} {}\n", revision, branch, files, bytes);
+	return AppendToGitDirectory(kBranchIndexPath, {line.data(), line.size()});
+}
+
 void FastImportProcess::WriteToGitDirectory(std::filesystem::path path, const std::string_view data)
 {
 	std::filesystem::path writePath = mRoot / path;
@@ -59,6 +98,118 @@ void FastImportProcess::WriteToGitDirectory(std::filesystem::path path, const st
 	}
 }
 
+std::expected<void, std::string>
+FastImportProcess::AppendToGitDirectory(std::filesystem::path path, const std::string_view data)
+{
+	// Commits are only in the repository once fast-import has written them out, which could
+	// still fail. Spools replay their branch index lines through here too.
+	if (path == kBranchIndexPath)
+	{
+		mUnconfirmedBranchIndex.append(data);
+		return {};
+	}
+	return AppendToFile(path, data);
+}
+
+std::expected<void, std::string> FastImportProcess::WriteBranchIndex()
+{
+	if (mUnconfirmedBranchIndex.empty())
+	{
+		return {};
+	}
+	auto appended = AppendToFile(kBranchIndexPath, mUnconfirmedBranchIndex);
+	if (appended && !mAppendedFiles.at(kBranchIndexPath).flush().good())
+	{
+		appended = std::unexpected(
+			fmt::format("Could not append to {:?}", (mRoot / kBranchIndexPath).c_str())
+		);
+	}
+	mUnconfirmedBranchIndex.clear();
+	return appended;
+}
+
+std::expected<void, std::string>
+FastImportProcess::AppendToFile(const std::filesystem::path& path, const std::string_view data)
+{
+	auto appended = mAppendedFiles.find(path);
+	if (appended == mAppendedFiles.end())
+	{
+		appended = mAppendedFiles.emplace(path, std::ofstream{}).first;
+		appended->second.open(mRoot / path, std::ios::app | std::ios::binary);
+	}
+
+	std::ofstream& file = appended->second;
+	file.write(data.data(), static_cast<std::streamsize>(data.size()));
+	if (!file.good())
+	{
+		return std::unexpected(fmt::format("Could not append to {:?}", (mRoot / path).c_str()));
+	}
+	return {};
+}
+
+std::expected<void, std::string>
+FastImportProcess::WriteLFSObject(std::string_view oid, const std::string_view data)
+{
+	if (mStoredObjects.contains(std::string(oid)))
+	{
+		return {};
+	}
+
+	// Only remembered once the object is in the store, so a failed write is tried again the
+	// next time the object comes up
+	const std::filesystem::path objectPath = LFSObjectPath(oid);
+	const std::filesystem::path repositoryPath = mRoot / objectPath;
+	std::error_code error;
+	if (std::filesystem::exists(repositoryPath, error))
+	{
+		mStoredObjects.emplace(oid);
+		return {};
+	}
+	if (error)
+	{
+		return std::unexpected(
+			fmt::format("Could not check {:?}: {}", repositoryPath.c_str(), error.message())
+		);
+	}
+
+	if (!mSharedLFSStore)
+	{
+		auto written = WriteFileAtomically(repositoryPath, data);
+		if (!written)
+		{
+			return written;
+		}
+		mStoredObjects.emplace(oid);
+		return {};
+	}
+
+	// The shared store is the index of every object any conversion has written
+	const std::filesystem::path sharedPath = *mSharedLFSStore / objectPath;
+	const bool shared = std::filesystem::exists(sharedPath, error);
+	if (error)
+	{
+		return std::unexpected(
+			fmt::format("Could not check {:?}: {}", sharedPath.c_str(), error.message())
+		);
+	}
+	if (!shared)
+	{
+		auto written = WriteFileAtomically(sharedPath, data);
+		if (!written)
+		{
+			return written;
+		}
+	}
+
+	auto linked = LinkLFSObject(sharedPath, repositoryPath);
+	if (!linked)
+	{
+		return linked;
+	}
+	mStoredObjects.emplace(oid);
+	return {};
+}
+
 void FastImportProcess::Write(std::string_view content)
 {
 	size_t written = std::fwrite(content.data(), 1, content.size(), mInput);
@@ -68,15 +219,16 @@ void FastImportProcess::Write(std::string_view content)
 	}
 }
 
-void FastImportProcess::SaveLastWrittenRevision(long int rev)
+void SaveLastWrittenRevision(const std::filesystem::path& gitRoot, long int rev)
 {
-	std::ofstream file{mRoot / "svn_lfs_export_revision"};
+	std::ofstream file{gitRoot / "svn_lfs_export_revision"};
 	file << rev << '\n';
 }
 
-std::expected<std::optional<long int>, std::string> FastImportProcess::GetLastWrittenRevision()
+std::expected<std::optional<long int>, std::string>
+GetLastWrittenRevision(const std::filesystem::path& gitRoot)
 {
-	std::filesystem::path path = mRoot / "svn_lfs_export_revision";
+	std::filesystem::path path = gitRoot / "svn_lfs_export_revision";
 	if (!std::filesystem::exists(path))
 	{
 		return std::nullopt;
@@ -94,9 +246,152 @@ std::expected<std::optional<long int>, std::string> FastImportProcess::GetLastWr
 	return rev;
 }
 
-bool FastImportProcess::Flush()
+std::expected<std::vector<long int>, std::string>
+GetBranchRevisions(const std::filesystem::path& gitRoot, std::span<const std::string> branches)
+{
+	std::filesystem::path path = gitRoot / kBranchIndexPath;
+	if (!std::filesystem::exists(path))
+	{
+		return std::unexpected(
+			fmt::format(
+				"No branch index {:?}, the repository must be converted again first", path.c_str()
+			)
+		);
+	}
+
+	std::vector<long int> revisions;
+	std::ifstream file{path};
+	long int revision = 0;
+	std::string branch;
+	std::string rest;
+	while (file >> revision >> branch && std::getline(file, rest))
+	{
+		if (std::ranges::contains(branches, branch))
+		{
+			revisions.push_back(revision);
+		}
+	}
+	if (!file.eof())
+	{
+		return std::unexpected(fmt::format("Branch index {:?} could not be parsed", path.c_str()));
+	}
+
+	// Re-exports append to the index, so a revision can be listed more than once
+	std::ranges::sort(revisions);
+	const auto duplicates = std::ranges::unique(revisions);
+	revisions.erase(duplicates.begin(), duplicates.end());
+	return revisions;
+}
+
+std::expected<std::unordered_map<long int, std::string>, std::string>
+GetRevisionBranches(const std::filesystem::path& gitRoot)
+{
+	std::filesystem::path path = gitRoot / kBranchIndexPath;
+	if (!std::filesystem::exists(path))
+	{
+		return std::unexpected(
+			fmt::format(
+				"No branch index {:?}, the repository must be converted again first", path.c_str()
+			)
+		);
+	}
+
+	std::unordered_map<long int, std::string> branches;
+	std::ifstream file{path};
+	long int revision = 0;
+	std::string branch;
+	std::string rest;
+	while (file >> revision >> branch && std::getline(file, rest))
+	{
+		auto [existing, inserted] = branches.try_emplace(revision, branch);
+		if (!inserted && existing->second != branch)
+		{
+			existing->second.clear();
+		}
+	}
+	if (!file.eof())
+	{
+		return std::unexpected(fmt::format("Branch index {:?} could not be parsed", path.c_str()));
+	}
+	return branches;
+}
+
+std::expected<std::vector<std::string>, std::string>
+GetRecentBranchCommits(const std::filesystem::path& gitRoot, size_t maxBytes)
+{
+	std::filesystem::path path = gitRoot / kBranchIndexPath;
+	if (!std::filesystem::exists(path))
+	{
+		return {};
+	}
+
+	std::ifstream file{path};
+	const auto size = static_cast<size_t>(std::filesystem::file_size(path));
+	if (size > maxBytes)
+	{
+		// Start at the first whole line
+		file.seekg(static_cast<std::streamoff>(size - maxBytes));
+		std::string partial;
+		std::getline(file, partial);
+	}
+
+	std::vector<std::string> branches;
+	long int revision = 0;
+	std::string branch;
+	std::string rest;
+	while (file >> revision >> branch && std::getline(file, rest))
+	{
+		branches.push_back(branch);
+	}
+	if (!file.eof())
+	{
+		return std::unexpected(fmt::format("Branch index {:?} could not be parsed", path.c_str()));
+	}
+	return branches;
+}
+
+std::expected<void, std::string> FastImportProcess::Flush()
+{
+	for (auto& [path, file] : mAppendedFiles)
+	{
+		if (!file.flush().good())
+		{
+			return std::unexpected(
+				fmt::format("Could not append to {:?}", (mRoot / path).c_str())
+			);
+		}
+	}
+	if (std::fflush(mInput) != 0 || std::ferror(mInput) != 0)
+	{
+		return std::unexpected("git fast-import pipe broke (process died?)");
+	}
+	return {};
+}
+
+bool FastImportProcess::Checkpoint()
 {
-	return std::fflush(mInput) == 0 && std::ferror(mInput) == 0;
+	// fast-import prints progress commands once everything before them has been processed
+	const std::string marker = fmt::format("progress svn-lfs-export checkpoint {}", ++mCheckpoints);
+	Write(fmt::format("checkpoint\n{}\n", marker));
+	if (!Flush())
+	{
+		return false;
+	}
+
+	std::array<char, 256> line{};
+	while (std::fgets(line.data(), static_cast<int>(line.size()), mOutput))
+	{
+		std::string_view received(line.data());
+		if (received.ends_with('\n'))
+		{
+			received.remove_suffix(1);
+		}
+		if (received == marker)
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 void FastImportBuffer::WriteToGitDirectory(std::filesystem::path, const std::string_view)
@@ -104,6 +399,20 @@ void FastImportBuffer::WriteToGitDirectory(std::filesystem::path, const std::str
 	// no op
 }
 
+std::expected<void, std::string>
+FastImportBuffer::AppendToGitDirectory(std::filesystem::path, const std::string_view)
+{
+	// no op
+	return {};
+}
+
+std::expected<void, std::string>
+FastImportBuffer::WriteLFSObject(std::string_view, const std::string_view)
+{
+	// no op
+	return {};
+}
+
 void FastImportBuffer::Write(std::string_view content)
 {
 	mBuffer.append(content);
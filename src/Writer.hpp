@@ -1,11 +1,22 @@
 #pragma once
+#include <cstddef>
 #include <cstdio>
 #include <expected>
 #include <filesystem>
+#include <fstream>
+#include <map>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
+
+/// Every commit written, one "<revision> <branch> <files> <bytes>" line each, relative to the git
+/// directory. Used to re-export single branches without visiting every revision.
+static constexpr std::string_view kBranchIndexPath = "svn_lfs_export_branches";
 
 struct BeginCommitArgInfo
 {
@@ -27,7 +38,20 @@ public:
 	void Delete(const std::string_view path);
 	void Modify(int mode, const std::string_view path, const std::string_view data);
 	void Done();
+	/// Point `ref` at `from`, creating it if needed, without writing a commit.
+	void Reset(std::string_view ref, std::string_view from);
+	/// Pass through commands that are already formatted, e.g. read back from a spool.
+	void WriteCommands(std::string_view commands);
+	/// Add a commit that was just written to the branch index. FastImportProcess holds it back
+	/// until WriteBranchIndex().
+	std::expected<void, std::string>
+	RecordBranchCommit(long int revision, std::string_view branch, size_t files, size_t bytes);
 	virtual void WriteToGitDirectory(std::filesystem::path path, const std::string_view data) = 0;
+	virtual std::expected<void, std::string>
+	AppendToGitDirectory(std::filesystem::path path, const std::string_view data) = 0;
+	/// Store an LFS object, failing if it couldn't be written, since its pointer is in a commit.
+	virtual std::expected<void, std::string>
+	WriteLFSObject(std::string_view oid, const std::string_view data) = 0;
 
 protected:
 	virtual void Write(std::string_view content) = 0;
@@ -36,31 +60,85 @@ protected:
 class FastImportProcess : public IFastImport
 {
 public:
-	FastImportProcess(FILE* input, std::filesystem::path root) :
+	/// With a `sharedLFSStore`, LFS objects are written there once and linked into each
+	/// repository, instead of being stored separately by every repository.
+	/// `output` is fast-import's stdout, read only by Checkpoint().
+	FastImportProcess(
+		FILE* input, FILE* output, std::filesystem::path root,
+		std::optional<std::filesystem::path> sharedLFSStore = std::nullopt
+	) :
 		mInput(input),
-		mRoot(std::move(root)) {};
+		mOutput(output),
+		mRoot(std::move(root)),
+		mSharedLFSStore(std::move(sharedLFSStore)) {};
 
 	void WriteToGitDirectory(std::filesystem::path path, const std::string_view data) final;
+	std::expected<void, std::string>
+	AppendToGitDirectory(std::filesystem::path path, const std::string_view data) final;
+	std::expected<void, std::string>
+	WriteLFSObject(std::string_view oid, const std::string_view data) final;
 
-	void SaveLastWrittenRevision(long int rev);
+	/// Send everything written so far to fast-import, and the appended files to disk.
+	std::expected<void, std::string> Flush();
 
-	std::expected<std::optional<long int>, std::string> GetLastWrittenRevision();
+	/// Ask fast-import to write out everything so far (packs, refs and marks), and wait until it
+	/// has, so the commits are visible in the repository.
+	bool Checkpoint();
 
-	bool Flush();
+	/// Add the commits written so far to the branch index. Only call it once fast-import has
+	/// confirmed them, after Checkpoint() or once it has exited successfully, so the index never
+	/// lists a commit the repository doesn't have.
+	std::expected<void, std::string> WriteBranchIndex();
 
 private:
 	void Write(std::string_view content) final;
+	std::expected<void, std::string>
+	AppendToFile(const std::filesystem::path& path, const std::string_view data);
 
 	FILE* mInput;
+	FILE* mOutput;
+	long int mCheckpoints = 0;
 	std::filesystem::path mRoot;
+	std::optional<std::filesystem::path> mSharedLFSStore;
+	/// Files appended to, kept open for the whole run and flushed with Flush()
+	std::map<std::filesystem::path, std::ofstream> mAppendedFiles;
+	/// Branch index lines held back until WriteBranchIndex()
+	std::string mUnconfirmedBranchIndex;
+	/// Objects already known to be in this repository's LFS store, so they aren't checked again
+	std::unordered_set<std::string> mStoredObjects;
 };
 
+/// The resume marker: every revision up to and including this one is in the repository at
+/// `gitRoot`.
+void SaveLastWrittenRevision(const std::filesystem::path& gitRoot, long int rev);
+
+std::expected<std::optional<long int>, std::string>
+GetLastWrittenRevision(const std::filesystem::path& gitRoot);
+
+/// The revisions the branch index records as writing to any of `branches`, in order.
+std::expected<std::vector<long int>, std::string>
+GetBranchRevisions(const std::filesystem::path& gitRoot, std::span<const std::string> branches);
+
+/// The branch each revision in the branch index wrote to. Revisions that wrote to more than one
+/// branch map to an empty string.
+std::expected<std::unordered_map<long int, std::string>, std::string>
+GetRevisionBranches(const std::filesystem::path& gitRoot);
+
+/// The branch of each commit in the last `maxBytes` of the branch index, oldest first. Empty if
+/// there is no index yet.
+std::expected<std::vector<std::string>, std::string>
+GetRecentBranchCommits(const std::filesystem::path& gitRoot, size_t maxBytes);
+
 class FastImportBuffer : public IFastImport
 {
 public:
 	FastImportBuffer();
 
 	void WriteToGitDirectory(std::filesystem::path path, const std::string_view data) final;
+	std::expected<void, std::string>
+	AppendToGitDirectory(std::filesystem::path path, const std::string_view data) final;
+	std::expected<void, std::string>
+	WriteLFSObject(std::string_view oid, const std::string_view data) final;
 
 	const std::string& GetBuffer() const { return mBuffer; };
 